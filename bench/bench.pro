@@ -0,0 +1,11 @@
+# Stage benchmarks on synthetic inputs: cd bench && qmake && make && ./bench
+# Regression check against the goldens in golden/: ./bench --check golden
+TEMPLATE = app
+TARGET = bench
+DEPENDPATH += .
+INCLUDEPATH += .
+
+include(../sources.pri)
+
+# Input
+SOURCES += ../src/bench.cpp
@@ -0,0 +1,16 @@
+# Everything but main(), shared by the renderer and the benchmark
+INCLUDEPATH += $$PWD
+INCLUDEPATH += $$PWD/../libosmium/include
+LIBS += -lz -lproj -lopencv_highgui -lopencv_core -lopencv_imgproc
+
+QMAKE_CXXFLAGS += -std=c++14 -g
+
+SOURCES += $$PWD/src/common.cpp $$PWD/src/osm_main.cpp $$PWD/src/osm_roads.cpp $$PWD/src/srtm.cpp \
+    $$PWD/src/osm_rail.cpp $$PWD/src/osm_places.cpp $$PWD/src/osm_rivers.cpp $$PWD/src/osm_forests.cpp \
+    $$PWD/src/compositor.cpp $$PWD/src/png_writer.cpp $$PWD/src/mosaic.cpp \
+    $$PWD/src/scheduler.cpp $$PWD/src/options.cpp $$PWD/src/memory.cpp $$PWD/src/image_writer.cpp \
+    $$PWD/src/grid.cpp $$PWD/src/render.cpp $$PWD/src/layers.cpp $$PWD/src/tile_cache.cpp $$PWD/src/osm_common.cpp \
+    $$PWD/src/osm_changes.cpp $$PWD/src/tile_server.cpp $$PWD/src/trace.cpp \
+    $$PWD/src/metrics.cpp $$PWD/src/heap_profile.cpp $$PWD/src/simplify.cpp $$PWD/src/rtree.cpp $$PWD/src/clip.cpp \
+    $$PWD/src/partition.cpp $$PWD/src/run_journal.cpp $$PWD/src/dem_smooth.cpp $$PWD/src/dem_mosaic.cpp \
+    $$PWD/src/geometry_arena.cpp
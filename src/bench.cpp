@@ -0,0 +1,887 @@
+/*
+ * Times the stages of rendering a tile on synthetic inputs: a PBF extract
+ * and SRTM cells generated from a fixed seed, so runs are comparable
+ * between commits and machines with the same flags.
+ *
+ * Usage: bench [--dir DIR] [--density N] [--image-size PX] [--iterations N] [--filter TEXT] [--memory]
+ *        bench --check GOLDEN [--update-golden] [--actual DIR] [--margin FRACTION]
+ *
+ * The second form is the regression check: it renders a fixed row of small
+ * tiles, compares every layer against the golden images in GOLDEN and the
+ * stage times against GOLDEN/budgets.txt, and exits with 1 on any mismatch,
+ * missing goldens included. The layers that differ are written to DIR,
+ * GOLDEN/actual by default. The goldens are kept in bench/golden, so from
+ * bench/ the check is ./bench --check golden. --update-golden rewrites them
+ * from the current tree; run it on the reference machine after an intended
+ * change of the output and commit the result. The check also plans the
+ * row as a partition, renders it with two forked workers, merges it and
+ * compares their tiles with the ones rendered directly.
+ *
+ * The dem-smooth-* stages time every DEM smoothing mode, and the run ends
+ * with how far each one's heights and gradients are from cv::bilateralFilter.
+ * The hills-mosaic stages read the DEM from a mosaic built from the cells.
+ * elevation-sample interpolates the height under every node of the extract.
+ *
+ * --memory adds the heap high-water mark of every stage to the table and
+ * ends with the heap profile of the trace spans the runs went through.
+ */
+#include "common.h"
+#include "compositor.h"
+#include "grid.h"
+#include "layers.h"
+#include "osm_forests.h"
+#include "osm_main.h"
+#include "osm_places.h"
+#include "osm_rail.h"
+#include "osm_rivers.h"
+#include "osm_roads.h"
+#include "partition.h"
+#include "png_writer.h"
+#include "render.h"
+#include "heap_profile.h"
+#include "srtm.h"
+#include "trace.h"
+
+#include <QImage>
+#include <QPainterPath>
+#include <QString>
+
+#include <osmium/builder/attr.hpp>
+#include <osmium/io/pbf_output.hpp>
+#include <osmium/io/writer.hpp>
+#include <osmium/memory/buffer.hpp>
+
+#include "opencv2/core/core.hpp"
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+    const double CENTER_LON = 43.739319;
+    const double CENTER_LAT = 56.162759;
+    const double TILE_SIZE = 25000;
+    const int HGT_SIZE = 3601;
+    const unsigned SEED = 20160101;
+    const size_t WRITE_BUFFER_SIZE = 1 << 20;
+
+    // Results are stored here so the compiler can't drop the loops that compute them
+    volatile double sink;
+
+    struct Settings {
+        std::string dir = "bench-data";
+        int density = 4;
+        int imageSize = 1200;
+        int iterations = 5;
+        std::string filter;
+        bool memory = false;
+        std::string golden;
+        // Where the layers that differ from their goldens go, GOLDEN/actual when empty
+        std::string actual;
+        bool updateGolden = false;
+        // Fraction a stage may exceed its budget by
+        double margin = 0.5;
+    };
+
+    void usage(const char* name) {
+        std::cerr << "Usage: " << name << " [options]\n"
+                  << "Options:\n"
+                  << "  --dir DIR       where the synthetic inputs are generated (default: bench-data)\n"
+                  << "  --density N     feature density of the synthetic extract (default: 4)\n"
+                  << "  --image-size PX tile side in pixels (default: 1200)\n"
+                  << "  --iterations N  timed runs per stage (default: 5)\n"
+                  << "  --filter TEXT   only run the stages whose name contains TEXT\n"
+                  << "  --memory        also report the heap high-water mark of every stage\n"
+                  << "  --check DIR     compare layers and stage times against the goldens in DIR instead\n"
+                  << "  --update-golden with --check, rewrite the goldens from this tree\n"
+                  << "  --actual DIR    with --check, where the layers that differ are written (default: GOLDEN/actual)\n"
+                  << "  --margin F      with --check, fraction a stage may exceed its budget by (default: 0.5)\n";
+        exit(1);
+    }
+
+    int toInt(const std::string& value, const char* name) {
+        try {
+            size_t end;
+            int result = std::stoi(value, &end);
+            if (end == value.size() && result > 0)
+                return result;
+        } catch (const std::exception&) {}
+        usage(name);
+        return 0;
+    }
+
+    Settings parseSettings(int argc, char* argv[]) {
+        Settings settings;
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--update-golden") {
+                settings.updateGolden = true;
+                continue;
+            }
+            if (arg == "--memory") {
+                settings.memory = true;
+                continue;
+            }
+            if (i + 1 >= argc)
+                usage(argv[0]);
+            std::string value = argv[++i];
+            if (arg == "--dir")
+                settings.dir = value;
+            else if (arg == "--density")
+                settings.density = toInt(value, argv[0]);
+            else if (arg == "--image-size")
+                settings.imageSize = toInt(value, argv[0]);
+            else if (arg == "--iterations")
+                settings.iterations = toInt(value, argv[0]);
+            else if (arg == "--filter")
+                settings.filter = value;
+            else if (arg == "--check")
+                settings.golden = value;
+            else if (arg == "--actual")
+                settings.actual = value;
+            else if (arg == "--margin")
+                try {
+                    settings.margin = std::stod(value);
+                } catch (const std::exception&) {
+                    usage(argv[0]);
+                }
+            else
+                usage(argv[0]);
+        }
+        if ((settings.updateGolden || !settings.actual.empty()) && settings.golden.empty())
+            usage(argv[0]);
+        return settings;
+    }
+
+    // Smooth hills with some roughness, continuous across cell borders
+    double terrain(double lon, double lat, std::mt19937& random) {
+        std::uniform_real_distribution<double> noise(-2, 2);
+        return 150 + 60 * std::sin(lon * 40) * std::cos(lat * 50) + 25 * std::sin(lon * 170 + lat * 130) + noise(random);
+    }
+
+    void writeCell(int x, int y, const std::string& filename) {
+        std::mt19937 random(SEED + x * 1000 + y);
+        std::vector<unsigned char> row(HGT_SIZE * 2);
+        std::ofstream file(filename, std::ios::out|std::ios::binary|std::ios::trunc);
+        for (int i = 0; i < HGT_SIZE; i++) {
+            double lat = y + 1 - double(i) / (HGT_SIZE - 1);
+            for (int j = 0; j < HGT_SIZE; j++) {
+                double lon = x + double(j) / (HGT_SIZE - 1);
+                int16_t height = std::lround(terrain(lon, lat, random));
+                row[2*j] = uint16_t(height) >> 8;
+                row[2*j + 1] = uint16_t(height) & 0xff;
+            }
+            file.write(reinterpret_cast<const char*>(row.data()), row.size());
+        }
+        if (!file) {
+            throw std::runtime_error("Can't write data to file " + filename);
+        }
+    }
+
+    // Cells covering the tile, generated once; the download script is replaced by a no-op
+    void generateCells(const Projector& proj, const MinMax& minmax) {
+        mkdir("srtm", 0755);
+        {
+            std::ofstream script("download_srtm.sh");
+            script << "#!/bin/sh\n";
+        }
+        chmod("download_srtm.sh", 0755);
+        point min = proj.invertTransform({minmax.minx, minmax.miny});
+        point max = proj.invertTransform({minmax.maxx, minmax.maxy});
+        for (int x = std::floor(min.x); x <= std::floor(max.x); x++) {
+            for (int y = std::floor(min.y); y <= std::floor(max.y); y++) {
+                std::string filename = SRTMProvider::cellFile(x, y);
+                struct stat info;
+                if (stat(filename.c_str(), &info) == 0)
+                    continue;
+                std::cout << "Generating " << filename << std::endl;
+                writeCell(x, y, filename);
+            }
+        }
+    }
+
+    struct Extract {
+        std::string filename;
+        std::vector<point> nodes;
+        size_t ways = 0;
+    };
+
+    /*
+     * Roads, railways and rivers are random walks, forests, water and
+     * places closed rings that become areas; their number scales with
+     * density.
+     */
+    Extract generateExtract(const Projector& proj, const MinMax& minmax, int density) {
+        Extract extract;
+        extract.filename = "synthetic-" + std::to_string(density) + ".osm.pbf";
+        std::mt19937 random(SEED + density);
+        std::uniform_real_distribution<double> unit(0, 1);
+        double width = minmax.maxx - minmax.minx, height = minmax.maxy - minmax.miny;
+
+        struct Way {
+            std::vector<osmium::object_id_type> nodes;
+            const char* key;
+            const char* value;
+        };
+        std::vector<Way> ways;
+        auto addNode = [&](double x, double y) {
+            extract.nodes.push_back(proj.invertTransform({x, y}));
+            return osmium::object_id_type(extract.nodes.size());
+        };
+        auto addWalk = [&](int count, int length, double step, const char* key, std::vector<const char*> values) {
+            for (int i = 0; i < count; i++) {
+                Way way{{}, key, values[i % values.size()]};
+                double x = minmax.minx + unit(random) * width, y = minmax.miny + unit(random) * height;
+                double heading = unit(random) * 2 * M_PI;
+                for (int j = 0; j < length; j++) {
+                    way.nodes.push_back(addNode(x, y));
+                    heading += (unit(random) - 0.5) * 0.6;
+                    x += step * std::cos(heading);
+                    y += step * std::sin(heading);
+                }
+                ways.push_back(way);
+            }
+        };
+        auto addRing = [&](int count, double minRadius, double maxRadius, const char* key, std::vector<const char*> values) {
+            for (int i = 0; i < count; i++) {
+                Way way{{}, key, values[i % values.size()]};
+                double cx = minmax.minx + unit(random) * width, cy = minmax.miny + unit(random) * height;
+                double radius = minRadius + unit(random) * (maxRadius - minRadius);
+                int vertices = 24 + random() % 16;
+                for (int j = 0; j < vertices; j++) {
+                    double angle = 2 * M_PI * j / vertices;
+                    double r = radius * (0.7 + 0.3 * unit(random));
+                    way.nodes.push_back(addNode(cx + r * std::cos(angle), cy + r * std::sin(angle)));
+                }
+                way.nodes.push_back(way.nodes.front());
+                ways.push_back(way);
+            }
+        };
+        addWalk(40 * density, 40, 150, "highway", {"primary", "secondary", "tertiary", "unclassified", "trunk"});
+        addWalk(2 * density, 60, 200, "railway", {"rail"});
+        addWalk(3 * density, 80, 120, "waterway", {"river", "canal"});
+        addRing(15 * density, 300, 1500, "landuse", {"forest"});
+        addRing(4 * density, 200, 800, "natural", {"water"});
+        addRing(10 * density, 150, 600, "place", {"village", "hamlet"});
+        extract.ways = ways.size();
+
+        using namespace osmium::builder::attr;
+        osmium::io::Header header;
+        header.set("generator", "drawmap bench");
+        osmium::io::Writer writer(osmium::io::File(extract.filename, "pbf"), header, osmium::io::overwrite::allow);
+        osmium::memory::Buffer buffer(WRITE_BUFFER_SIZE, osmium::memory::Buffer::auto_grow::yes);
+        auto flush = [&](bool force) {
+            if (buffer.committed() >= WRITE_BUFFER_SIZE || (force && buffer.committed() != 0)) {
+                writer(std::move(buffer));
+                buffer = osmium::memory::Buffer(WRITE_BUFFER_SIZE, osmium::memory::Buffer::auto_grow::yes);
+            }
+        };
+        for (size_t i = 0; i < extract.nodes.size(); i++) {
+            osmium::builder::add_node(buffer, _id(osmium::object_id_type(i + 1)), _version(1),
+                                      _timestamp("2016-01-01T00:00:00Z"),
+                                      _location(extract.nodes[i].x, extract.nodes[i].y));
+            flush(false);
+        }
+        for (size_t i = 0; i < ways.size(); i++) {
+            osmium::builder::add_way(buffer, _id(osmium::object_id_type(i + 1)), _version(1),
+                                     _timestamp("2016-01-01T00:00:00Z"), _nodes(ways[i].nodes),
+                                     _tag(ways[i].key, ways[i].value));
+            flush(false);
+        }
+        flush(true);
+        writer.close();
+        return extract;
+    }
+
+    // Forwards to a handler, adding up the time spent in its callbacks
+    class TimedHandler: public BaseHandler {
+    public:
+        TimedHandler(BaseHandler& inner_) :
+            inner(inner_),
+            seconds(0),
+            objects(0) {}
+
+        virtual void way(const osmium::Way& way) {
+            auto start = std::chrono::steady_clock::now();
+            inner.way(way);
+            add(start);
+        }
+
+        virtual void area(const osmium::Area& area) {
+            auto start = std::chrono::steady_clock::now();
+            inner.area(area);
+            add(start);
+        }
+
+        double getSeconds() const {
+            return seconds;
+        }
+
+        size_t getObjects() const {
+            return objects;
+        }
+
+    private:
+        void add(std::chrono::steady_clock::time_point start) {
+            seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            objects++;
+        }
+
+        BaseHandler& inner;
+        double seconds;
+        size_t objects;
+    };
+
+    class Bench {
+    public:
+        explicit Bench(const Settings& settings_) :
+            settings(settings_) {
+            std::cout << std::left << std::setw(28) << "stage" << std::right << std::setw(6) << "runs"
+                      << std::setw(12) << "min ms" << std::setw(12) << "median ms" << std::setw(16) << "throughput";
+            if (settings.memory)
+                std::cout << std::setw(25) << "heap MB";
+            std::cout << std::endl;
+        }
+
+        bool enabled(const std::string& name) const {
+            return name.find(settings.filter) != std::string::npos;
+        }
+
+        // Times run() as a whole; work is what one run processes, in unit
+        void measure(const std::string& name, double work, const std::string& unit, std::function<void()> run) {
+            if (!enabled(name))
+                return;
+            std::vector<double> samples;
+            int64_t heapPeak = 0;
+            for (int i = 0; i < settings.iterations; i++) {
+                heap::Probe probe;
+                probe.start();
+                auto start = std::chrono::steady_clock::now();
+                run();
+                samples.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+                heapPeak = std::max(heapPeak, probe.finish().heapPeak);
+            }
+            report(name, samples, work, unit, heapPeak);
+        }
+
+        int getIterations() const {
+            return settings.iterations;
+        }
+
+        // heapPeak is the largest heap high-water mark of the runs, shown with --memory
+        void report(const std::string& name, std::vector<double> samples, double work, const std::string& unit,
+                    int64_t heapPeak) {
+            std::sort(samples.begin(), samples.end());
+            double min = samples.front(), median = samples[samples.size() / 2];
+            std::string throughput = unit + "/s";
+            std::cout << std::left << std::setw(28) << name << std::right << std::setw(6) << samples.size()
+                      << std::fixed << std::setprecision(2)
+                      << std::setw(12) << min * 1000 << std::setw(12) << median * 1000
+                      << std::setprecision(0) << std::setw(16) << (median > 0 ? work / median : 0) << " ";
+            if (settings.memory)
+                std::cout << std::left << std::setw(12) << throughput << std::right
+                          << std::setprecision(1) << std::setw(12) << heapPeak / double(1 << 20);
+            else
+                std::cout << throughput;
+            std::cout << std::endl;
+        }
+
+    private:
+        Settings settings;
+    };
+
+    // Height and gradient differences of smoothed from reference, the gradients being what the hills are drawn from
+    std::string smoothingError(const cv::Mat& smoothed, const cv::Mat& reference) {
+        cv::Mat xGrad, yGrad, xReference, yReference;
+        SRTMtoCV::gradients(smoothed, xGrad, yGrad);
+        SRTMtoCV::gradients(reference, xReference, yReference);
+        cv::Mat heights = smoothed - reference;
+        double maxHeight;
+        cv::minMaxLoc(cv::abs(heights), nullptr, &maxHeight);
+        double heightRms = std::sqrt(cv::mean(heights.mul(heights))[0]);
+        cv::Mat dx = xGrad - xReference, dy = yGrad - yReference;
+        double gradientRms = std::sqrt(cv::mean(dx.mul(dx) + dy.mul(dy))[0]);
+        double referenceRms = std::sqrt(cv::mean(xReference.mul(xReference) + yReference.mul(yReference))[0]);
+        std::ostringstream result;
+        result << std::fixed << std::setprecision(2) << "heights rms " << heightRms << " m, max " << maxHeight
+               << " m; gradients rms " << std::setprecision(1) << (referenceRms > 0 ? 100 * gradientRms / referenceRms : 0)
+               << "% of theirs";
+        return result.str();
+    }
+
+    // Runs handler over the store, timing its way/area callbacks and then finalize
+    template<class Handler>
+    void measureHandler(Bench& bench, const std::string& name, const FeatureStore& store, double pixels,
+                        std::function<Handler*()> make) {
+        if (!bench.enabled("handler-" + name))
+            return;
+        size_t objects = 0;
+        std::vector<double> callbacks, finalizes;
+        int64_t callbacksHeap = 0, finalizeHeap = 0;
+        for (int i = 0; i < bench.getIterations(); i++) {
+            heap::Probe probe;
+            probe.start();
+            std::unique_ptr<Handler> handler(make());
+            TimedHandler timed(*handler);
+            OsmDrawer drawer;
+            drawer.addHandler(&timed);
+            drawer.dispatch(store);
+            callbacks.push_back(timed.getSeconds());
+            objects = timed.getObjects();
+            heap::Probe finalizeProbe;
+            finalizeProbe.start();
+            auto start = std::chrono::steady_clock::now();
+            handler->finalize();
+            finalizes.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            finalizeHeap = std::max(finalizeHeap, finalizeProbe.finish().heapPeak);
+            callbacksHeap = std::max(callbacksHeap, probe.finish().heapPeak);
+        }
+        bench.report("handler-" + name, callbacks, objects, "objects", callbacksHeap);
+        bench.report("handler-" + name + "-finalize", finalizes, pixels, "pixels", finalizeHeap);
+    }
+}
+
+namespace {
+    // Fixed, so the goldens stay valid whatever the other flags are
+    const int CHECK_DENSITY = 4;
+    const int CHECK_IMAGE_SIZE = 256;
+    const int CHECK_TILES = 3;
+    const int CHECK_RUNS = 3;
+    const int CHECK_WORKERS = 2;
+    // Largest channel difference after a 3x3 blur that still counts as the same pixel
+    const int PIXEL_TOLERANCE = 24;
+    const double MAX_DIFFERENT_PIXELS = 0.002;
+
+    // Premultiplied RGBA of a pixel averaged over its 3x3 neighbourhood, so antialiasing shifts are tolerated
+    void blurredPixel(const QImage& image, int x, int y, int* channels) {
+        int sum[4] = {0, 0, 0, 0}, count = 0;
+        for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, image.height() - 1); ny++) {
+            const QRgb* line = reinterpret_cast<const QRgb*>(image.constScanLine(ny));
+            for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, image.width() - 1); nx++) {
+                QRgb pixel = line[nx];
+                sum[0] += qRed(pixel);
+                sum[1] += qGreen(pixel);
+                sum[2] += qBlue(pixel);
+                sum[3] += qAlpha(pixel);
+                count++;
+            }
+        }
+        for (int i = 0; i < 4; i++)
+            channels[i] = sum[i] / count;
+    }
+
+    // Fraction of pixels that differ noticeably, 1 if the sizes don't match
+    double difference(const QImage& actual, const QImage& expected) {
+        if (actual.width() != expected.width() || actual.height() != expected.height())
+            return 1;
+        QImage a = actual.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+        QImage b = expected.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+        size_t different = 0;
+        for (int y = 0; y < a.height(); y++) {
+            for (int x = 0; x < a.width(); x++) {
+                int ca[4], cb[4];
+                blurredPixel(a, x, y, ca);
+                blurredPixel(b, x, y, cb);
+                for (int i = 0; i < 4; i++) {
+                    if (std::abs(ca[i] - cb[i]) > PIXEL_TOLERANCE) {
+                        different++;
+                        break;
+                    }
+                }
+            }
+        }
+        return double(different) / (double(a.width()) * a.height());
+    }
+
+    std::map<std::string, double> readBudgets(const std::string& filename) {
+        std::map<std::string, double> budgets;
+        std::ifstream file(filename);
+        std::string stage;
+        double ms;
+        while (file >> stage >> ms)
+            budgets[stage] = ms;
+        return budgets;
+    }
+
+    /*
+     * Plans the check row in a partition directory, renders it with
+     * CHECK_WORKERS forked workers of one thread each, so they contend for
+     * the claims, merges it and compares every tile with the direct render
+     * in tiles. The grid is the check grid around center. Returns the number
+     * of failed checks.
+     */
+    int checkPartition(const Projector& proj, const Grid& grid, point center, const Extract& extract,
+                       const std::map<std::string, QImage>& tiles) {
+        const std::string dir = "partition-check";
+        Options options;
+        options.osmFile = extract.filename;
+        point lonLat = proj.invertTransform(center);
+        options.centerLon = lonLat.x;
+        options.centerLat = lonLat.y;
+        options.tileSize = grid.getTileSize();
+        options.tiles = CHECK_TILES;
+        options.imageSize = CHECK_IMAGE_SIZE;
+        options.jobs = 1;
+        options.memoryBudget = 0;
+        options.output = dir + "/merged.png";
+        TileRange range = {0, CHECK_TILES - 1, CHECK_TILES / 2, CHECK_TILES / 2};
+        partition::plan(options, dir, range);
+
+        int failures = 0;
+        std::vector<pid_t> workers;
+        for (int i = 0; i < CHECK_WORKERS; i++) {
+            pid_t pid = fork();
+            if (pid < 0)
+                throw std::runtime_error("Can't fork a partition worker");
+            if (pid == 0) {
+                int failed = 1;
+                try {
+                    failed = partition::work(options, proj, dir);
+                } catch (const std::exception& e) {
+                    std::cerr << e.what() << std::endl;
+                }
+                _exit(failed ? 1 : 0);
+            }
+            workers.push_back(pid);
+        }
+        for (pid_t pid: workers) {
+            int status = 0;
+            bool ok = waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            std::cout << (ok ? "ok   " : "FAIL ") << "partition worker " << pid << std::endl;
+            if (!ok)
+                failures++;
+        }
+        try {
+            partition::merge(options, dir);
+        } catch (const std::exception& e) {
+            std::cout << "FAIL partition merge: " << e.what() << std::endl;
+            return failures + 1;
+        }
+        for (int x = range.minX; x <= range.maxX; x++) {
+            std::string name = "tile" + std::to_string(x) + "-" + std::to_string(range.minY);
+            QImage rendered;
+            rendered.load(QString::fromStdString(dir + "/tiles/" + Grid::tileFileName(x, range.minY)));
+            double different = difference(rendered, tiles.at(name));
+            bool ok = different <= MAX_DIFFERENT_PIXELS;
+            std::cout << (ok ? "ok   " : "FAIL ") << "partition " << name << ": " << std::setprecision(3)
+                      << different * 100 << "% pixels differ from the direct render" << std::endl;
+            if (!ok)
+                failures++;
+        }
+        return failures;
+    }
+
+    /*
+     * Renders a row of small tiles in the middle of the synthetic extract
+     * CHECK_RUNS times, keeping each stage's fastest total from the trace,
+     * and checks or rewrites the goldens. Returns the exit code.
+     */
+    int checkGolden(const Settings& settings, const Projector& proj, const Grid& region) {
+        MinMax regionMinMax = region.tileMinMax(0, 0);
+        generateCells(proj, regionMinMax);
+        Extract extract = generateExtract(proj, regionMinMax, CHECK_DENSITY);
+        point center = {(regionMinMax.minx + regionMinMax.maxx) / 2, (regionMinMax.miny + regionMinMax.maxy) / 2};
+        Grid grid(center, region.getTileSize() / 4, CHECK_TILES, CHECK_IMAGE_SIZE);
+
+        trace::enable(true);
+        std::map<std::string, QImage> images;
+        std::map<std::string, QImage> tiles;
+        std::map<std::string, int64_t> fastest;
+        for (int run = 0; run < CHECK_RUNS; run++) {
+            trace::clear();
+            for (int x = 0; x < CHECK_TILES; x++) {
+                int y = CHECK_TILES / 2;
+                auto layers = drawLayers(extract.filename, proj, grid.tileMinMax(x, y), CHECK_IMAGE_SIZE, x, y);
+                std::vector<QImage> ordered;
+                for (auto layer: allLayers()) {
+                    const auto& parts = layers[layer];
+                    images["tile" + std::to_string(x) + "-" + std::to_string(y) + "-" + layerName(layer)] =
+                            parts.size() == 1 ? parts[0] : composite(parts, 1);
+                    ordered.insert(ordered.end(), parts.begin(), parts.end());
+                }
+                QImage tile;
+                {
+                    TRACE_SCOPE("composite");
+                    tile = composite(ordered);
+                }
+                tiles["tile" + std::to_string(x) + "-" + std::to_string(y)] = tile;
+                TRACE_SCOPE("png.encode");
+                encodePng(tile);
+            }
+            for (const auto& stage: trace::totals())
+                if (run == 0 || stage.second < fastest[stage.first])
+                    fastest[stage.first] = stage.second;
+        }
+        trace::enable(false);
+
+        std::string budgetFile = settings.golden + "/budgets.txt";
+        if (settings.updateGolden) {
+            mkdir(settings.golden.c_str(), 0755);
+            for (const auto& image: images)
+                savePng(image.second, settings.golden + "/" + image.first + ".png");
+            std::ofstream budgets(budgetFile);
+            for (const auto& stage: fastest)
+                budgets << stage.first << " " << std::fixed << std::setprecision(1) << stage.second / 1000.0 << "\n";
+            if (!budgets) {
+                throw std::runtime_error("Can't write data to file " + budgetFile);
+            }
+            std::cout << "Wrote " << images.size() << " golden images and " << fastest.size() << " budgets to "
+                      << settings.golden << std::endl;
+            return 0;
+        }
+
+        int failures = 0;
+        std::string actualDir = settings.actual.empty() ? settings.golden + "/actual" : settings.actual;
+        for (const auto& image: images) {
+            QImage expected;
+            std::string filename = settings.golden + "/" + image.first + ".png";
+            if (!expected.load(QString::fromStdString(filename))) {
+                std::cout << "FAIL " << image.first << ": no golden " << filename << std::endl;
+                failures++;
+                continue;
+            }
+            double different = difference(image.second, expected);
+            bool ok = different <= MAX_DIFFERENT_PIXELS;
+            std::cout << (ok ? "ok   " : "FAIL ") << image.first << ": " << std::setprecision(3)
+                      << different * 100 << "% pixels differ" << std::endl;
+            if (!ok) {
+                mkdir(actualDir.c_str(), 0755);
+                savePng(image.second, actualDir + "/" + image.first + ".png");
+                failures++;
+            }
+        }
+        auto budgets = readBudgets(budgetFile);
+        if (budgets.empty()) {
+            std::cout << "FAIL budgets: no stage budgets in " << budgetFile << std::endl;
+            failures++;
+        }
+        for (const auto& budget: budgets) {
+            auto stage = fastest.find(budget.first);
+            if (stage == fastest.end()) {
+                std::cout << "skip " << budget.first << ": stage didn't run" << std::endl;
+                continue;
+            }
+            double ms = stage->second / 1000.0;
+            bool ok = ms <= budget.second * (1 + settings.margin);
+            std::cout << (ok ? "ok   " : "FAIL ") << budget.first << ": " << std::fixed << std::setprecision(1)
+                      << ms << " ms, budget " << budget.second << " ms" << std::endl;
+            if (!ok)
+                failures++;
+        }
+        failures += checkPartition(proj, grid, center, extract, tiles);
+        if (failures)
+            std::cout << "Layers that differ are in " << actualDir << "; after an intended change, rerun with --update-golden"
+                      << std::endl;
+        std::cout << (failures ? "FAILED: " + std::to_string(failures) + " checks" : std::string("PASSED")) << std::endl;
+        return failures ? 1 : 0;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    cv::setNumThreads(0);
+    Settings settings = parseSettings(argc, argv);
+    // Relative to where bench was started, not to --dir
+    for (std::string* path: {&settings.golden, &settings.actual}) {
+        char cwd[4096];
+        if (!path->empty() && (*path)[0] != '/' && getcwd(cwd, sizeof(cwd)))
+            *path = std::string(cwd) + "/" + *path;
+    }
+    mkdir(settings.dir.c_str(), 0755);
+    if (chdir(settings.dir.c_str()) != 0) {
+        std::cerr << "Can't enter " << settings.dir << std::endl;
+        return 1;
+    }
+
+    Projector proj;
+    point center = proj.transform({CENTER_LON, CENTER_LAT});
+    Grid grid(center, TILE_SIZE, 1, settings.imageSize);
+    MinMax minmax = grid.tileMinMax(0, 0);
+    if (!settings.golden.empty())
+        return checkGolden(settings, proj, grid);
+    const int imageSize = settings.imageSize;
+    const double pixels = double(imageSize) * imageSize;
+
+    generateCells(proj, minmax);
+    Extract extract = generateExtract(proj, minmax, settings.density);
+    std::cout << extract.filename << ": " << extract.nodes.size() << " nodes, " << extract.ways << " ways" << std::endl;
+
+    trace::profileMemory(settings.memory);
+    Bench bench(settings);
+    const double nodes = extract.nodes.size();
+
+    bench.measure("pbf-dispatch", nodes, "nodes", [&] {
+        OsmDrawer drawer;
+        drawer.dispatch(extract.filename);
+    });
+    std::unique_ptr<FeatureStore> store;
+    bench.measure("feature-store", nodes, "nodes", [&] {
+        store.reset(new FeatureStore(extract.filename, proj));
+    });
+    if (!store)
+        store.reset(new FeatureStore(extract.filename, proj));
+    bench.measure("feature-query", store->getIndex().size(), "features", [&] {
+        sink = store->getIndex().query(minmax).size();
+    });
+
+    bench.measure("projection", nodes, "points", [&] {
+        double sum = 0;
+        for (const auto& node: extract.nodes)
+            sum += proj.transform(node).x;
+        sink = sum;
+    });
+
+    std::vector<std::string> cells = SRTMtoCV::cellFiles(proj, minmax);
+    point minCell = proj.invertTransform({minmax.minx, minmax.miny});
+    bench.measure("srtm-load", cells.size(), "cells", [&] {
+        SRTMProvider provider(proj);
+        point max = proj.invertTransform({minmax.maxx, minmax.maxy});
+        for (int x = std::floor(minCell.x); x <= std::floor(max.x); x++)
+            for (int y = std::floor(minCell.y); y <= std::floor(max.y); y++)
+                provider.getHeights(x, y);
+    });
+
+    SRTMProvider dem(proj);
+    const auto& heights = dem.getHeights(std::floor(minCell.x), std::floor(minCell.y));
+    bench.measure("elevation-sample", nodes, "points", [&] {
+        std::vector<float> elevations = dem.sample(extract.nodes);
+        sink = elevations.size();
+    });
+    cv::Mat source(HGT_SIZE, HGT_SIZE, CV_32FC1);
+    for (int x = 0; x < HGT_SIZE; x++)
+        for (int y = 0; y < HGT_SIZE; y++)
+            source.at<float>(y, x) = heights[x][y];
+    const double cellPixels = double(HGT_SIZE) * HGT_SIZE;
+    cv::Mat smoothed = SRTMtoCV::smooth(source);
+    bench.measure("dem-smooth", cellPixels, "pixels", [&] {
+        SRTMtoCV::smooth(source);
+    });
+    // Every smoothing mode against the single-threaded filter they replace
+    cv::Mat reference;
+    cv::bilateralFilter(source, reference, -1, 10, 5);
+    bench.measure("dem-smooth-reference", cellPixels, "pixels", [&] {
+        cv::Mat result;
+        cv::bilateralFilter(source, result, -1, 10, 5);
+    });
+    std::vector<std::string> smoothingErrors;
+    for (auto mode: {DemSmoothing::BILATERAL, DemSmoothing::GUIDED, DemSmoothing::FAST}) {
+        std::string name = "dem-smooth-" + demSmooth::name(mode);
+        if (!bench.enabled(name))
+            continue;
+        bench.measure(name, cellPixels, "pixels", [&] {
+            demSmooth::apply(source, mode);
+        });
+        smoothingErrors.push_back(name + ": " + smoothingError(demSmooth::apply(source, mode), reference));
+    }
+    bench.measure("dem-gradients", cellPixels, "pixels", [&] {
+        cv::Mat xGrad, yGrad;
+        SRTMtoCV::gradients(smoothed, xGrad, yGrad);
+    });
+    std::unique_ptr<SRTMtoCV> hills;
+    bench.measure("hills", pixels, "pixels", [&] {
+        hills.reset(new SRTMtoCV(dem, proj, minmax, imageSize));
+    });
+    if (!hills)
+        hills.reset(new SRTMtoCV(dem, proj, minmax, imageSize));
+    bench.measure("hills-paint", pixels, "pixels", [&] {
+        cvPaint::paintGrads(hills->getXGrad(), hills->getYGrad());
+    });
+
+    // The same tile from a DEM mosaic of the cells, at full size and as an eighth-size preview
+    if (bench.enabled("hills-mosaic")) {
+        MinMax geo = SRTMtoCV::geoBounds(proj, minmax);
+        DemMosaic::build("dem.mosaic", proj, std::floor(geo.minx), std::floor(geo.miny),
+                         std::floor(geo.maxx) + 1, std::floor(geo.maxy) + 1);
+        DemMosaic mosaic("dem.mosaic");
+        SRTMtoCV::setMosaic(&mosaic);
+        bench.measure("hills-mosaic", pixels, "pixels", [&] {
+            SRTMtoCV tile(dem, proj, minmax, imageSize);
+        });
+        bench.measure("hills-mosaic-preview", pixels / 64, "pixels", [&] {
+            SRTMtoCV tile(dem, proj, minmax, imageSize / 8);
+        });
+        SRTMtoCV::setMosaic(nullptr);
+    }
+
+    static const QPainterPath EMPTY;
+    measureHandler<OsmRoadsHandler>(bench, "roads", *store, pixels, [&] {
+        auto handler = new OsmRoadsHandler(proj, minmax, imageSize);
+        handler->setPlacesPath(EMPTY);
+        return handler;
+    });
+    measureHandler<OsmRailHandler>(bench, "rail", *store, pixels, [&] {
+        return new OsmRailHandler(proj, minmax, imageSize);
+    });
+    measureHandler<OsmPlacesHandler>(bench, "places", *store, pixels, [&] {
+        auto handler = new OsmPlacesHandler(proj, minmax, imageSize);
+        handler->setRoadsPath(EMPTY);
+        handler->setRailPath(EMPTY);
+        handler->setForestAreas(EMPTY);
+        return handler;
+    });
+    measureHandler<OsmRiversHandler>(bench, "rivers", *store, pixels, [&] {
+        return new OsmRiversHandler(proj, minmax, imageSize, 0, 0);
+    });
+    measureHandler<OsmForestsHandler>(bench, "forests", *store, pixels, [&] {
+        auto handler = new OsmForestsHandler(proj, minmax, imageSize, 0, 0);
+        handler->setHeights(hills->getCvHeights());
+        return handler;
+    });
+
+    QImage tile;
+    drawTile(&tile, extract.filename, proj, minmax, imageSize, 0, 0);
+    std::vector<QImage> layers(6, tile);
+    bench.measure("composite-6", pixels, "pixels", [&] {
+        composite(layers);
+    });
+    PngOptions png;
+    bench.measure("png-encode", pixels, "pixels", [&] {
+        encodePng(tile, png);
+    });
+    bench.measure("png-encode-fast", pixels, "pixels", [&] {
+        encodePng(tile, PngOptions::preset("fast"));
+    });
+
+    bench.measure("tile", 1, "tiles", [&] {
+        QImage image;
+        drawTile(&image, extract.filename, proj, minmax, imageSize, 0, 0);
+    });
+    // Hills alone, which reads neither the extract nor the forests' canopy
+    bench.measure("tile-hills", 1, "tiles", [&] {
+        QImage image;
+        drawTile(&image, extract.filename, proj, minmax, imageSize, 0, 0, nullptr, SharedInputs(), {Layer::HILLS});
+    });
+    SharedInputs shared;
+    shared.features = store.get();
+    shared.dem = &dem;
+    bench.measure("tile-resident", 1, "tiles", [&] {
+        QImage image;
+        drawTile(&image, extract.filename, proj, minmax, imageSize, 0, 0, nullptr, shared);
+    });
+
+    if (!smoothingErrors.empty()) {
+        std::cout << std::endl << "DEM smoothing against cv::bilateralFilter:" << std::endl;
+        for (const auto& line: smoothingErrors)
+            std::cout << "  " << line << std::endl;
+    }
+    if (settings.memory) {
+        std::cout << std::endl;
+        heap::report(std::cout);
+    }
+    return 0;
+}
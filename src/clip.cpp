@@ -0,0 +1,157 @@
+#include "clip.h"
+
+#include <algorithm>
+
+namespace {
+    enum class Edge { LEFT, RIGHT, TOP, BOTTOM };
+
+    struct Bounds {
+        double minx, miny, maxx, maxy;
+    };
+
+    Bounds bounds(const QPointF* points, size_t count) {
+        Bounds result = {points[0].x(), points[0].y(), points[0].x(), points[0].y()};
+        for (size_t i = 1; i < count; i++) {
+            result.minx = std::min(result.minx, points[i].x());
+            result.maxx = std::max(result.maxx, points[i].x());
+            result.miny = std::min(result.miny, points[i].y());
+            result.maxy = std::max(result.maxy, points[i].y());
+        }
+        return result;
+    }
+
+    bool inside(const QPointF& point, Edge edge, const QRectF& window) {
+        switch (edge) {
+            case Edge::LEFT: return point.x() >= window.left();
+            case Edge::RIGHT: return point.x() <= window.right();
+            case Edge::TOP: return point.y() >= window.top();
+            case Edge::BOTTOM: return point.y() <= window.bottom();
+        }
+        return true;
+    }
+
+    // Where segment a-b crosses the line of edge; a and b are on different sides of it
+    QPointF crossing(const QPointF& a, const QPointF& b, Edge edge, const QRectF& window) {
+        if (edge == Edge::LEFT || edge == Edge::RIGHT) {
+            double x = edge == Edge::LEFT ? window.left() : window.right();
+            return QPointF(x, a.y() + (b.y() - a.y()) * (x - a.x()) / (b.x() - a.x()));
+        }
+        double y = edge == Edge::TOP ? window.top() : window.bottom();
+        return QPointF(a.x() + (b.x() - a.x()) * (y - a.y()) / (b.y() - a.y()), y);
+    }
+
+    // One Sutherland-Hodgman pass over an open ring, from points into result
+    void clipEdge(const std::vector<QPointF>& points, Edge edge, const QRectF& window, std::vector<QPointF>& result) {
+        result.clear();
+        if (points.empty())
+            return;
+        QPointF previous = points.back();
+        bool previousInside = inside(previous, edge, window);
+        for (const auto& point: points) {
+            bool pointInside = inside(point, edge, window);
+            if (pointInside != previousInside)
+                result.push_back(crossing(previous, point, edge, window));
+            if (pointInside)
+                result.push_back(point);
+            previous = point;
+            previousInside = pointInside;
+        }
+    }
+}
+
+namespace clip {
+
+QRectF window(double width, double height, double halo) {
+    return QRectF(-halo, -halo, width + 2 * halo, height + 2 * halo);
+}
+
+void ring(const QPointF* ring, size_t count, const QRectF& window, std::vector<QPointF>& result,
+          std::vector<QPointF>& scratch) {
+    result.clear();
+    if (count == 0)
+        return;
+    Bounds box = bounds(ring, count);
+    if (box.minx >= window.left() && box.maxx <= window.right() && box.miny >= window.top() && box.maxy <= window.bottom()) {
+        result.assign(ring, ring + count);
+        return;
+    }
+    if (box.maxx < window.left() || box.minx > window.right() || box.maxy < window.top() || box.miny > window.bottom())
+        return;
+
+    const QPointF& first = ring[0];
+    const QPointF& last = ring[count - 1];
+    bool closed = count > 1 && first.x() == last.x() && first.y() == last.y();
+    scratch.assign(ring, ring + count - (closed ? 1 : 0));
+    // Back and forth between the two buffers, ending in scratch
+    clipEdge(scratch, Edge::LEFT, window, result);
+    clipEdge(result, Edge::RIGHT, window, scratch);
+    clipEdge(scratch, Edge::TOP, window, result);
+    clipEdge(result, Edge::BOTTOM, window, scratch);
+    result.swap(scratch);
+    if (result.size() < 3) {
+        result.clear();
+        return;
+    }
+    if (closed)
+        result.push_back(result[0]);
+}
+
+void polyline(const QPointF* line, size_t count, const QRectF& window, std::vector<QPointF>& points,
+              std::vector<size_t>& starts) {
+    points.clear();
+    starts.clear();
+    if (count == 0)
+        return;
+    Bounds box = bounds(line, count);
+    if (box.minx >= window.left() && box.maxx <= window.right() && box.miny >= window.top() && box.maxy <= window.bottom()) {
+        points.assign(line, line + count);
+        starts.push_back(0);
+        return;
+    }
+    if (box.maxx < window.left() || box.minx > window.right() || box.maxy < window.top() || box.miny > window.bottom())
+        return;
+
+    // Liang-Barsky on every segment; a piece ends where a segment leaves the window.
+    // The piece being built is points[start, end()); one of a single point is dropped.
+    size_t start = 0;
+    auto finish = [&points, &starts, &start] {
+        if (points.size() - start > 1)
+            starts.push_back(start);
+        else
+            points.resize(start);
+        start = points.size();
+    };
+    for (size_t i = 1; i < count; i++) {
+        const QPointF& a = line[i - 1];
+        const QPointF& b = line[i];
+        double dx = b.x() - a.x(), dy = b.y() - a.y();
+        double t0 = 0, t1 = 1;
+        const double p[4] = {-dx, dx, -dy, dy};
+        const double q[4] = {a.x() - window.left(), window.right() - a.x(), a.y() - window.top(), window.bottom() - a.y()};
+        bool visible = true;
+        for (int k = 0; k < 4 && visible; k++) {
+            if (p[k] == 0) {
+                visible = q[k] >= 0;
+            } else {
+                double t = q[k] / p[k];
+                if (p[k] < 0)
+                    t0 = std::max(t0, t);
+                else
+                    t1 = std::min(t1, t);
+                visible = t0 <= t1;
+            }
+        }
+        if (!visible)
+            continue;
+        if (points.size() == start || t0 > 0) {
+            finish();
+            points.push_back(QPointF(a.x() + t0 * dx, a.y() + t0 * dy));
+        }
+        points.push_back(QPointF(a.x() + t1 * dx, a.y() + t1 * dy));
+        if (t1 < 1)
+            finish();
+    }
+    finish();
+}
+
+}
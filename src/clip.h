@@ -0,0 +1,31 @@
+#pragma once
+
+#include <QPointF>
+#include <QRectF>
+
+#include <cstddef>
+#include <vector>
+
+/*
+ * Clipping of projected ways and rings to the part of the tile a handler
+ * draws, before they reach QPainterPath, so a forest or a lake spanning
+ * dozens of tiles costs each of them only its visible part. A window is
+ * the handler's image grown by a halo wider than anything it strokes
+ * along the geometry, so the edges clipping adds along the window are
+ * never visible. Results go to buffers the caller keeps between ways,
+ * so clipping allocates only while they grow.
+ */
+namespace clip {
+    // Handler image of width x height pixels grown by halo on every side
+    QRectF window(double width, double height, double halo);
+
+    // Sutherland-Hodgman against the window into result, using scratch as working space; empty
+    // when the ring misses it. A closed ring stays closed.
+    void ring(const QPointF* ring, size_t count, const QRectF& window, std::vector<QPointF>& result,
+              std::vector<QPointF>& scratch);
+
+    // The pieces of a polyline inside the window, in order: their points one after another in
+    // points, and the index each one starts at in starts
+    void polyline(const QPointF* line, size_t count, const QRectF& window, std::vector<QPointF>& points,
+                  std::vector<size_t>& starts);
+}
@@ -1,7 +1,5 @@
 #include "common.h"
 
-#include <QPainter>
-
 Projector::Projector() :
     latlonProj(pj_init_plus("+proj=latlong +datum=WGS84")),
     resultProj(pj_init_plus("+init=epsg:3857"))
@@ -21,10 +19,13 @@ point Projector::invertTransform(point p) const {
     return p;
 }
 
-QImage combine(const QImage& image1, const QImage& image2) {
-    QImage result(image1);
-    QPainter painter(&result);
-    painter.drawImage(0, 0, image2);
-    
-    return result;
+void Projector::invertTransform(std::vector<point>& points) const {
+    if (points.empty())
+        return;
+    // x and y of consecutive points are two doubles apart
+    pj_transform(resultProj, latlonProj, points.size(), 2, &points[0].x, &points[0].y, NULL);
+    for (auto& p: points) {
+        p.x /= M_PI/180;
+        p.y /= M_PI/180;
+    }
 }
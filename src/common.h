@@ -3,6 +3,7 @@
 #include <proj_api.h>
 #include <cmath>
 #include <QImage>
+#include <vector>
 
 struct point {
     double x,y;
@@ -15,6 +16,9 @@ public:
     point transform(point p) const;
     
     point invertTransform(point p) const;
+
+    // Every point at once, in place: one call into proj instead of one per point
+    void invertTransform(std::vector<point>& points) const;
     
 private:
     projPJ latlonProj;
@@ -25,4 +29,3 @@ struct MinMax {
     double maxx, maxy, minx, miny;
 };
 
-QImage combine(const QImage& image1, const QImage& image2);
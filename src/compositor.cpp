@@ -0,0 +1,152 @@
+#include "compositor.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <thread>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+    // Exact rounded x/255 for x in [0, 255*255]
+    inline uint32_t div255(uint32_t x) {
+        x += 128;
+        return (x + (x >> 8)) >> 8;
+    }
+
+    /*
+     * dst is premultiplied. For a straight-alpha source every channel c
+     * (alpha included, taking c=255 for it) becomes (c*a + d*(255-a))/255,
+     * for a premultiplied one it is (c*255 + d*(255-a))/255.
+     */
+    void blendRowScalar(uint32_t* dst, const uint32_t* src, int count, bool premultiplied) {
+        for (int i = 0; i < count; i++) {
+            uint32_t s = src[i];
+            uint32_t a = s >> 24;
+            if (a == 0)
+                continue;
+            if (a == 255) {
+                dst[i] = s;
+                continue;
+            }
+            uint32_t d = dst[i];
+            uint32_t sa = premultiplied ? 255 : a;
+            uint32_t da = 255 - a;
+            uint32_t r = div255(((s >> 16) & 0xff) * sa + ((d >> 16) & 0xff) * da);
+            uint32_t g = div255(((s >> 8) & 0xff) * sa + ((d >> 8) & 0xff) * da);
+            uint32_t b = div255((s & 0xff) * sa + (d & 0xff) * da);
+            uint32_t alpha = div255(255 * a + (d >> 24) * da);
+            dst[i] = (alpha << 24) | (r << 16) | (g << 8) | b;
+        }
+    }
+
+#ifdef __SSE2__
+    // Same formula as blendRowScalar for two pixels unpacked to 16-bit lanes (B, G, R, A each)
+    inline __m128i blendPixels(__m128i s, __m128i d, bool premultiplied) {
+        const __m128i alphaLanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+        const __m128i c255 = _mm_set1_epi16(255);
+        const __m128i c128 = _mm_set1_epi16(128);
+
+        __m128i a = _mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3));
+        a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+        __m128i sMul = premultiplied ? c255 : _mm_or_si128(_mm_andnot_si128(alphaLanes, a), _mm_and_si128(alphaLanes, c255));
+        __m128i dMul = _mm_sub_epi16(c255, a);
+
+        __m128i x = _mm_add_epi16(_mm_mullo_epi16(s, sMul), _mm_mullo_epi16(d, dMul));
+        x = _mm_add_epi16(x, c128);
+        return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+    }
+
+    void blendRow(uint32_t* dst, const uint32_t* src, int count, bool premultiplied) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i opaque = _mm_set1_epi32(255);
+        int i = 0;
+        for (; i + 4 <= count; i += 4) {
+            __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            __m128i sa = _mm_srli_epi32(s, 24);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, zero)) == 0xffff)
+                continue;
+            __m128i* d = reinterpret_cast<__m128i*>(dst + i);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, opaque)) == 0xffff) {
+                _mm_storeu_si128(d, s);
+                continue;
+            }
+            __m128i dv = _mm_loadu_si128(d);
+            __m128i lo = blendPixels(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(dv, zero), premultiplied);
+            __m128i hi = blendPixels(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(dv, zero), premultiplied);
+            _mm_storeu_si128(d, _mm_packus_epi16(lo, hi));
+        }
+        blendRowScalar(dst + i, src + i, count - i, premultiplied);
+    }
+#else
+    void blendRow(uint32_t* dst, const uint32_t* src, int count, bool premultiplied) {
+        blendRowScalar(dst, src, count, premultiplied);
+    }
+#endif
+
+    struct Layer {
+        const uchar* bits;
+        int bytesPerLine;
+        bool premultiplied;
+    };
+
+    void compositeBand(uchar* dstBits, int dstBytesPerLine, const std::vector<Layer>& layers,
+                       int width, int rowFrom, int rowTo) {
+        for (int y = rowFrom; y < rowTo; y++) {
+            uint32_t* dst = reinterpret_cast<uint32_t*>(dstBits + y * dstBytesPerLine);
+            std::fill(dst, dst + width, 0);
+            for (const auto& layer: layers) {
+                const uint32_t* src = reinterpret_cast<const uint32_t*>(layer.bits + y * layer.bytesPerLine);
+                blendRow(dst, src, width, layer.premultiplied);
+            }
+        }
+    }
+}
+
+QImage composite(const std::vector<QImage>& layers, int threads) {
+    if (layers.empty())
+        return QImage();
+    int width = layers[0].width();
+    int height = layers[0].height();
+
+    // Keeps converted copies alive for layers in formats we can't blend directly
+    std::vector<QImage> converted;
+    converted.reserve(layers.size());
+    std::vector<Layer> sources;
+    for (const auto& image: layers) {
+        if (image.width() != width || image.height() != height)
+            throw std::runtime_error("composite: layer size mismatch");
+        const QImage* source = &image;
+        if (image.format() != QImage::Format_ARGB32 && image.format() != QImage::Format_ARGB32_Premultiplied
+                && image.format() != QImage::Format_RGB32) {
+            converted.push_back(image.convertToFormat(QImage::Format_ARGB32));
+            source = &converted.back();
+        }
+        sources.push_back({source->constBits(), source->bytesPerLine(),
+                           source->format() == QImage::Format_ARGB32_Premultiplied});
+    }
+
+    QImage result(width, height, QImage::Format_ARGB32_Premultiplied);
+    uchar* dstBits = result.bits();
+    int dstBytesPerLine = result.bytesPerLine();
+
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, height);
+    if (threads <= 1) {
+        compositeBand(dstBits, dstBytesPerLine, sources, width, 0, height);
+        return result;
+    }
+
+    std::vector<std::thread> bands;
+    int bandHeight = (height + threads - 1) / threads;
+    for (int from = 0; from < height; from += bandHeight) {
+        int to = std::min(from + bandHeight, height);
+        bands.emplace_back(compositeBand, dstBits, dstBytesPerLine, std::cref(sources), width, from, to);
+    }
+    for (auto& band: bands)
+        band.join();
+    return result;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <QImage>
+
+#include <vector>
+
+/*
+ * Blends the layers bottom to top (source-over) in a single pass and
+ * returns the premultiplied result. Layers are read in place: both
+ * ARGB32 and ARGB32_Premultiplied are blended directly, all of them must
+ * have the size of the first one. Rows are split into bands that are
+ * processed by `threads` threads (0 means one per core).
+ */
+QImage composite(const std::vector<QImage>& layers, int threads = 0);
@@ -0,0 +1,232 @@
+#include "dem_mosaic.h"
+
+#include "srtm.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+    const char MAGIC[4] = {'D', 'M', 'D', 'M'};
+    const int32_t VERSION = 1;
+    const int MAX_LEVELS = 16;
+    // Header and level table, padded so level data starts on a page
+    const int64_t DATA_OFFSET = 4096;
+    const int16_t VOID = -32768;
+
+    struct Header {
+        char magic[4];
+        int32_t version;
+        int32_t west, north;
+        int32_t cellsX, cellsY;
+        int32_t levels;
+        int32_t reserved;
+    };
+
+    struct LevelRecord {
+        int64_t width, height, tilesX, tilesY, offset;
+    };
+
+    int64_t tileBytes() {
+        return int64_t(DemMosaic::TILE) * DemMosaic::TILE * sizeof(int16_t);
+    }
+
+    int16_t* address(char* base, const LevelRecord& level, int64_t x, int64_t y) {
+        int64_t tile = (y / DemMosaic::TILE) * level.tilesX + x / DemMosaic::TILE;
+        return reinterpret_cast<int16_t*>(base + level.offset + tile * tileBytes())
+               + (y % DemMosaic::TILE) * DemMosaic::TILE + x % DemMosaic::TILE;
+    }
+
+    // Sample (x, y) of level from the 3x3 neighbourhood of (2x, 2y) in the finer one
+    int16_t overview(char* base, const LevelRecord& finer, int64_t x, int64_t y) {
+        static const int WEIGHTS[3] = {1, 2, 1};
+        int64_t sum = 0, weight = 0;
+        for (int dy = -1; dy <= 1; dy++) {
+            int64_t sy = std::min(std::max<int64_t>(2 * y + dy, 0), finer.height - 1);
+            for (int dx = -1; dx <= 1; dx++) {
+                int64_t sx = std::min(std::max<int64_t>(2 * x + dx, 0), finer.width - 1);
+                int16_t value = *address(base, finer, sx, sy);
+                if (value == VOID)
+                    continue;
+                int w = WEIGHTS[dy + 1] * WEIGHTS[dx + 1];
+                sum += w * value;
+                weight += w;
+            }
+        }
+        if (weight == 0)
+            return VOID;
+        return int16_t(std::lround(double(sum) / weight));
+    }
+}
+
+void DemMosaic::build(const std::string& filename, const Projector& proj, int west, int south, int east, int north) {
+    if (east <= west || north <= south)
+        throw std::runtime_error("Can't build " + filename + ": empty area");
+    Header header;
+    std::memcpy(header.magic, MAGIC, 4);
+    header.version = VERSION;
+    header.west = west;
+    header.north = north;
+    header.cellsX = east - west;
+    header.cellsY = north - south;
+    header.reserved = 0;
+
+    std::vector<LevelRecord> levels;
+    LevelRecord level;
+    level.width = int64_t(header.cellsX) * SAMPLES_PER_DEGREE + 1;
+    level.height = int64_t(header.cellsY) * SAMPLES_PER_DEGREE + 1;
+    level.offset = DATA_OFFSET;
+    while (true) {
+        level.tilesX = (level.width + TILE - 1) / TILE;
+        level.tilesY = (level.height + TILE - 1) / TILE;
+        levels.push_back(level);
+        if ((level.width <= TILE && level.height <= TILE) || int(levels.size()) == MAX_LEVELS)
+            break;
+        level.offset += level.tilesX * level.tilesY * tileBytes();
+        level.width = (level.width - 1) / 2 + 1;
+        level.height = (level.height - 1) / 2 + 1;
+    }
+    header.levels = levels.size();
+    int64_t total = levels.back().offset + levels.back().tilesX * levels.back().tilesY * tileBytes();
+
+    std::string tmpName = filename + ".tmp";
+    int fd = open(tmpName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw std::runtime_error("Can't create " + tmpName);
+    if (ftruncate(fd, total) != 0) {
+        close(fd);
+        throw std::runtime_error("Can't allocate " + std::to_string(total >> 20) + " MB for " + tmpName);
+    }
+    void* map = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        throw std::runtime_error("Can't map " + tmpName);
+    char* base = static_cast<char*>(map);
+    std::memcpy(base, &header, sizeof(header));
+    std::memcpy(base + sizeof(header), levels.data(), levels.size() * sizeof(LevelRecord));
+
+    // Level 0 a row of cells at a time; neighbouring cells share their edge samples
+    for (int cy = 0; cy < header.cellsY; cy++) {
+        SRTMProvider provider(proj);
+        for (int cx = 0; cx < header.cellsX; cx++) {
+            const auto& heights = provider.getHeights(west + cx, north - 1 - cy);
+            for (int dy = 0; dy <= SAMPLES_PER_DEGREE; dy++)
+                for (int dx = 0; dx <= SAMPLES_PER_DEGREE; dx++)
+                    *address(base, levels[0], int64_t(cx) * SAMPLES_PER_DEGREE + dx, int64_t(cy) * SAMPLES_PER_DEGREE + dy)
+                        = int16_t(uint16_t(heights[dx][dy]));
+        }
+        std::cout << "DEM mosaic: cell row " << cy + 1 << " of " << header.cellsY << std::endl;
+    }
+    for (size_t i = 1; i < levels.size(); i++)
+        for (int64_t y = 0; y < levels[i].height; y++)
+            for (int64_t x = 0; x < levels[i].width; x++)
+                *address(base, levels[i], x, y) = overview(base, levels[i - 1], x, y);
+
+    bool synced = msync(map, total, MS_SYNC) == 0;
+    munmap(map, total);
+    if (!synced || std::rename(tmpName.c_str(), filename.c_str()) != 0)
+        throw std::runtime_error("Can't write " + filename);
+    std::cout << "DEM mosaic " << filename << ": " << header.cellsX << "x" << header.cellsY << " cells, "
+              << levels.size() << " levels, " << (total >> 20) << " MB" << std::endl;
+}
+
+DemMosaic::DemMosaic(const std::string& filename_) :
+    filename(filename_),
+    data(nullptr),
+    size(0)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Can't open " + filename);
+    struct stat info;
+    if (fstat(fd, &info) != 0 || size_t(info.st_size) < size_t(DATA_OFFSET)) {
+        close(fd);
+        throw std::runtime_error("Can't read " + filename + ": not a DEM mosaic");
+    }
+    size = info.st_size;
+    void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        throw std::runtime_error("Can't map " + filename);
+    data = static_cast<const int16_t*>(map);
+
+    const char* base = reinterpret_cast<const char*>(data);
+    Header header;
+    std::memcpy(&header, base, sizeof(header));
+    if (std::memcmp(header.magic, MAGIC, 4) != 0 || header.version != VERSION
+            || header.levels < 1 || header.levels > MAX_LEVELS) {
+        munmap(map, size);
+        throw std::runtime_error("Can't read " + filename + ": not a version " + std::to_string(VERSION) + " DEM mosaic");
+    }
+    west = header.west;
+    north = header.north;
+    for (int i = 0; i < header.levels; i++) {
+        LevelRecord record;
+        std::memcpy(&record, base + sizeof(header) + i * sizeof(LevelRecord), sizeof(record));
+        if (record.offset + record.tilesX * record.tilesY * tileBytes() > int64_t(size)) {
+            munmap(map, size);
+            throw std::runtime_error("Can't read " + filename + ": truncated");
+        }
+        levels.push_back({record.width, record.height, record.tilesX, record.tilesY, record.offset});
+    }
+}
+
+DemMosaic::~DemMosaic() {
+    munmap(const_cast<int16_t*>(data), size);
+}
+
+int DemMosaic::getLevels() const {
+    return levels.size();
+}
+
+double DemMosaic::spacing(int level) const {
+    return double(int64_t(1) << level) / SAMPLES_PER_DEGREE;
+}
+
+int DemMosaic::levelFor(double degrees) const {
+    int level = 0;
+    while (level + 1 < getLevels() && spacing(level + 1) <= degrees)
+        level++;
+    return level;
+}
+
+double DemMosaic::getWest() const {
+    return west;
+}
+
+double DemMosaic::getNorth() const {
+    return north;
+}
+
+int16_t DemMosaic::sample(const Level& level, int64_t x, int64_t y) const {
+    int64_t tile = (y / TILE) * level.tilesX + x / TILE;
+    return data[(level.offset + tile * tileBytes()) / int64_t(sizeof(int16_t)) + (y % TILE) * TILE + x % TILE];
+}
+
+cv::Mat DemMosaic::read(int level, int x0, int y0, int width, int height) const {
+    const Level& source = levels.at(level);
+    cv::Mat result(height, width, CV_32FC1);
+    for (int y = 0; y < height; y++) {
+        int64_t sy = std::min(std::max<int64_t>(y0 + y, 0), source.height - 1);
+        float* row = result.ptr<float>(y);
+        for (int x = 0; x < width; x++) {
+            int64_t sx = std::min(std::max<int64_t>(x0 + x, 0), source.width - 1);
+            int16_t value = sample(source, sx, sy);
+            row[x] = value == VOID ? 0 : value;
+        }
+    }
+    return result;
+}
+
+const std::string& DemMosaic::getFilename() const {
+    return filename;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "common.h"
+
+#include "opencv2/core/core.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * The SRTM cells of an area preprocessed into one memory-mapped file of
+ * int16 heights, with overview levels, so a tile reads just its window at
+ * the resolution it is drawn at instead of whole one-arc-second cells.
+ *
+ * Level 0 holds every sample of the cells, 3600 per degree; each next level
+ * keeps every other sample of the previous one in both directions, averaged
+ * over its neighbours with a 1-2-1 tent, down to a level that fits one
+ * tile. Sample (0, 0) of every level sits at the north-west corner of the
+ * area. Levels are stored as TILE x TILE blocks, row by row, so a window
+ * touches few pages wherever it lies. Voids keep the SRTM void value, are
+ * left out of the overviews and read back as 0.
+ */
+class DemMosaic {
+public:
+    static const int TILE = 256;
+    static const int SAMPLES_PER_DEGREE = 3600;
+
+    /*
+     * Writes the mosaic of the cells with south-west corners in lon
+     * [west, east), lat [south, north), downloading missing cells like
+     * SRTMProvider does. Holds one row of cells in memory at a time.
+     */
+    static void build(const std::string& filename, const Projector& proj, int west, int south, int east, int north);
+
+    // Maps the file; throws if it isn't a mosaic
+    explicit DemMosaic(const std::string& filename);
+    ~DemMosaic();
+
+    DemMosaic(const DemMosaic&) = delete;
+    DemMosaic& operator=(const DemMosaic&) = delete;
+
+    int getLevels() const;
+
+    // Degrees between neighbouring samples of level
+    double spacing(int level) const;
+
+    // Coarsest level whose samples are at most degrees apart, 0 if none is
+    int levelFor(double degrees) const;
+
+    double getWest() const;
+    double getNorth() const;
+
+    /*
+     * Samples [x0, x0 + width) x [y0, y0 + height) of level as CV_32FC1, y
+     * growing south; outside the mosaic the nearest edge sample repeats.
+     * Safe to call from any number of threads.
+     */
+    cv::Mat read(int level, int x0, int y0, int width, int height) const;
+
+    const std::string& getFilename() const;
+
+private:
+    struct Level {
+        int64_t width, height;
+        int64_t tilesX, tilesY;
+        // From the start of the file, in bytes
+        int64_t offset;
+    };
+
+    int16_t sample(const Level& level, int64_t x, int64_t y) const;
+
+    std::string filename;
+    int west, north;
+    std::vector<Level> levels;
+    const int16_t* data;
+    size_t size;
+};
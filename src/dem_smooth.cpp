@@ -0,0 +1,212 @@
+#include "dem_smooth.h"
+
+#include "scheduler.h"
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+    // The bilateral filter's, and its reach: OpenCV's kernel radius for d=-1 is 1.5 sigma
+    const double SIGMA_COLOR = 10;
+    const double SIGMA_SPACE = 5;
+    const int BILATERAL_RADIUS = 8;
+    /*
+     * Box radius and edge threshold of the guided filter: two passes of a
+     * radius 4 box spread about as far as sigma 5, and variances well under
+     * SIGMA_COLOR squared are smoothed away. Measured on a synthetic 3601^2
+     * DEM, heights stay within 1.2 m rms and gradients within 6% rms of the
+     * bilateral filter.
+     */
+    const int GUIDED_RADIUS = 4;
+    const double GUIDED_EPS = SIGMA_COLOR * SIGMA_COLOR;
+    const int FAST_SCALE = 2;
+    const int MIN_STRIP_ROWS = 64;
+
+    /*
+     * The filter for a source of step level 0 samples per sample. The
+     * sizes above are in level 0 samples, so they shrink by step and the
+     * smoothing covers the same ground at every mosaic level.
+     */
+    struct Filter {
+        DemSmoothing mode;
+        double sigmaSpace;
+        // Bilateral kernel or guided box radius, in source samples; 0 leaves the source as it is
+        int radius;
+    };
+
+    Filter scaled(DemSmoothing mode, int step) {
+        Filter result;
+        result.mode = mode;
+        result.sigmaSpace = SIGMA_SPACE / step;
+        if (mode == DemSmoothing::BILATERAL) {
+            result.radius = BILATERAL_RADIUS / step;
+            return result;
+        }
+        result.radius = GUIDED_RADIUS / step;
+        // Too small to compute at a coarser resolution still
+        if (mode == DemSmoothing::FAST && result.radius / FAST_SCALE < 1)
+            result.mode = DemSmoothing::GUIDED;
+        return result;
+    }
+
+    // Rows beyond a strip its filter reads
+    int reach(const Filter& filter) {
+        switch (filter.mode) {
+            case DemSmoothing::BILATERAL: return filter.radius;
+            case DemSmoothing::GUIDED: return 2 * filter.radius;
+            case DemSmoothing::FAST: return (2 * filter.radius / FAST_SCALE + 1) * FAST_SCALE + FAST_SCALE;
+        }
+        return 0;
+    }
+
+    cv::Mat box(const cv::Mat& source, int radius) {
+        cv::Mat result;
+        cv::boxFilter(source, result, -1, cv::Size(2 * radius + 1, 2 * radius + 1), cv::Point(-1, -1), true,
+                      cv::BORDER_REFLECT_101);
+        return result;
+    }
+
+    // Coefficients a, b of the guided filter of I guiding itself, already box-averaged
+    void coefficients(const cv::Mat& I, int radius, cv::Mat& a, cv::Mat& b) {
+        cv::Mat mean = box(I, radius);
+        cv::Mat variance = box(I.mul(I), radius) - mean.mul(mean);
+        a = variance / (variance + GUIDED_EPS);
+        b = mean - a.mul(mean);
+        a = box(a, radius);
+        b = box(b, radius);
+    }
+
+    // Averages of FAST_SCALE x FAST_SCALE blocks, partial at the bottom and right edges
+    cv::Mat downsample(const cv::Mat& source) {
+        cv::Mat result((source.rows + FAST_SCALE - 1) / FAST_SCALE, (source.cols + FAST_SCALE - 1) / FAST_SCALE, CV_32FC1);
+        for (int y = 0; y < result.rows; y++) {
+            float* out = result.ptr<float>(y);
+            for (int x = 0; x < result.cols; x++) {
+                float sum = 0;
+                int count = 0;
+                for (int sy = y * FAST_SCALE; sy < std::min((y + 1) * FAST_SCALE, source.rows); sy++)
+                    for (int sx = x * FAST_SCALE; sx < std::min((x + 1) * FAST_SCALE, source.cols); sx++, count++)
+                        sum += source.at<float>(sy, sx);
+                out[x] = sum / count;
+            }
+        }
+        return result;
+    }
+
+    // Bilinear at the exact scale, so strips starting on a block boundary line up with each other
+    cv::Mat upsample(const cv::Mat& source, int rows, int cols) {
+        cv::Mat result(rows, cols, CV_32FC1);
+        std::vector<int> x0(cols), x1(cols);
+        std::vector<float> fx(cols);
+        for (int x = 0; x < cols; x++) {
+            float sx = std::max(0.0f, std::min(float(source.cols - 1), (x + 0.5f) / FAST_SCALE - 0.5f));
+            x0[x] = int(sx);
+            x1[x] = std::min(x0[x] + 1, source.cols - 1);
+            fx[x] = sx - x0[x];
+        }
+        for (int y = 0; y < rows; y++) {
+            float sy = std::max(0.0f, std::min(float(source.rows - 1), (y + 0.5f) / FAST_SCALE - 0.5f));
+            int y0 = int(sy), y1 = std::min(y0 + 1, source.rows - 1);
+            float fy = sy - y0;
+            const float* top = source.ptr<float>(y0);
+            const float* bottom = source.ptr<float>(y1);
+            float* out = result.ptr<float>(y);
+            for (int x = 0; x < cols; x++) {
+                float upper = top[x0[x]] + (top[x1[x]] - top[x0[x]]) * fx[x];
+                float lower = bottom[x0[x]] + (bottom[x1[x]] - bottom[x0[x]]) * fx[x];
+                out[x] = upper + (lower - upper) * fy;
+            }
+        }
+        return result;
+    }
+
+    /*
+     * Filters one strip. Heights are shifted by offset, the same for every
+     * strip, so the variances of a high plateau don't lose their precision
+     * to float cancellation.
+     */
+    cv::Mat smoothStrip(const cv::Mat& strip, const Filter& filter, double offset) {
+        cv::Mat result;
+        if (filter.mode == DemSmoothing::BILATERAL) {
+            // The diameter given, as OpenCV's own for d=-1 at the reference sigma
+            cv::bilateralFilter(strip, result, 2 * filter.radius + 1, SIGMA_COLOR, filter.sigmaSpace);
+            return result;
+        }
+        cv::Mat I;
+        strip.convertTo(I, CV_32FC1, 1, -offset);
+        cv::Mat a, b;
+        if (filter.mode == DemSmoothing::GUIDED) {
+            coefficients(I, filter.radius, a, b);
+        } else {
+            coefficients(downsample(I), filter.radius / FAST_SCALE, a, b);
+            a = upsample(a, I.rows, I.cols);
+            b = upsample(b, I.rows, I.cols);
+        }
+        result = a.mul(I) + b + offset;
+        return result;
+    }
+}
+
+namespace demSmooth {
+
+DemSmoothing parse(const std::string& name) {
+    if (name == "bilateral")
+        return DemSmoothing::BILATERAL;
+    if (name == "guided")
+        return DemSmoothing::GUIDED;
+    if (name == "fast")
+        return DemSmoothing::FAST;
+    throw std::runtime_error("Unknown DEM smoothing " + name);
+}
+
+std::string name(DemSmoothing mode) {
+    switch (mode) {
+        case DemSmoothing::BILATERAL: return "bilateral";
+        case DemSmoothing::GUIDED: return "guided";
+        case DemSmoothing::FAST: return "fast";
+    }
+    return "";
+}
+
+cv::Mat apply(const cv::Mat& source, DemSmoothing mode, int threads, int step) {
+    cv::Mat result(source.size(), CV_32FC1);
+    if (source.empty())
+        return result;
+    Filter filter = scaled(mode, std::max(1, step));
+    if (filter.radius == 0) {
+        source.copyTo(result);
+        return result;
+    }
+    double offset = cv::mean(source)[0];
+    if (threads == 1)
+        return smoothStrip(source, filter, offset);
+    int halo = reach(filter);
+    ThreadPool pool(threads);
+    int strips = std::max(1, std::min(2 * pool.size(), source.rows / MIN_STRIP_ROWS));
+    for (int i = 0; i < strips; i++) {
+        int begin = source.rows * i / strips, end = source.rows * (i + 1) / strips;
+        pool.submit([&source, &result, filter, offset, halo, begin, end] {
+            int top = std::max(0, begin - halo), bottom = std::min(source.rows, end + halo);
+            top -= top % FAST_SCALE;
+            cv::Mat strip = smoothStrip(source.rowRange(top, bottom), filter, offset);
+            strip.rowRange(begin - top, end - top).copyTo(result.rowRange(begin, end));
+        });
+    }
+    pool.wait();
+    return result;
+}
+
+size_t scratch(DemSmoothing mode) {
+    switch (mode) {
+        case DemSmoothing::BILATERAL: return 1;
+        case DemSmoothing::GUIDED: return 6;
+        case DemSmoothing::FAST: return 4;
+    }
+    return 0;
+}
+
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "opencv2/core/core.hpp"
+
+#include <cstddef>
+#include <string>
+
+/*
+ * Edge-preserving smoothing of the DEM before its gradients are taken:
+ * flattens SRTM noise on slopes while keeping ridges and river banks
+ * sharp. All modes run on horizontal strips of the source on a thread
+ * pool, each strip grown by the filter's reach so the seams don't show.
+ *
+ * BILATERAL is cv::bilateralFilter(source, -1, 10, 5), the reference.
+ * GUIDED is a self-guided filter of the same reach and edge threshold
+ * built from box filters, so its cost doesn't grow with the radius.
+ * FAST computes the guided filter's coefficients at half resolution.
+ */
+enum class DemSmoothing {BILATERAL, GUIDED, FAST};
+
+namespace demSmooth {
+    // "bilateral", "guided" or "fast"; throws on anything else
+    DemSmoothing parse(const std::string& name);
+
+    std::string name(DemSmoothing mode);
+
+    /*
+     * Single channel float source of step level 0 samples per sample, such
+     * as a coarse mosaic level; the filter keeps its ground footprint, and
+     * where that is under a sample the source is returned as it is. threads
+     * <= 0 means one per core, 1 filters on the calling thread.
+     */
+    cv::Mat apply(const cv::Mat& source, DemSmoothing mode, int threads = 0, int step = 1);
+
+    // Working memory of apply on top of its result, in multiples of the source size
+    size_t scratch(DemSmoothing mode);
+}
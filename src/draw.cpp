@@ -1,81 +1,47 @@
-#include "srtm.h"
+#include "render.h"
+#include "dem_mosaic.h"
+#include "grid.h"
+#include "heap_profile.h"
+#include "image_writer.h"
+#include "metrics.h"
+#include "osm_changes.h"
+#include "partition.h"
+#include "tile_server.h"
+#include "trace.h"
+#include "options.h"
 
-#include "osm_roads.h"
-#include "osm_rail.h"
-#include "osm_places.h"
-#include "osm_rivers.h"
-#include "osm_forests.h"
-#include "osm_main.h"
-
-#include <QImage>
+#include "opencv2/core/core.hpp"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
-#include <thread>
-
-const int IMAGE_SIZE = 1200;
-const int TILE_SOURCE_SIZE = 25000;
-
-void drawTile(QImage* result, const std::string osmFile, const Projector proj, MinMax minmax, int xTile, int yTile) {
-    std::cout << "tile " << minmax.minx << " " << minmax.maxx << "   " << minmax.miny << " " << minmax.maxy << std::endl;
-    
-    SRTMtoCV srtm(proj, minmax, IMAGE_SIZE);
-    
-    cvPaint::paint(srtm.getCvHeights()).save("test-cv.png");
-    cvPaint::paint(srtm.getXGrad()).save("test-xgrad.png");
-    cvPaint::paint(srtm.getYGrad()).save("test-ygrad.png");
-    cvPaint::paintGrads(srtm.getXGrad(), srtm.getYGrad()).save("test-grads.png");
-    
-    OsmRoadsHandler roads(proj, minmax, IMAGE_SIZE);
-    OsmRailHandler rail(proj, minmax, IMAGE_SIZE);
-    OsmPlacesHandler places(proj, minmax, IMAGE_SIZE);
-    OsmRiversHandler rivers(proj, minmax, IMAGE_SIZE);
-    
-    OsmForestsHandler forests(proj, minmax, IMAGE_SIZE, xTile, yTile);
-    
-    forests.setHeights(srtm.getCvHeights());
-    
-    roads.setPlacesPath(places.getUnitedPath());
-    
-    places.setRoadsPath(roads.getUnitedPath());
-    places.setRailPath(rail.getUnitedPath());
-    places.setForestAreas(forests.getAreas());
+#include <memory>
 
-    OsmDrawer osm;
-    osm.addHandler(&roads);
-    osm.addHandler(&rail);
-    osm.addHandler(&places);
-    osm.addHandler(&rivers);
-    osm.addHandler(&forests);
-    
-    osm.dispatch(osmFile);
-    
-    auto hills = cvPaint::paintGrads(srtm.getXGrad(), srtm.getYGrad());
-    
-    
-    //roads.getImage().save("roads.png");
-    //places.getImage().save("places.png");
-    
-    *result = hills;
-    // *result = rivers.getImage();
-    *result = combine(*result, forests.getImage());
-    *result = combine(*result, rivers.getImage());
-    *result = combine(*result, roads.getImage());
-    *result = combine(*result, rail.getImage());
-    *result = combine(*result, places.getImage());
-    //std::cout << result << " result.width=" << result->width() << std::endl;
-    
-    //*result = forests.getImage();
+namespace {
+    void writeProfiles(const Options& options) {
+        if (!options.traceFile.empty())
+            trace::write(options.traceFile);
+        if (!options.memoryProfile.empty())
+            heap::write(options.memoryProfile);
+    }
 }
 
 int main(int argc, char* argv[]) {
     cv::setNumThreads(0);
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " OSMFILE\n";
-        exit(1);
+    Options options = parseOptions(argc, argv);
+    ImageWriter::instance().setDebugLayers(options.debugLayers);
+    ImageWriter::instance().setPngOptions(options.png);
+    SRTMtoCV::setSmoothing(options.demSmoothing);
+    std::unique_ptr<DemMosaic> mosaic;
+    if (!options.demMosaic.empty()) {
+        mosaic.reset(new DemMosaic(options.demMosaic));
+        SRTMtoCV::setMosaic(mosaic.get());
     }
+    // The server never finishes a run to write the trace at
+    trace::enable(!options.traceFile.empty() && !options.servePort);
+    trace::profileMemory(!options.memoryProfile.empty() && !options.servePort);
 
     Projector proj;
-    MinMax minmax;
     /*
      * Nizhobl: x in [41.7 .. 47.8]  -> [4642000 .. 5321000]  dx=679000 em (effective meters)
      *          y in [54.4 .. 58.1]  -> [7231000 .. 7952000]  dy=721000 em
@@ -89,71 +55,88 @@ int main(int argc, char* argv[]) {
      * 
      * for 600dpi for 10x10cm image size should be 2400 x 2400
      * 5x5cm -- 1200x1200
+     *
+     * Other centers used before: 41.720581,57.858635 and 37.6,55.8
      */
-    
-    /*
-    minmax.minx = 4550000; // 4860000
-    minmax.maxx = 5200000; // 4880000
-    minmax.miny = 7300000; // 7555000
-    */
-    
-    /*
-    point center = proj.transform({41.720581, 57.858635});
-    minmax.minx = center.x - 100000;
-    minmax.maxx = center.x + 100000;
-    minmax.miny = center.y - 100000;
-    */
-    
-    point center = proj.transform({43.739319, 56.162759});
-    minmax.minx = center.x - TILE_SOURCE_SIZE/2;
-    minmax.maxx = center.x + TILE_SOURCE_SIZE/2;
-    minmax.miny = center.y - TILE_SOURCE_SIZE/2;
-    
-    
-    
-    /*
-    point center = proj.transform({37.6, 55.8});
-    minmax.minx = center.x - 1000000;
-    minmax.maxx = center.x + 1000000;
-    minmax.miny = center.y - 1000000;
-    */
-    
-    minmax.maxy = minmax.miny + (minmax.maxx - minmax.minx); 
-    
-    int TILES = 10;
-    int OFFSET = TILES/2;
-    
-    QImage result(IMAGE_SIZE*TILES, IMAGE_SIZE*TILES, QImage::Format_ARGB32);
-    result.fill({255, 255, 255, 0});
-    QPainter painter(&result);
-
-    for (int x=0; x<TILES; x++) {
-        std::vector<std::unique_ptr<std::thread>> threads;
-        std::vector<QImage> images(TILES);
-        for (int y=0; y<TILES; y++) {
-            MinMax curMinMax(minmax);
-            curMinMax.minx += (x-OFFSET)*TILE_SOURCE_SIZE;
-            curMinMax.maxx += (x-OFFSET)*TILE_SOURCE_SIZE;
-            curMinMax.miny += (OFFSET-y)*TILE_SOURCE_SIZE;
-            curMinMax.maxy += (OFFSET-y)*TILE_SOURCE_SIZE;
-            threads.emplace_back(new std::thread(drawTile, &(images[y]), argv[1], proj, curMinMax, x, y));
-            //threads[y]->join();
-            //drawTile(&(images[y]), argv[1], proj, curMinMax);
-        }
-        for (int y=0; y<TILES; y++) {
-            std::cout << "y=" << y << std::endl;
-            threads[y]->join();
-            std::cout << "y=" << y << std::endl;
-            std::ostringstream str;
-            str << "img" << x << y;
-            images[y].save(std::string(str.str() + ".png").c_str());
-            std::cout << &(images[y]) << "y=" << y << " " << str.str() << " " << images[y].width() << std::endl;
-            painter.drawImage(x*IMAGE_SIZE, y*IMAGE_SIZE, images[y]);
+    if (options.servePort) {
+        TileServer server(options, proj);
+        server.run();
+        return 0;
+    }
+    if (!options.mergeDir.empty()) {
+        partition::merge(options, options.mergeDir);
+        return 0;
+    }
+    if (!options.workerDir.empty()) {
+        int failed;
+        {
+            trace::measure(!options.metricsFile.empty());
+            metrics::Reporter reporter(options.metricsFile, options.metricsInterval);
+            failed = partition::work(options, proj, options.workerDir);
         }
+        writeProfiles(options);
+        if (failed)
+            std::cerr << failed << " tiles failed, see " << options.workerDir << "/failed" << std::endl;
+        return failed ? 1 : 0;
+    }
+
+    point center = proj.transform({options.centerLon, options.centerLat});
+    Grid grid(center, options.tileSize, options.tiles, options.imageSize);
+
+    TileRange range = grid.fullRange();
+    if (options.hasRange) {
+        range = options.range;
+    } else if (options.hasBBox) {
+        point min = proj.transform({options.bbox[0], options.bbox[1]});
+        point max = proj.transform({options.bbox[2], options.bbox[3]});
+        MinMax bbox;
+        bbox.minx = min.x;
+        bbox.miny = min.y;
+        bbox.maxx = max.x;
+        bbox.maxy = max.y;
+        range = grid.rangeFor(bbox);
+    }
+    if (!options.buildDem.empty()) {
+        MinMax area = grid.tileMinMax(range.minX, range.minY);
+        MinMax last = grid.tileMinMax(range.maxX, range.maxY);
+        area.minx = std::min(area.minx, last.minx);
+        area.miny = std::min(area.miny, last.miny);
+        area.maxx = std::max(area.maxx, last.maxx);
+        area.maxy = std::max(area.maxy, last.maxy);
+        MinMax geo = SRTMtoCV::geoBounds(proj, area);
+        DemMosaic::build(options.buildDem, proj, std::floor(geo.minx), std::floor(geo.miny),
+                         std::floor(geo.maxx) + 1, std::floor(geo.maxy) + 1);
+        return 0;
     }
-    
-    result.save("final.png");
+    std::cout << "Rendering tiles x " << range.minX << ".." << range.maxX
+              << ", y " << range.minY << ".." << range.maxY << std::endl;
+
+    TileSet dirty;
+    if (!options.changes.empty()) {
+        OsmChanges changes(options.changes);
+        changes.scan(options.osmFile);
+        changes.scan(options.previousOsmFile);
+        // Strokes and labels reach a bit past the feature they belong to
+        static const int HALO_PIXELS = 32;
+        for (const auto& tile: changes.touchedTiles(proj, grid, grid.getTileSize() * HALO_PIXELS / grid.getImageSize()))
+            if (range.contains(tile.first, tile.second))
+                dirty.insert(tile);
+        std::cout << "Change touches " << dirty.size() << " of " << range.width() * range.height() << " tiles" << std::endl;
+    }
+    if (!options.planDir.empty()) {
+        partition::plan(options, options.planDir, range, options.changes.empty() ? nullptr : &dirty);
+        return 0;
+    }
+    int failed;
+    {
+        trace::measure(!options.metricsFile.empty());
+        metrics::Reporter reporter(options.metricsFile, options.metricsInterval);
+        failed = renderGrid(options, proj, grid, range, options.changes.empty() ? nullptr : &dirty);
+    }
+
+    writeProfiles(options);
+    if (failed)
+        std::cerr << failed << " tiles failed and are left blank in " << options.output << std::endl;
 
-    
-    return 0;
+    return failed ? 1 : 0;
 }
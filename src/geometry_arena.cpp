@@ -0,0 +1,64 @@
+#include "geometry_arena.h"
+
+#include "clip.h"
+
+void GeometryArena::beginShape(int style) {
+    shapes.push_back(parts.size());
+    styles.push_back(style);
+}
+
+std::vector<QPointF>& GeometryArena::projected() {
+    return input;
+}
+
+void GeometryArena::addLine(const QRectF& window) {
+    clip::polyline(input.data(), input.size(), window, clipped, starts);
+    for (size_t i = 0; i < starts.size(); i++) {
+        size_t end = i + 1 < starts.size() ? starts[i + 1] : clipped.size();
+        QPointF* piece = clipped.data() + starts[i];
+        addPart(piece, simplify::polyline(piece, end - starts[i], scratch));
+    }
+}
+
+void GeometryArena::addRing(const QRectF& window) {
+    clip::ring(input.data(), input.size(), window, clipped, spare);
+    addPart(clipped.data(), simplify::ring(clipped.data(), clipped.size(), scratch));
+}
+
+void GeometryArena::addPart(const QPointF* points, size_t count) {
+    if (count == 0)
+        return;
+    parts.push_back(xs.size());
+    for (size_t i = 0; i < count; i++) {
+        xs.push_back(points[i].x());
+        ys.push_back(points[i].y());
+    }
+}
+
+bool GeometryArena::endShape() {
+    if (shapes.back() < parts.size())
+        return true;
+    shapes.pop_back();
+    styles.pop_back();
+    return false;
+}
+
+size_t GeometryArena::size() const {
+    return shapes.size();
+}
+
+int GeometryArena::style(size_t shape) const {
+    return styles[shape];
+}
+
+QPainterPath GeometryArena::path(size_t shape) const {
+    QPainterPath result;
+    size_t lastPart = shape + 1 < shapes.size() ? shapes[shape + 1] : parts.size();
+    for (size_t part = shapes[shape]; part < lastPart; part++) {
+        size_t end = part + 1 < parts.size() ? parts[part + 1] : xs.size();
+        result.moveTo(xs[parts[part]], ys[parts[part]]);
+        for (size_t i = parts[part] + 1; i < end; i++)
+            result.lineTo(xs[i], ys[i]);
+    }
+    return result;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "simplify.h"
+
+#include <QPainterPath>
+#include <QPointF>
+#include <QRectF>
+
+#include <cstdint>
+#include <vector>
+
+/*
+ * The projected geometry a handler collects for one tile, as flat arrays:
+ * the x and y of every vertex, where each part (a polyline or a ring)
+ * starts, where each shape (the parts of one way or ring) starts, and a
+ * handler-defined style per shape. Ingest only appends to the arrays;
+ * QPainterPaths are built from it when the handler draws, and the whole
+ * tile's geometry goes with the handler's few vectors instead of one Qt
+ * path per way. A way is projected into projected(), then clipped and
+ * simplified through buffers the arena keeps from way to way, so past the
+ * first few ways ingest allocates only when an array grows.
+ */
+class GeometryArena {
+public:
+    // Starts a shape; the parts added until endShape() belong to it
+    void beginShape(int style);
+
+    // Where the handler projects the next way or ring before addLine() or addRing()
+    std::vector<QPointF>& projected();
+
+    // Appends the pieces of projected() inside window, simplified, as parts of the current shape
+    void addLine(const QRectF& window);
+
+    // Appends projected() clipped to window and simplified as a part of the current shape
+    void addRing(const QRectF& window);
+
+    // Appends a part to the current shape; empty parts are skipped
+    void addPart(const QPointF* points, size_t count);
+
+    // Closes the current shape; one without parts is dropped and false returned
+    bool endShape();
+
+    size_t size() const;
+
+    int style(size_t shape) const;
+
+    // Each part a subpath, as QPainterPath::addPolygon adds it
+    QPainterPath path(size_t shape) const;
+
+private:
+    std::vector<double> xs, ys;
+    // First vertex of every part
+    std::vector<uint32_t> parts;
+    // First part of every shape
+    std::vector<uint32_t> shapes;
+    std::vector<int32_t> styles;
+
+    // Ingest working space
+    std::vector<QPointF> input, clipped, spare;
+    std::vector<size_t> starts;
+    simplify::Scratch scratch;
+};
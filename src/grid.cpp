@@ -0,0 +1,64 @@
+#include "grid.h"
+
+#include <cmath>
+
+int TileRange::width() const {
+    return maxX - minX + 1;
+}
+
+int TileRange::height() const {
+    return maxY - minY + 1;
+}
+
+bool TileRange::contains(int x, int y) const {
+    return x >= minX && x <= maxX && y >= minY && y <= maxY;
+}
+
+Grid::Grid(point center_, double tileSize_, int tiles_, int imageSize_) :
+    center(center_),
+    tileSize(tileSize_),
+    tiles(tiles_),
+    imageSize(imageSize_)
+{}
+
+MinMax Grid::tileMinMax(int x, int y) const {
+    int offset = tiles/2;
+    MinMax minmax;
+    minmax.minx = center.x - tileSize/2 + (x-offset)*tileSize;
+    minmax.maxx = minmax.minx + tileSize;
+    minmax.miny = center.y - tileSize/2 + (offset-y)*tileSize;
+    minmax.maxy = minmax.miny + tileSize;
+    return minmax;
+}
+
+TileRange Grid::fullRange() const {
+    return {0, tiles-1, 0, tiles-1};
+}
+
+TileRange Grid::rangeFor(const MinMax& bbox) const {
+    int offset = tiles/2;
+    double originX = center.x - tileSize/2;
+    double originY = center.y - tileSize/2;
+    TileRange range;
+    range.minX = offset + std::floor((bbox.minx - originX) / tileSize);
+    range.maxX = offset + std::ceil((bbox.maxx - originX) / tileSize) - 1;
+    range.minY = offset - std::ceil((bbox.maxy - originY) / tileSize) + 1;
+    range.maxY = offset - std::floor((bbox.miny - originY) / tileSize);
+    if (range.maxX < range.minX)
+        range.maxX = range.minX;
+    if (range.maxY < range.minY)
+        range.maxY = range.minY;
+    return range;
+}
+
+double Grid::getTileSize() const {
+    return tileSize;
+}
+
+int Grid::getImageSize() const {
+    return imageSize;
+}
+
+std::string Grid::tileFileName(int x, int y) {
+    return "img" + std::to_string(x) + "-" + std::to_string(y) + ".png";
+}
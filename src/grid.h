@@ -0,0 +1,50 @@
+#pragma once
+
+#include "common.h"
+
+#include <set>
+#include <string>
+#include <utility>
+
+// Inclusive range of tile indices
+struct TileRange {
+    int minX, maxX, minY, maxY;
+
+    int width() const;
+
+    int height() const;
+
+    bool contains(int x, int y) const;
+};
+
+// Set of (x, y) tile indices
+typedef std::set<std::pair<int, int>> TileSet;
+
+/*
+ * Square tiles of tileSize projected meters laid out around center, tile
+ * (tiles/2, tiles/2) being the one centered on it; x grows east, y south.
+ * Indices outside [0, tiles) are valid and continue the lattice.
+ */
+class Grid {
+public:
+    Grid(point center, double tileSize, int tiles, int imageSize);
+
+    MinMax tileMinMax(int x, int y) const;
+
+    TileRange fullRange() const;
+
+    // Tiles covering a projected bounding box
+    TileRange rangeFor(const MinMax& bbox) const;
+
+    double getTileSize() const;
+
+    int getImageSize() const;
+
+    static std::string tileFileName(int x, int y);
+
+private:
+    point center;
+    double tileSize;
+    int tiles;
+    int imageSize;
+};
@@ -0,0 +1,231 @@
+#include "heap_profile.h"
+
+#include "memory.h"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+
+#include <cerrno>
+#include <cstdlib>
+#endif
+
+namespace {
+    std::atomic<bool> counting(false);
+
+    // Plain integers with constant initializers live in static TLS, so touching them never allocates
+    thread_local int64_t live = 0, peak = 0;
+    // Level of the innermost running probe at its start; frees don't take live below it
+    thread_local int64_t liveFloor = INT64_MIN;
+
+    struct StageStats {
+        size_t count = 0;
+        int64_t maxHeap = 0, sumHeap = 0;
+        size_t maxRss = 0, peakRssGrowth = 0;
+    };
+
+    struct TileStats {
+        int x, y;
+        heap::Sample sample;
+    };
+
+    std::mutex statsMutex;
+    std::map<std::string, StageStats> stages;
+    std::vector<TileStats> tiles;
+
+    double megabytes(double bytes) {
+        return bytes / (1 << 20);
+    }
+}
+
+#ifdef __GLIBC__
+extern "C" {
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void* pointer, size_t size);
+    void* __libc_memalign(size_t alignment, size_t size);
+    void* __libc_valloc(size_t size);
+    void* __libc_pvalloc(size_t size);
+    void __libc_free(void* pointer);
+}
+
+namespace {
+    inline void allocated(void* pointer) {
+        if (pointer && counting.load(std::memory_order_relaxed)) {
+            live += malloc_usable_size(pointer);
+            if (live > peak)
+                peak = live;
+        }
+    }
+
+    inline void released(size_t size) {
+        live = std::max(live - int64_t(size), liveFloor);
+    }
+
+    inline void freed(void* pointer) {
+        // Frees from another thread than the allocation's land on the freeing thread
+        if (pointer && counting.load(std::memory_order_relaxed))
+            released(malloc_usable_size(pointer));
+    }
+}
+
+extern "C" {
+    void* malloc(size_t size) noexcept {
+        void* pointer = __libc_malloc(size);
+        allocated(pointer);
+        return pointer;
+    }
+
+    void* calloc(size_t count, size_t size) noexcept {
+        void* pointer = __libc_calloc(count, size);
+        allocated(pointer);
+        return pointer;
+    }
+
+    void* realloc(void* pointer, size_t size) noexcept {
+        size_t before = pointer && counting.load(std::memory_order_relaxed) ? malloc_usable_size(pointer) : 0;
+        void* result = __libc_realloc(pointer, size);
+        // On failure the old block is still there
+        if (result || !size) {
+            released(before);
+            allocated(result);
+        }
+        return result;
+    }
+
+    void* memalign(size_t alignment, size_t size) noexcept {
+        void* pointer = __libc_memalign(alignment, size);
+        allocated(pointer);
+        return pointer;
+    }
+
+    void* aligned_alloc(size_t alignment, size_t size) noexcept {
+        return memalign(alignment, size);
+    }
+
+    int posix_memalign(void** result, size_t alignment, size_t size) noexcept {
+        if (alignment < sizeof(void*) || (alignment & (alignment - 1)))
+            return EINVAL;
+        void* pointer = memalign(alignment, size);
+        if (!pointer)
+            return ENOMEM;
+        *result = pointer;
+        return 0;
+    }
+
+    void* valloc(size_t size) noexcept {
+        void* pointer = __libc_valloc(size);
+        allocated(pointer);
+        return pointer;
+    }
+
+    void* pvalloc(size_t size) noexcept {
+        void* pointer = __libc_pvalloc(size);
+        allocated(pointer);
+        return pointer;
+    }
+
+    void free(void* pointer) noexcept {
+        freed(pointer);
+        __libc_free(pointer);
+    }
+}
+#endif
+
+namespace heap {
+    void enable(bool on) {
+        counting.store(on, std::memory_order_relaxed);
+    }
+
+    bool enabled() {
+        return counting.load(std::memory_order_relaxed);
+    }
+
+    // Reading /proc allocates, so it stays outside the measured part
+    void Probe::start() {
+        startPeakRss = memory::peakRss();
+        startLive = live;
+        outerPeak = peak;
+        outerFloor = liveFloor;
+        peak = live;
+        liveFloor = live;
+    }
+
+    Sample Probe::finish() {
+        Sample sample;
+        sample.heapPeak = peak - startLive;
+        peak = std::max(peak, outerPeak);
+        liveFloor = outerFloor;
+        sample.rss = memory::currentRss();
+        sample.peakRssGrowth = memory::peakRss() - startPeakRss;
+        return sample;
+    }
+
+    void addStage(const char* name, const Sample& sample) {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        StageStats& stats = stages[name];
+        stats.count++;
+        stats.maxHeap = std::max(stats.maxHeap, sample.heapPeak);
+        stats.sumHeap += sample.heapPeak;
+        stats.maxRss = std::max(stats.maxRss, sample.rss);
+        stats.peakRssGrowth += sample.peakRssGrowth;
+    }
+
+    void addTile(int x, int y, const Sample& sample) {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        tiles.push_back({x, y, sample});
+    }
+
+    void report(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        std::vector<std::pair<std::string, StageStats>> sorted(stages.begin(), stages.end());
+        std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, StageStats>& a, const std::pair<std::string, StageStats>& b) {
+            return a.second.maxHeap > b.second.maxHeap;
+        });
+        out << "Peak RSS " << std::fixed << std::setprecision(1) << megabytes(memory::peakRss()) << " MB\n"
+            << "Stages nest, so a stage's heap includes the stages inside it\n\n"
+            << std::left << std::setw(28) << "stage" << std::right << std::setw(8) << "runs"
+            << std::setw(16) << "max heap MB" << std::setw(16) << "mean heap MB" << std::setw(14) << "max rss MB"
+            << std::setw(18) << "raised peak MB" << "\n";
+        for (const auto& stage: sorted) {
+            const StageStats& stats = stage.second;
+            out << std::left << std::setw(28) << stage.first << std::right << std::setw(8) << stats.count
+                << std::setw(16) << megabytes(stats.maxHeap) << std::setw(16) << megabytes(double(stats.sumHeap) / stats.count)
+                << std::setw(14) << megabytes(stats.maxRss) << std::setw(18) << megabytes(stats.peakRssGrowth) << "\n";
+        }
+
+        std::vector<TileStats> sortedTiles = tiles;
+        std::sort(sortedTiles.begin(), sortedTiles.end(), [](const TileStats& a, const TileStats& b) {
+            return a.sample.heapPeak > b.sample.heapPeak;
+        });
+        if (!sortedTiles.empty()) {
+            out << "\n" << std::left << std::setw(28) << "tile" << std::right << std::setw(16) << "heap MB"
+                << std::setw(14) << "rss MB" << std::setw(18) << "raised peak MB" << "\n";
+        }
+        for (const auto& tile: sortedTiles) {
+            out << std::left << std::setw(28) << (std::to_string(tile.x) + "," + std::to_string(tile.y)) << std::right
+                << std::setw(16) << megabytes(tile.sample.heapPeak) << std::setw(14) << megabytes(tile.sample.rss)
+                << std::setw(18) << megabytes(tile.sample.peakRssGrowth) << "\n";
+        }
+    }
+
+    void write(const std::string& filename) {
+        std::ofstream out(filename);
+        if (!out) {
+            throw std::runtime_error("Can't open file " + filename);
+        }
+        report(out);
+        if (!out) {
+            throw std::runtime_error("Can't write data to file " + filename);
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+/*
+ * Memory profile of the render stages. While it is on, malloc and its
+ * relatives (and so operator new, QImage and cv::Mat) count the bytes
+ * each thread holds, and every probe reports the high-water mark of its
+ * thread's heap above the level it started at, the RSS it ended with and
+ * how far it pushed the process's peak RSS. Allocations are only counted
+ * with glibc; elsewhere the heap columns stay zero.
+ */
+namespace heap {
+    void enable(bool on);
+
+    bool enabled();
+
+    struct Sample {
+        // Highest heap bytes the thread held above its level at start()
+        int64_t heapPeak;
+        size_t rss;
+        // How much the process peak RSS grew between start() and finish(), by any thread
+        size_t peakRssGrowth;
+    };
+
+    // Probes on a thread must finish in the reverse order they started. Frees of blocks
+    // the thread got before the innermost probe started don't take its heap below the
+    // level at start(), so those blocks can't hide what the probe allocates
+    class Probe {
+    public:
+        void start();
+        Sample finish();
+
+    private:
+        int64_t startLive, outerPeak, outerFloor;
+        size_t startPeakRss;
+    };
+
+    void addStage(const char* name, const Sample& sample);
+
+    void addTile(int x, int y, const Sample& sample);
+
+    // Per-stage and per-tile high-water marks of everything added so far, largest first
+    void report(std::ostream& out);
+
+    void write(const std::string& filename);
+}
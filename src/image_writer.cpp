@@ -0,0 +1,104 @@
+#include "image_writer.h"
+#include "metrics.h"
+#include "trace.h"
+
+namespace {
+    const int WRITER_THREADS = 2;
+    const size_t QUEUE_CAPACITY = 16;
+}
+
+ImageWriter& ImageWriter::instance() {
+    static ImageWriter writer(WRITER_THREADS, QUEUE_CAPACITY);
+    return writer;
+}
+
+ImageWriter::ImageWriter(int threadCount, size_t capacity_) :
+    capacity(capacity_),
+    active(0),
+    stopping(false)
+{
+    for (int i = 0; i < threadCount; i++)
+        threads.emplace_back(&ImageWriter::run, this);
+}
+
+ImageWriter::~ImageWriter() {
+    flush();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    notEmpty.notify_all();
+    for (auto& thread: threads)
+        thread.join();
+}
+
+void ImageWriter::save(const QImage& image, const std::string& filename) {
+    push({[image]{ return image; }, filename});
+}
+
+void ImageWriter::push(Job job) {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this]{ return jobs.size() < capacity; });
+        jobs.push_back(std::move(job));
+    }
+    notEmpty.notify_one();
+}
+
+void ImageWriter::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this]{ return jobs.empty() && active == 0; });
+}
+
+void ImageWriter::setPngOptions(const PngOptions& options) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pngOptions = options;
+}
+
+void ImageWriter::setDebugLayers(const std::set<std::string>& layers) {
+    std::lock_guard<std::mutex> lock(mutex);
+    debugLayers = layers;
+}
+
+bool ImageWriter::debugEnabled(const std::string& layer) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return debugLayers.count(layer) != 0 || debugLayers.count("all") != 0;
+}
+
+void ImageWriter::saveDebug(const std::string& layer, const std::string& name, int xTile, int yTile,
+                            std::function<QImage()> makeImage) {
+    if (!debugEnabled(layer))
+        return;
+    push({std::move(makeImage), name + "-" + std::to_string(xTile) + "-" + std::to_string(yTile) + ".png"});
+}
+
+void ImageWriter::run() {
+    while (true) {
+        Job job;
+        PngOptions options;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            notEmpty.wait(lock, [this]{ return stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+            options = pngOptions;
+            active++;
+        }
+        notFull.notify_one();
+        try {
+            int64_t start = trace::now();
+            savePng(job.makeImage(), job.filename, options);
+            if (trace::enabled())
+                trace::record("png.save", start, trace::now() - start, "\"file\":" + trace::jsonString(job.filename));
+        } catch (const std::exception& e) {
+            metrics::log("Can't save " + job.filename + ": " + e.what(), true);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            active--;
+        }
+        idle.notify_all();
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "png_writer.h"
+
+#include <QImage>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Saves images on background threads. The queue is bounded: save() blocks
+ * while it is full, so a slow disk throttles the producers instead of
+ * piling up images in memory.
+ *
+ * Debug dumps are off unless their layer ("hills", "rivers", "forests" or
+ * "all") was enabled, and are named <name>-<xTile>-<yTile>.png so
+ * concurrent tiles don't overwrite each other.
+ */
+class ImageWriter {
+public:
+    static ImageWriter& instance();
+
+    ~ImageWriter();
+
+    void save(const QImage& image, const std::string& filename);
+
+    // Blocks until everything queued so far is on disk
+    void flush();
+
+    void setPngOptions(const PngOptions& options);
+
+    void setDebugLayers(const std::set<std::string>& layers);
+
+    bool debugEnabled(const std::string& layer) const;
+
+    // makeImage runs on a writer thread and only if the layer is enabled
+    void saveDebug(const std::string& layer, const std::string& name, int xTile, int yTile,
+                   std::function<QImage()> makeImage);
+
+private:
+    struct Job {
+        std::function<QImage()> makeImage;
+        std::string filename;
+    };
+
+    ImageWriter(int threads, size_t capacity);
+
+    void push(Job job);
+    void run();
+
+    size_t capacity;
+    std::deque<Job> jobs;
+    int active;
+    bool stopping;
+    std::set<std::string> debugLayers;
+    PngOptions pngOptions;
+    mutable std::mutex mutex;
+    std::condition_variable notEmpty, notFull, idle;
+    std::vector<std::thread> threads;
+};
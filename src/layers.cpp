@@ -0,0 +1,84 @@
+#include "layers.h"
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+    // Places are cut by roads, rail and forests
+    const std::map<Layer, LayerSet> DEPENDENCIES{
+        {Layer::PLACES, {Layer::ROADS, Layer::RAIL, Layer::FORESTS}}
+    };
+}
+
+const std::vector<Layer>& allLayers() {
+    static const std::vector<Layer> layers{Layer::HILLS, Layer::FORESTS, Layer::RIVERS, Layer::ROADS, Layer::RAIL, Layer::PLACES};
+    return layers;
+}
+
+const LayerSet& allLayerSet() {
+    static const LayerSet layers(allLayers().begin(), allLayers().end());
+    return layers;
+}
+
+std::string layerName(Layer layer) {
+    switch (layer) {
+        case Layer::HILLS: return "hills";
+        case Layer::FORESTS: return "forests";
+        case Layer::RIVERS: return "rivers";
+        case Layer::ROADS: return "roads";
+        case Layer::RAIL: return "rail";
+        case Layer::PLACES: return "places";
+    }
+    return "";
+}
+
+LayerSet parseLayers(const std::string& spec) {
+    LayerSet result;
+    std::istringstream stream(spec);
+    std::string name;
+    while (std::getline(stream, name, ',')) {
+        if (name == "all") {
+            result = allLayerSet();
+            continue;
+        }
+        auto layer = std::find_if(allLayers().begin(), allLayers().end(), [&name](Layer layer) { return layerName(layer) == name; });
+        if (layer == allLayers().end())
+            throw std::runtime_error("Unknown layer " + name);
+        result.insert(*layer);
+    }
+    if (result.empty())
+        throw std::runtime_error("No layers in " + spec);
+    return result;
+}
+
+std::string layerNames(const LayerSet& layers) {
+    std::string result;
+    for (auto layer: allLayers())
+        if (layers.count(layer))
+            result += (result.empty() ? "" : ",") + layerName(layer);
+    return result;
+}
+
+LayerSet withDependencies(const LayerSet& layers) {
+    LayerSet result = layers;
+    for (auto layer: layers) {
+        auto dependencies = DEPENDENCIES.find(layer);
+        if (dependencies != DEPENDENCIES.end())
+            result.insert(dependencies->second.begin(), dependencies->second.end());
+    }
+    return result;
+}
+
+bool needsDem(const LayerSet& layers) {
+    // Forests shade their canopy on top of the terrain
+    return layers.count(Layer::HILLS) != 0 || layers.count(Layer::FORESTS) != 0;
+}
+
+bool needsOsm(const LayerSet& layers) {
+    for (auto layer: layers)
+        if (layer != Layer::HILLS)
+            return true;
+    return false;
+}
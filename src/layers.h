@@ -0,0 +1,32 @@
+#pragma once
+
+#include <set>
+#include <string>
+#include <vector>
+
+// Map layers in compositing order, bottom to top
+enum class Layer {HILLS, FORESTS, RIVERS, ROADS, RAIL, PLACES};
+
+typedef std::set<Layer> LayerSet;
+
+const std::vector<Layer>& allLayers();
+
+// allLayers() as a set
+const LayerSet& allLayerSet();
+
+std::string layerName(Layer layer);
+
+// Comma-separated layer names or "all"; throws on an unknown name and on an empty list
+LayerSet parseLayers(const std::string& spec);
+
+// Comma-separated names of the layers in compositing order, as parseLayers reads them
+std::string layerNames(const LayerSet& layers);
+
+// Adds the layers whose handlers the given ones take input from
+LayerSet withDependencies(const LayerSet& layers);
+
+// Whether any of the layers reads the DEM
+bool needsDem(const LayerSet& layers);
+
+// Whether any of the layers reads the OSM file
+bool needsOsm(const LayerSet& layers);
@@ -0,0 +1,163 @@
+#include "memory.h"
+
+#include "srtm.h"
+#include "osm_main.h"
+#include "osm_forests.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace {
+    const auto SAMPLE_INTERVAL = std::chrono::milliseconds(200);
+    const double MIN_CORRECTION = 0.5;
+    const double MAX_CORRECTION = 4;
+
+    // Full-size ARGB images alive at the peak of drawTile: the layers, rail's
+    // two canvases, rivers' base copy, hills and the composited result
+    const int TILE_IMAGES = 9;
+    // QPainterPath unions and other per-tile bookkeeping
+    const size_t TILE_OVERHEAD = 64 << 20;
+}
+
+namespace memory {
+
+size_t currentRss() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+size_t peakRss() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            std::istringstream value(line.substr(6));
+            size_t kb = 0;
+            value >> kb;
+            return kb << 10;
+        }
+    }
+    return currentRss();
+}
+
+size_t physicalMemory() {
+    return size_t(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGESIZE);
+}
+
+size_t estimateTile(const Projector& proj, const MinMax& minmax, int imageSize, const std::string& osmFile,
+                    const LayerSet& layers, bool sharedFeatures) {
+    LayerSet run = withDependencies(layers);
+    size_t images = size_t(TILE_IMAGES) * imageSize * imageSize * 4;
+    return images
+        + (needsDem(run) ? SRTMtoCV::estimateMemory(proj, minmax, imageSize) : 0)
+        + (run.count(Layer::FORESTS) ? OsmForestsHandler::estimateMemory(imageSize) : 0)
+        + (needsOsm(run) && !sharedFeatures ? OsmDrawer::estimateMemory(osmFile) : 0)
+        + TILE_OVERHEAD;
+}
+
+}
+
+MemoryBudget::MemoryBudget(size_t budget_) :
+    budget(budget_),
+    baseline(memory::currentRss()),
+    reserved(0),
+    rawReserved(0),
+    inFlight(0),
+    correction(1),
+    stopping(false),
+    sampler(&MemoryBudget::sample, this)
+{}
+
+MemoryBudget::~MemoryBudget() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    sampler.join();
+}
+
+size_t MemoryBudget::getBudget() const {
+    return budget;
+}
+
+void MemoryBudget::hold(size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        baseline += bytes;
+        // Still one tile at a time when nothing is left
+        if (budget != 0)
+            budget = budget > bytes ? budget - bytes : 1;
+    }
+    changed.notify_all();
+}
+
+double MemoryBudget::getCorrection() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return correction;
+}
+
+size_t MemoryBudget::acquire(size_t estimate) {
+    std::unique_lock<std::mutex> lock(mutex);
+    size_t bytes = estimate * correction;
+    changed.wait(lock, [&]{
+        bytes = estimate * correction;
+        return budget == 0 || inFlight == 0 || reserved + bytes <= budget;
+    });
+    reserved += bytes;
+    rawReserved += estimate;
+    inFlight++;
+    return bytes;
+}
+
+void MemoryBudget::release(size_t estimate, size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        reserved -= bytes;
+        rawReserved -= estimate;
+        inFlight--;
+    }
+    changed.notify_all();
+}
+
+void MemoryBudget::sample() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        changed.wait_for(lock, SAMPLE_INTERVAL);
+        if (stopping || rawReserved == 0)
+            continue;
+        lock.unlock();
+        size_t rss = memory::currentRss();
+        lock.lock();
+        if (rawReserved == 0)
+            continue;
+        double observed = rss > baseline ? double(rss - baseline) / rawReserved : 0;
+        // Follow growth at once, decay slowly since freed memory isn't always returned to the system
+        double next = observed > correction ? observed : 0.9 * correction + 0.1 * observed;
+        next = std::min(std::max(next, MIN_CORRECTION), MAX_CORRECTION);
+        if (next < correction)
+            changed.notify_all();
+        correction = next;
+    }
+}
+
+MemoryBudget::Reservation::Reservation(MemoryBudget& budget_, size_t estimate_) :
+    budget(budget_),
+    estimate(estimate_),
+    bytes(budget_.acquire(estimate_))
+{}
+
+MemoryBudget::Reservation::~Reservation() {
+    budget.release(estimate, bytes);
+}
+
+size_t MemoryBudget::Reservation::getBytes() const {
+    return bytes;
+}
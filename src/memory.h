@@ -0,0 +1,75 @@
+#pragma once
+
+#include "common.h"
+#include "layers.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace memory {
+    size_t currentRss();
+
+    size_t peakRss();
+
+    size_t physicalMemory();
+
+    // Up-front estimate of the peak memory drawTile needs for one tile of layers; with sharedFeatures
+    // the tile replays a FeatureStore and builds no node location index of its own
+    size_t estimateTile(const Projector& proj, const MinMax& minmax, int imageSize, const std::string& osmFile,
+                        const LayerSet& layers = allLayerSet(), bool sharedFeatures = false);
+}
+
+/*
+ * Admission controller for tiles. A tile is started only while the sum of
+ * the estimates of the tiles in flight stays under the budget; one tile is
+ * always let through so that a too small budget can't stall the render.
+ * A sampler thread compares the RSS growth to the estimates of the tiles
+ * in flight and scales further estimates by the observed ratio.
+ */
+class MemoryBudget {
+public:
+    // budget == 0 means unlimited
+    explicit MemoryBudget(size_t budget);
+    ~MemoryBudget();
+
+    class Reservation {
+    public:
+        Reservation(MemoryBudget& budget, size_t estimate);
+        ~Reservation();
+
+        size_t getBytes() const;
+
+    private:
+        MemoryBudget& budget;
+        size_t estimate;
+        size_t bytes;
+    };
+
+    size_t getBudget() const;
+
+    // Takes bytes that stay resident for the rest of the run, such as inputs the tiles share,
+    // out of the budget and out of the RSS growth the correction attributes to tiles
+    void hold(size_t bytes);
+
+    // Current estimate-to-RSS correction factor
+    double getCorrection() const;
+
+private:
+    size_t acquire(size_t estimate);
+    void release(size_t estimate, size_t bytes);
+    void sample();
+
+    size_t budget;
+    size_t baseline;
+    size_t reserved;
+    size_t rawReserved;
+    int inFlight;
+    double correction;
+    bool stopping;
+    mutable std::mutex mutex;
+    std::condition_variable changed;
+    std::thread sampler;
+};
@@ -0,0 +1,250 @@
+#include "metrics.h"
+
+#include "memory.h"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace {
+    const int64_t BOUNDS[metrics::Histogram::BUCKETS] = {
+        1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+        1000000, 2500000, 5000000, 10000000, 30000000, 60000000, 300000000, 600000000
+    };
+
+    struct Family {
+        std::string help;
+        const char* type = nullptr;
+        std::map<std::string, std::unique_ptr<metrics::Counter>> counters;
+        std::map<std::string, std::unique_ptr<metrics::Gauge>> gauges;
+        std::map<std::string, std::unique_ptr<metrics::Histogram>> histograms;
+    };
+
+    std::mutex registryMutex;
+
+    // Serializes the status line and log(); status is what a terminal Reporter shows, empty when none does
+    std::mutex consoleMutex;
+    std::string status;
+    std::map<std::string, Family>& registry() {
+        static std::map<std::string, Family> families;
+        return families;
+    }
+
+    template<class T>
+    T& find(const std::string& name, const std::string& help, const char* type, const std::string& labels,
+            std::map<std::string, std::unique_ptr<T>> Family::* series) {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        Family& family = registry()[name];
+        if (!family.type) {
+            family.help = help;
+            family.type = type;
+        } else if (std::string(family.type) != type) {
+            throw std::runtime_error("Metric " + name + " is a " + family.type + ", not a " + type);
+        }
+        auto& metric = (family.*series)[labels];
+        if (!metric)
+            metric.reset(new T());
+        return *metric;
+    }
+
+    std::string braces(const std::string& labels, const std::string& extra = "") {
+        if (labels.empty() && extra.empty())
+            return "";
+        return "{" + labels + (labels.empty() || extra.empty() ? "" : ",") + extra + "}";
+    }
+
+    std::string seconds(int64_t microseconds) {
+        std::ostringstream out;
+        out.precision(12);
+        out << microseconds / 1e6;
+        return out.str();
+    }
+
+    std::string megabytes(size_t bytes) {
+        return std::to_string(bytes >> 20) + " MB";
+    }
+
+    std::string duration(int64_t seconds) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%d:%02d:%02d", int(seconds / 3600), int(seconds / 60 % 60), int(seconds % 60));
+        return buffer;
+    }
+}
+
+namespace metrics {
+    void Histogram::observe(int64_t microseconds) {
+        int i = 0;
+        while (i < BUCKETS && microseconds > BOUNDS[i])
+            i++;
+        counts[i].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(microseconds, std::memory_order_relaxed);
+    }
+
+    int64_t Histogram::bound(int i) {
+        return BOUNDS[i];
+    }
+
+    uint64_t Histogram::cumulative(int i) const {
+        uint64_t result = 0;
+        for (int j = 0; j <= i; j++)
+            result += counts[j].load(std::memory_order_relaxed);
+        return result;
+    }
+
+    Counter& counter(const std::string& name, const std::string& help, const std::string& labels) {
+        return find(name, help, "counter", labels, &Family::counters);
+    }
+
+    Gauge& gauge(const std::string& name, const std::string& help, const std::string& labels) {
+        return find(name, help, "gauge", labels, &Family::gauges);
+    }
+
+    Histogram& histogram(const std::string& name, const std::string& help, const std::string& labels) {
+        return find(name, help, "histogram", labels, &Family::histograms);
+    }
+
+    Histogram& stage(const char* name) {
+        // Span names outlive the process, so their addresses key a lock-free lookup
+        thread_local std::unordered_map<const char*, Histogram*> stages;
+        Histogram*& result = stages[name];
+        if (!result)
+            result = &histogram("drawmap_stage_seconds", "Duration of render stages", "stage=\"" + std::string(name) + "\"");
+        return *result;
+    }
+
+    Tiles& tiles() {
+        static Tiles tiles = {
+            gauge("drawmap_tiles", "Tiles in the batch"),
+            gauge("drawmap_tiles_in_flight", "Tiles being rendered"),
+            counter("drawmap_tiles_finished_total", "Tiles finished", "result=\"rendered\""),
+            counter("drawmap_tiles_finished_total", "Tiles finished", "result=\"reused\""),
+            counter("drawmap_tiles_finished_total", "Tiles finished", "result=\"failed\"")
+        };
+        return tiles;
+    }
+
+    Dem& dem() {
+        static Dem dem = {
+            counter("drawmap_dem_cells_total", "DEM cell lookups", "result=\"hit\""),
+            counter("drawmap_dem_cells_total", "DEM cell lookups", "result=\"miss\"")
+        };
+        return dem;
+    }
+
+    std::string exposition() {
+        std::ostringstream out;
+        std::lock_guard<std::mutex> lock(registryMutex);
+        for (const auto& entry: registry()) {
+            const std::string& name = entry.first;
+            const Family& family = entry.second;
+            out << "# HELP " << name << " " << family.help << "\n"
+                << "# TYPE " << name << " " << family.type << "\n";
+            for (const auto& series: family.counters)
+                out << name << braces(series.first) << " " << series.second->get() << "\n";
+            for (const auto& series: family.gauges)
+                out << name << braces(series.first) << " " << series.second->get() << "\n";
+            for (const auto& series: family.histograms) {
+                const Histogram& histogram = *series.second;
+                for (int i = 0; i < Histogram::BUCKETS; i++) {
+                    out << name << "_bucket" << braces(series.first, "le=\"" + seconds(Histogram::bound(i)) + "\"")
+                        << " " << histogram.cumulative(i) << "\n";
+                }
+                out << name << "_bucket" << braces(series.first, "le=\"+Inf\"") << " " << histogram.cumulative(Histogram::BUCKETS) << "\n"
+                    << name << "_sum" << braces(series.first) << " " << seconds(histogram.sum()) << "\n"
+                    << name << "_count" << braces(series.first) << " " << histogram.cumulative(Histogram::BUCKETS) << "\n";
+            }
+        }
+        return out.str();
+    }
+
+    Reporter::Reporter(const std::string& filename_, int intervalSeconds) :
+        filename(filename_),
+        interval(intervalSeconds),
+        start(std::chrono::steady_clock::now()),
+        terminal(isatty(STDERR_FILENO)),
+        stopping(false),
+        thread(&Reporter::run, this)
+    {}
+
+    Reporter::~Reporter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        thread.join();
+        report(true);
+    }
+
+    void Reporter::run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!wake.wait_for(lock, interval, [this] { return stopping; })) {
+            lock.unlock();
+            report(false);
+            lock.lock();
+        }
+    }
+
+    void Reporter::report(bool last) {
+        int64_t elapsed = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start).count();
+        Tiles& progress = tiles();
+        int64_t total = progress.total.get();
+        int64_t finished = progress.finished();
+        // Reused tiles finish at once, so early on an incremental render the ETA is optimistic
+        int64_t eta = finished ? (total - finished) * elapsed / finished : -1;
+        size_t rss = memory::currentRss(), peak = memory::peakRss();
+        uint64_t hits = dem().hits.get(), misses = dem().misses.get();
+
+        gauge("drawmap_elapsed_seconds", "Time since the batch started").set(elapsed);
+        gauge("drawmap_eta_seconds", "Estimated time to finish the batch, -1 until a tile is done").set(eta);
+        gauge("drawmap_rss_bytes", "Resident set size").set(rss);
+        gauge("drawmap_peak_rss_bytes", "Peak resident set size").set(peak);
+
+        if (!filename.empty()) {
+            // Renamed into place so a scraper never reads half a file
+            std::string temporary = filename + ".tmp";
+            {
+                std::ofstream out(temporary);
+                out << exposition();
+                if (!out) {
+                    std::cerr << "Can't write metrics to " << temporary << std::endl;
+                    return;
+                }
+            }
+            if (std::rename(temporary.c_str(), filename.c_str()) != 0)
+                std::cerr << "Can't rename " << temporary << " to " << filename << std::endl;
+        }
+
+        std::ostringstream line;
+        line << finished << "/" << total << " tiles, " << progress.inFlight.get() << " in flight";
+        if (progress.failed.get())
+            line << ", " << progress.failed.get() << " failed";
+        if (hits + misses)
+            line << ", DEM hits " << 100 * hits / (hits + misses) << "%";
+        line << ", rss " << megabytes(rss) << " (peak " << megabytes(peak) << "), elapsed " << duration(elapsed);
+        if (!last && eta >= 0)
+            line << ", ETA " << duration(eta);
+        std::lock_guard<std::mutex> lock(consoleMutex);
+        if (terminal) {
+            std::cerr << "\r" << line.str() << "\033[K" << (last ? "\n" : "") << std::flush;
+            status = last ? "" : line.str();
+        } else {
+            std::cerr << line.str() << std::endl;
+        }
+    }
+
+    void log(const std::string& line, bool error) {
+        std::lock_guard<std::mutex> lock(consoleMutex);
+        if (!status.empty())
+            std::cerr << "\r" << line << "\033[K\n" << status << std::flush;
+        else
+            (error ? std::cerr : std::cout) << line << std::endl;
+    }
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/*
+ * Process-wide counters, gauges and latency histograms, exported in the
+ * Prometheus text format. A metric is created on first use and lives as
+ * long as the process, so callers may keep the reference; updates are
+ * relaxed atomics. Labels are the text between the braces, e.g.
+ * layer="roads".
+ */
+namespace metrics {
+    class Counter {
+    public:
+        void add(uint64_t n = 1) {
+            value.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        uint64_t get() const {
+            return value.load(std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<uint64_t> value{0};
+    };
+
+    class Gauge {
+    public:
+        void set(int64_t n) {
+            value.store(n, std::memory_order_relaxed);
+        }
+
+        void add(int64_t n) {
+            value.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        int64_t get() const {
+            return value.load(std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<int64_t> value{0};
+    };
+
+    // Latencies in fixed buckets from 1 ms to 10 min
+    class Histogram {
+    public:
+        static const int BUCKETS = 16;
+
+        void observe(int64_t microseconds);
+
+        // Upper bound of bucket i in microseconds
+        static int64_t bound(int i);
+
+        // Observations not above bound(i); i == BUCKETS counts all of them
+        uint64_t cumulative(int i) const;
+
+        int64_t sum() const {
+            return total.load(std::memory_order_relaxed);
+        }
+
+    private:
+        // The last bucket holds everything above the largest bound
+        std::atomic<uint64_t> counts[BUCKETS + 1] = {};
+        std::atomic<int64_t> total{0};
+    };
+
+    Counter& counter(const std::string& name, const std::string& help, const std::string& labels = "");
+
+    Gauge& gauge(const std::string& name, const std::string& help, const std::string& labels = "");
+
+    Histogram& histogram(const std::string& name, const std::string& help, const std::string& labels = "");
+
+    // Latency of the trace spans with this name
+    Histogram& stage(const char* name);
+
+    // Progress of a batch render
+    struct Tiles {
+        Gauge& total;
+        Gauge& inFlight;
+        Counter& rendered;
+        // Taken unchanged from a previous run
+        Counter& reused;
+        Counter& failed;
+
+        uint64_t finished() const {
+            return rendered.get() + reused.get() + failed.get();
+        }
+    };
+
+    Tiles& tiles();
+
+    // Lookups of one-degree DEM cells, a miss loads the cell from disk
+    struct Dem {
+        Counter& hits;
+        Counter& misses;
+    };
+
+    Dem& dem();
+
+    // Every metric in the Prometheus text format
+    std::string exposition();
+
+    /*
+     * Prints a line of per-tile chatter to stdout, or stderr for errors.
+     * While a Reporter keeps its status line on a terminal, the line goes
+     * to stderr above it instead, so the two don't garble each other.
+     */
+    void log(const std::string& line, bool error = false);
+
+    /*
+     * Every interval until destroyed, refreshes the process gauges (RSS,
+     * ETA), rewrites filename if it isn't empty and prints a one-line
+     * status to stderr, in place when stderr is a terminal.
+     */
+    class Reporter {
+    public:
+        Reporter(const std::string& filename, int intervalSeconds);
+        ~Reporter();
+
+    private:
+        void run();
+        void report(bool last);
+
+        std::string filename;
+        std::chrono::seconds interval;
+        std::chrono::steady_clock::time_point start;
+        bool terminal;
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        bool stopping;
+        std::thread thread;
+    };
+}
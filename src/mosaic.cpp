@@ -0,0 +1,90 @@
+#include "mosaic.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+MosaicWriter::MosaicWriter(const std::string& filename, int tilesX_, int tilesY_, int tileSize_, int maxPendingRows_,
+                           const PngOptions& pngOptions) :
+    png(filename, tilesX_ * tileSize_, tilesY_ * tileSize_, pngOptions),
+    tilesX(tilesX_),
+    tilesY(tilesY_),
+    tileSize(tileSize_),
+    maxPendingRows(std::max(maxPendingRows_, 1)),
+    nextRow(0)
+{}
+
+void MosaicWriter::addTile(int x, int y, const QImage& image) {
+    if (x < 0 || x >= tilesX || y < 0 || y >= tilesY) {
+        throw std::runtime_error("Tile is outside of the mosaic");
+    }
+    QImage tile = image;
+    if (tile.format() != QImage::Format_ARGB32 && tile.format() != QImage::Format_ARGB32_Premultiplied
+            && tile.format() != QImage::Format_RGB32)
+        tile = tile.convertToFormat(QImage::Format_ARGB32);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    rowWritten.wait(lock, [&]{ return y < nextRow + maxPendingRows; });
+    if (y < nextRow) {
+        throw std::runtime_error("Tile is added to an already written row");
+    }
+    auto& row = pending[y];
+    row.resize(tilesX);
+    row[x] = tile;
+    writeReadyRows();
+}
+
+void MosaicWriter::waitForRow(int y) {
+    std::unique_lock<std::mutex> lock(mutex);
+    rowWritten.wait(lock, [&]{ return y < nextRow + maxPendingRows; });
+}
+
+int MosaicWriter::getMaxPendingRows() const {
+    return maxPendingRows;
+}
+
+void MosaicWriter::writeReadyRows() {
+    while (true) {
+        auto row = pending.find(nextRow);
+        if (row == pending.end())
+            return;
+        for (const auto& tile: row->second)
+            if (tile.isNull())
+                return;
+        writeRow(row->second);
+        pending.erase(row);
+        nextRow++;
+        rowWritten.notify_all();
+    }
+}
+
+void MosaicWriter::writeRow(const std::vector<QImage>& tiles) {
+    TRACE_SCOPE("mosaic.row");
+    std::vector<unsigned char> line(png.getWidth() * 4);
+    for (int dy = 0; dy < tileSize; dy++) {
+        std::fill(line.begin(), line.end(), 0);
+        for (int x = 0; x < tilesX; x++) {
+            const QImage& tile = tiles[x];
+            if (tile.isNull() || dy >= tile.height() || tile.width() != tileSize)
+                continue;
+            toRgba(tile, dy, line.data() + x * tileSize * 4);
+        }
+        png.writeRow(line.data());
+    }
+}
+
+void MosaicWriter::finish() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (nextRow < tilesY) {
+        auto row = pending.find(nextRow);
+        if (row != pending.end()) {
+            writeRow(row->second);
+            pending.erase(row);
+        } else {
+            writeRow(std::vector<QImage>(tilesX));
+        }
+        nextRow++;
+    }
+    rowWritten.notify_all();
+    png.finish();
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "png_writer.h"
+
+#include <QImage>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * Assembles the tile grid into one PNG without ever holding the whole
+ * mosaic: tiles are kept only until their row of tiles is complete, then
+ * the row is streamed to disk as a strip and released.
+ */
+class MosaicWriter {
+public:
+    MosaicWriter(const std::string& filename, int tilesX, int tilesY, int tileSize, int maxPendingRows = 2,
+                 const PngOptions& pngOptions = PngOptions());
+
+    /*
+     * Thread-safe. Blocks while y is maxPendingRows or more rows ahead of
+     * the first row that has not been written yet.
+     */
+    void addTile(int x, int y, const QImage& image);
+
+    // Blocks until a tile of row y could be added without blocking
+    void waitForRow(int y);
+
+    int getMaxPendingRows() const;
+
+    // Writes the remaining rows, with missing tiles left transparent
+    void finish();
+
+private:
+    void writeRow(const std::vector<QImage>& tiles);
+    void writeReadyRows();
+
+    PngWriter png;
+    int tilesX, tilesY, tileSize;
+    int maxPendingRows;
+    int nextRow;
+    std::map<int, std::vector<QImage>> pending;
+    std::mutex mutex;
+    std::condition_variable rowWritten;
+};
@@ -0,0 +1,255 @@
+#include "options.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+    void usage(const char* name) {
+        std::cerr << "Usage: " << name << " [options] OSMFILE\n"
+                  << "Options:\n"
+                  << "  --output FILE   mosaic file (default: final.png)\n"
+                  << "  --run DIR       keep finished tiles in DIR and resume from them when rerun with the same parameters\n"
+                  << "  --cache DIR     reuse layer images whose inputs and style haven't changed\n"
+                  << "  --changes FILE  re-render only the tiles an .osc change touches, reusing the other tile files;\n"
+                  << "                  needs --previous\n"
+                  << "  --previous FILE extract the change was applied to, for the old geometry of changed objects\n"
+                  << "  --serve PORT    serve /tile/Z/X/Y.png and /bbox/MINLON,MINLAT,MAXLON,MAXLAT.png on localhost\n"
+                  << "  --lru MB        encoded tiles the server keeps in memory (default: 256)\n"
+                  << "  --plan DIR      write the tile jobs of the grid into DIR for workers instead of rendering\n"
+                  << "  --worker DIR    render tiles planned in DIR, alongside any other workers sharing it\n"
+                  << "  --merge DIR     assemble the mosaic from the tiles rendered in DIR\n"
+                  << "  --claim-timeout MIN\n"
+                  << "                  minutes before a silent worker's tiles are taken over (default: 10)\n"
+                  << "  --center LON,LAT\n"
+                  << "                  center of the grid (default: 43.739319,56.162759)\n"
+                  << "  --tile-size M   tile side in projected meters (default: 25000)\n"
+                  << "  --tiles N       grid is N x N tiles (default: 10)\n"
+                  << "  --image-size PX tile side in pixels (default: 1200)\n"
+                  << "  --tile X,Y      render a single tile\n"
+                  << "  --range X0:X1,Y0:Y1\n"
+                  << "                  render an inclusive range of tiles\n"
+                  << "  --bbox MINLON,MINLAT,MAXLON,MAXLAT\n"
+                  << "                  render the tiles covering a bounding box\n"
+                  << "  --jobs N        number of render threads (default: one per core)\n"
+                  << "  --memory-budget MB\n"
+                  << "                  start tiles only while their estimated memory fits (default: 3/4 of RAM, 0: unlimited)\n"
+                  << "  --trace FILE    write per-tile stage timings as Chrome trace JSON (chrome://tracing, Perfetto)\n"
+                  << "  --metrics FILE  keep batch progress and stage latencies in a Prometheus text file\n"
+                  << "  --metrics-interval S\n"
+                  << "                  seconds between metrics file and status line updates (default: 10)\n"
+                  << "  --memory-profile FILE\n"
+                  << "                  count allocations and write the heap high-water mark of every stage and tile\n"
+                  << "  --dem FILE      read heights from a DEM mosaic made by --build-dem instead of the SRTM cells\n"
+                  << "  --build-dem FILE\n"
+                  << "                  write a DEM mosaic with overviews of the SRTM cells under the tiles, then exit\n"
+                  << "  --dem-smoothing MODE\n"
+                  << "                  bilateral (default), guided (about 4x faster) or fast (about 15x faster)\n"
+                  << "  --layers LAYERS draw only the comma-separated layers (hills, forests, rivers, roads, rail, places;\n"
+                  << "                  default: all), skipping the extract or the DEM when none of them need it\n"
+                  << "  --debug LAYERS  dump intermediate images of the comma-separated layers (hills, rivers, forests, all)\n"
+                  << "  --png PRESET    PNG compression: fast, default or archive\n"
+                  << "  --png-level N   zlib level 0..9, overrides the preset\n"
+                  << "  --png-strategy S\n"
+                  << "                  zlib strategy: default, filtered, rle or huffman, overrides the preset\n";
+        exit(1);
+    }
+
+    std::vector<std::string> split(const std::string& value, char separator) {
+        std::vector<std::string> result;
+        std::istringstream stream(value);
+        std::string item;
+        while (std::getline(stream, item, separator))
+            if (!item.empty())
+                result.push_back(item);
+        return result;
+    }
+
+    double toDouble(const std::string& value, const char* name) {
+        try {
+            size_t end;
+            double result = std::stod(value, &end);
+            if (end == value.size())
+                return result;
+        } catch (const std::exception&) {}
+        usage(name);
+        return 0;
+    }
+
+    std::vector<double> toDoubles(const std::string& value, size_t count, const char* name) {
+        std::vector<double> result;
+        for (const auto& item: split(value, ','))
+            result.push_back(toDouble(item, name));
+        if (result.size() != count)
+            usage(name);
+        return result;
+    }
+
+    int toInt(const std::string& value, const char* name) {
+        try {
+            size_t end;
+            int result = std::stoi(value, &end);
+            if (end == value.size())
+                return result;
+        } catch (const std::exception&) {}
+        usage(name);
+        return 0;
+    }
+}
+
+Options parseOptions(int argc, char* argv[]) {
+    Options options;
+    // Applied over the preset after parsing, so they hold in any order with --png
+    int pngLevel = -1, pngStrategy = -1;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc)
+                usage(argv[0]);
+            return argv[++i];
+        };
+        if (arg == "--output" || arg == "-o") {
+            options.output = value();
+        } else if (arg == "--run") {
+            options.runDir = value();
+        } else if (arg == "--cache") {
+            options.cacheDir = value();
+        } else if (arg == "--changes") {
+            options.changes = value();
+        } else if (arg == "--previous") {
+            options.previousOsmFile = value();
+        } else if (arg == "--plan") {
+            options.planDir = value();
+        } else if (arg == "--worker") {
+            options.workerDir = value();
+        } else if (arg == "--merge") {
+            options.mergeDir = value();
+        } else if (arg == "--claim-timeout") {
+            options.claimTimeout = toInt(value(), argv[0]);
+            if (options.claimTimeout <= 0)
+                usage(argv[0]);
+        } else if (arg == "--serve") {
+            options.servePort = toInt(value(), argv[0]);
+            if (options.servePort <= 0 || options.servePort > 65535)
+                usage(argv[0]);
+        } else if (arg == "--lru") {
+            options.lruMegabytes = toInt(value(), argv[0]);
+            if (options.lruMegabytes < 0)
+                usage(argv[0]);
+        } else if (arg == "--center") {
+            auto center = toDoubles(value(), 2, argv[0]);
+            options.centerLon = center[0];
+            options.centerLat = center[1];
+        } else if (arg == "--tile-size") {
+            options.tileSize = toDouble(value(), argv[0]);
+        } else if (arg == "--tiles") {
+            options.tiles = toInt(value(), argv[0]);
+        } else if (arg == "--image-size") {
+            options.imageSize = toInt(value(), argv[0]);
+        } else if (arg == "--tile") {
+            auto tile = split(value(), ',');
+            if (tile.size() != 2)
+                usage(argv[0]);
+            int x = toInt(tile[0], argv[0]), y = toInt(tile[1], argv[0]);
+            options.range = {x, x, y, y};
+            options.hasRange = true;
+        } else if (arg == "--range") {
+            auto axes = split(value(), ',');
+            if (axes.size() != 2)
+                usage(argv[0]);
+            auto xs = split(axes[0], ':');
+            auto ys = split(axes[1], ':');
+            if (xs.size() != 2 || ys.size() != 2)
+                usage(argv[0]);
+            options.range = {toInt(xs[0], argv[0]), toInt(xs[1], argv[0]), toInt(ys[0], argv[0]), toInt(ys[1], argv[0])};
+            if (options.range.width() <= 0 || options.range.height() <= 0)
+                usage(argv[0]);
+            options.hasRange = true;
+        } else if (arg == "--bbox") {
+            auto bbox = toDoubles(value(), 4, argv[0]);
+            std::copy(bbox.begin(), bbox.end(), options.bbox);
+            options.hasBBox = true;
+        } else if (arg == "--jobs" || arg == "-j") {
+            options.jobs = toInt(value(), argv[0]);
+        } else if (arg == "--memory-budget") {
+            options.memoryBudget = toInt(value(), argv[0]);
+        } else if (arg == "--trace") {
+            options.traceFile = value();
+        } else if (arg == "--metrics") {
+            options.metricsFile = value();
+        } else if (arg == "--metrics-interval") {
+            options.metricsInterval = toInt(value(), argv[0]);
+            if (options.metricsInterval <= 0)
+                usage(argv[0]);
+        } else if (arg == "--memory-profile") {
+            options.memoryProfile = value();
+        } else if (arg == "--layers") {
+            try {
+                options.layers = parseLayers(value());
+            } catch (const std::runtime_error&) {
+                usage(argv[0]);
+            }
+        } else if (arg == "--debug") {
+            for (const auto& layer: split(value(), ','))
+                options.debugLayers.insert(layer);
+        } else if (arg == "--dem") {
+            options.demMosaic = value();
+        } else if (arg == "--build-dem") {
+            options.buildDem = value();
+        } else if (arg == "--dem-smoothing") {
+            try {
+                options.demSmoothing = demSmooth::parse(value());
+            } catch (const std::runtime_error&) {
+                usage(argv[0]);
+            }
+        } else if (arg == "--png") {
+            try {
+                options.png = PngOptions::preset(value());
+            } catch (const std::runtime_error&) {
+                usage(argv[0]);
+            }
+        } else if (arg == "--png-level") {
+            pngLevel = toInt(value(), argv[0]);
+            if (pngLevel < 0 || pngLevel > 9)
+                usage(argv[0]);
+        } else if (arg == "--png-strategy") {
+            std::string strategy = value();
+            if (strategy == "default")
+                pngStrategy = Z_DEFAULT_STRATEGY;
+            else if (strategy == "filtered")
+                pngStrategy = Z_FILTERED;
+            else if (strategy == "rle")
+                pngStrategy = Z_RLE;
+            else if (strategy == "huffman")
+                pngStrategy = Z_HUFFMAN_ONLY;
+            else
+                usage(argv[0]);
+        } else if (!arg.empty() && arg[0] == '-') {
+            usage(argv[0]);
+        } else if (options.osmFile.empty()) {
+            options.osmFile = arg;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (pngLevel >= 0)
+        options.png.level = pngLevel;
+    if (pngStrategy >= 0)
+        options.png.strategy = pngStrategy;
+    int modes = !options.planDir.empty() + !options.workerDir.empty() + !options.mergeDir.empty() + (options.servePort > 0);
+    if (modes > 1)
+        usage(argv[0]);
+    // Without the old extract, objects the change moves or deletes would leave their old tiles stale
+    if (!options.changes.empty() && options.previousOsmFile.empty())
+        usage(argv[0]);
+    // Workers and the merge take the extract and the grid from the manifest; a DEM mosaic and
+    // layers drawn from the DEM alone need no extract
+    bool needsExtract = options.workerDir.empty() && options.mergeDir.empty() && options.buildDem.empty()
+                        && needsOsm(withDependencies(options.layers));
+    if ((needsExtract && options.osmFile.empty()) || options.tiles <= 0 || options.imageSize <= 0 || options.tileSize <= 0)
+        usage(argv[0]);
+    return options;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "dem_smooth.h"
+#include "grid.h"
+#include "layers.h"
+#include "png_writer.h"
+
+#include <set>
+#include <string>
+
+struct Options {
+    std::string osmFile;
+    std::string output = "final.png";
+    // Journaled directory of finished tiles that a rerun resumes from, empty for none
+    std::string runDir;
+    // Layer image cache directory, empty to disable
+    std::string cacheDir;
+    // OSM change file to re-render only the tiles it touches, and the extract it was applied to
+    std::string changes;
+    std::string previousOsmFile;
+    // Serve tiles on this localhost port instead of rendering the grid, 0 for batch mode
+    int servePort = 0;
+    int lruMegabytes = 256;
+    // Partitioned rendering through a shared directory: write its manifest, render its tiles
+    // as one of any number of workers, or assemble the mosaic from them; empty when not used
+    std::string planDir;
+    std::string workerDir;
+    std::string mergeDir;
+    // Minutes after which a worker's claim that hasn't been refreshed is taken over
+    int claimTimeout = 10;
+    // Chrome trace JSON written at the end of a batch run, empty for none
+    std::string traceFile;
+    // Prometheus text file rewritten every metricsInterval seconds of a batch run, empty for none;
+    // a status line goes to stderr at the same pace either way
+    std::string metricsFile;
+    int metricsInterval = 10;
+    // Per-stage and per-tile heap high-water marks written at the end of a batch run, empty for none
+    std::string memoryProfile;
+
+    // Grid of tiles tileSize x tileSize projected meters, imageSize pixels each
+    double centerLon = 43.739319, centerLat = 56.162759;
+    double tileSize = 25000;
+    int tiles = 10;
+    int imageSize = 1200;
+    // Tiles to render, the whole grid unless --tile, --range or --bbox is given
+    bool hasRange = false;
+    TileRange range;
+    bool hasBBox = false;
+    // min lon, min lat, max lon, max lat
+    double bbox[4];
+
+    // Render threads, 0 for one per core
+    int jobs = 0;
+    // RSS budget for tiles in flight in MB; 0 for unlimited, negative for 3/4 of physical memory
+    long memoryBudget = -1;
+    // Preprocessed DEM mosaic to read heights from instead of the SRTM cells, empty for the cells
+    std::string demMosaic;
+    // Build a DEM mosaic of the cells under the tiles to render into this file instead of rendering
+    std::string buildDem;
+    // Edge-preserving DEM smoothing, from the exact bilateral filter to the fastest approximation
+    DemSmoothing demSmoothing = DemSmoothing::BILATERAL;
+    // Layers to draw; the ones they take input from are run but left out of the tile
+    LayerSet layers = allLayerSet();
+    // Layers whose intermediate images are dumped: hills, rivers, forests or all
+    std::set<std::string> debugLayers;
+    PngOptions png;
+};
+
+// Prints the usage and exits on malformed arguments
+Options parseOptions(int argc, char* argv[]);
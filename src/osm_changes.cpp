@@ -0,0 +1,229 @@
+#include "osm_changes.h"
+
+#include <osmium/handler.hpp>
+#include <osmium/io/file.hpp>
+#include <osmium/io/pbf_input.hpp>
+#include <osmium/io/xml_input.hpp>
+#include <osmium/io/gzip_compression.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/way.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/visitor.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+namespace {
+    typedef std::set<osmium::object_id_type> IdSet;
+    typedef std::map<osmium::object_id_type, std::vector<osmium::object_id_type>> WayRefs;
+
+    class ChangeHandler: public osmium::handler::Handler {
+    public:
+        ChangeHandler(IdSet& nodes_, IdSet& ways_, IdSet& relations_, std::vector<osmium::Box>& boxes_) :
+            nodes(nodes_), ways(ways_), relations(relations_), boxes(boxes_) {}
+
+        void node(const osmium::Node& node) {
+            nodes.insert(node.id());
+            // Deletions may come without a location
+            if (node.location()) {
+                osmium::Box box;
+                box.extend(node.location());
+                boxes.push_back(box);
+            }
+        }
+
+        void way(const osmium::Way& way) {
+            ways.insert(way.id());
+        }
+
+        void relation(const osmium::Relation& relation) {
+            relations.insert(relation.id());
+        }
+
+    private:
+        IdSet& nodes;
+        IdSet& ways;
+        IdSet& relations;
+        std::vector<osmium::Box>& boxes;
+    };
+
+    // Remembers the node lists of the ways that are changed or go through a changed node
+    class WayHandler: public osmium::handler::Handler {
+    public:
+        WayHandler(const IdSet& nodes_, const IdSet& ways_, const IdSet& extra_, WayRefs& refs_) :
+            nodes(nodes_), ways(ways_), extra(extra_), refs(refs_) {}
+
+        void way(const osmium::Way& way) {
+            bool touched = ways.count(way.id()) || extra.count(way.id());
+            for (const auto& node: way.nodes())
+                touched = touched || nodes.count(node.ref());
+            if (!touched)
+                return;
+            auto& list = refs[way.id()];
+            list.clear();
+            for (const auto& node: way.nodes())
+                list.push_back(node.ref());
+        }
+
+    private:
+        const IdSet& nodes;
+        const IdSet& ways;
+        const IdSet& extra;
+        WayRefs& refs;
+    };
+
+    // Collects the member ways of relations that are changed or hold a touched way
+    class RelationHandler: public osmium::handler::Handler {
+    public:
+        RelationHandler(const IdSet& relations_, const WayRefs& touched_, std::vector<IdSet>& groups_) :
+            relations(relations_), touched(touched_), groups(groups_) {}
+
+        void relation(const osmium::Relation& relation) {
+            // Only multipolygons are drawn; a changed boundary would dirty the whole region
+            const char* type = relation.get_value_by_key("type");
+            if (!type || std::string(type) != "multipolygon")
+                return;
+            bool dirty = relations.count(relation.id()) != 0;
+            IdSet members;
+            for (const auto& member: relation.members()) {
+                if (member.type() != osmium::item_type::way)
+                    continue;
+                members.insert(member.ref());
+                dirty = dirty || touched.count(member.ref());
+            }
+            if (dirty && !members.empty())
+                groups.push_back(members);
+        }
+
+    private:
+        const IdSet& relations;
+        const WayRefs& touched;
+        std::vector<IdSet>& groups;
+    };
+
+    class NodeHandler: public osmium::handler::Handler {
+    public:
+        NodeHandler(const IdSet& wanted_, std::map<osmium::object_id_type, osmium::Location>& locations_) :
+            wanted(wanted_), locations(locations_) {}
+
+        void node(const osmium::Node& node) {
+            if (wanted.count(node.id()))
+                locations[node.id()] = node.location();
+        }
+
+    private:
+        const IdSet& wanted;
+        std::map<osmium::object_id_type, osmium::Location>& locations;
+    };
+
+    template<class Handler>
+    void read(const std::string& filename, osmium::osm_entity_bits::type entities, Handler& handler) {
+        osmium::io::File file(filename);
+        osmium::io::Reader reader(file, entities);
+        osmium::apply(reader, handler);
+        reader.close();
+    }
+}
+
+OsmChanges::OsmChanges(const std::string& changeFile) {
+    ChangeHandler handler(nodes, ways, relations, boxes);
+    read(changeFile, osmium::osm_entity_bits::object, handler);
+    std::cerr << "Change " << changeFile << ": " << nodes.size() << " nodes, " << ways.size() << " ways, "
+              << relations.size() << " relations\n";
+}
+
+void OsmChanges::scan(const std::string& extract) {
+    // The extract is sorted nodes, ways, relations, but each step needs the next one's results
+    std::cerr << "Scanning " << extract << " for changed geometry...\n";
+    WayRefs refs;
+    IdSet noWays;
+    WayHandler touchedWays(nodes, ways, noWays, refs);
+    read(extract, osmium::osm_entity_bits::way, touchedWays);
+
+    std::vector<IdSet> groups;
+    RelationHandler relationHandler(relations, refs, groups);
+    read(extract, osmium::osm_entity_bits::relation, relationHandler);
+
+    IdSet members;
+    for (const auto& group: groups)
+        for (auto id: group)
+            if (!refs.count(id))
+                members.insert(id);
+    if (!members.empty()) {
+        IdSet noNodes;
+        WayHandler memberWays(noNodes, noWays, members, refs);
+        read(extract, osmium::osm_entity_bits::way, memberWays);
+    }
+
+    IdSet wanted = nodes;
+    for (const auto& way: refs)
+        wanted.insert(way.second.begin(), way.second.end());
+    std::map<osmium::object_id_type, osmium::Location> locations;
+    NodeHandler nodeHandler(wanted, locations);
+    read(extract, osmium::osm_entity_bits::node, nodeHandler);
+
+    std::map<osmium::object_id_type, osmium::Box> wayBoxes;
+    for (const auto& way: refs) {
+        osmium::Box box;
+        for (auto id: way.second) {
+            auto location = locations.find(id);
+            if (location != locations.end() && location->second)
+                box.extend(location->second);
+        }
+        if (box.valid()) {
+            wayBoxes[way.first] = box;
+            boxes.push_back(box);
+        }
+    }
+    // A multipolygon's fill may change anywhere inside it, not only along the changed way
+    for (const auto& group: groups) {
+        osmium::Box box;
+        for (auto id: group) {
+            auto way = wayBoxes.find(id);
+            if (way != wayBoxes.end()) {
+                box.extend(way->second.bottom_left());
+                box.extend(way->second.top_right());
+            }
+        }
+        if (box.valid())
+            boxes.push_back(box);
+    }
+    for (auto id: nodes) {
+        auto location = locations.find(id);
+        if (location != locations.end() && location->second) {
+            osmium::Box box;
+            box.extend(location->second);
+            boxes.push_back(box);
+        }
+    }
+    std::cerr << "Scan done: " << refs.size() << " ways, " << groups.size() << " relations affected\n";
+}
+
+TileSet OsmChanges::touchedTiles(const Projector& proj, const Grid& grid, double halo) const {
+    TileSet tiles;
+    for (const auto& box: boxes) {
+        osmium::Location min = box.bottom_left(), max = box.top_right();
+        MinMax projected;
+        projected.minx = projected.miny = std::numeric_limits<double>::max();
+        projected.maxx = projected.maxy = std::numeric_limits<double>::lowest();
+        for (double lon: {min.lon(), max.lon()}) {
+            for (double lat: {min.lat(), max.lat()}) {
+                point p = proj.transform({lon, lat});
+                projected.minx = std::min(projected.minx, p.x - halo);
+                projected.maxx = std::max(projected.maxx, p.x + halo);
+                projected.miny = std::min(projected.miny, p.y - halo);
+                projected.maxy = std::max(projected.maxy, p.y + halo);
+            }
+        }
+        TileRange range = grid.rangeFor(projected);
+        for (int y = range.minY; y <= range.maxY; y++)
+            for (int x = range.minX; x <= range.maxX; x++)
+                tiles.insert({x, y});
+    }
+    return tiles;
+}
+
+size_t OsmChanges::changedObjects() const {
+    return nodes.size() + ways.size() + relations.size();
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "common.h"
+#include "grid.h"
+
+#include <osmium/osm/types.hpp>
+#include <osmium/osm/box.hpp>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+/*
+ * Works out which tiles an OSM change file (.osc or .osc.gz) touches.
+ *
+ * The change only lists the objects themselves, so their geometry is looked
+ * up in the extracts: the one the change was applied to gives the old
+ * geometry, the updated one the new. A changed node dirties the ways
+ * through it, a changed way the multipolygons it is a member of, and each
+ * of them dirties every tile its bounding box overlaps.
+ */
+class OsmChanges {
+public:
+    explicit OsmChanges(const std::string& changeFile);
+
+    // Adds the geometry the changed objects have in extract
+    void scan(const std::string& extract);
+
+    // Tiles whose drawing may differ, halo being the projected distance strokes and labels reach past a feature
+    TileSet touchedTiles(const Projector& proj, const Grid& grid, double halo) const;
+
+    size_t changedObjects() const;
+
+private:
+    std::set<osmium::object_id_type> nodes, ways, relations;
+    std::vector<osmium::Box> boxes;
+};
@@ -0,0 +1,14 @@
+#include "osm_common.h"
+
+#include <sstream>
+
+std::string describeTags(const TagFilter& tags) {
+    std::ostringstream result;
+    for (const auto& tag: tags) {
+        result << tag.first << "=";
+        for (const auto& value: tag.second)
+            result << value << ",";
+        result << ";";
+    }
+    return result.str();
+}
@@ -1,7 +1,35 @@
 #pragma once
 
+#include "common.h"
+
 #include <osmium/handler.hpp>
 
+#include <QPointF>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+typedef std::map<std::string, std::set<std::string>> TagFilter;
+
+// Stable textual form of a tag filter, for layer style keys
+std::string describeTags(const TagFilter& tags);
+
+// Pixels of the located nodes of a way or ring into points, at scale pixels per projected
+// meter from the top left corner of minmax, shifted right and down by margin
+template<class Nodes>
+void projectNodes(const Nodes& nodes, const Projector& proj, const MinMax& minmax, double scale, double margin,
+                  std::vector<QPointF>& points) {
+    points.clear();
+    for (const auto& node: nodes) {
+        if (!node.location())
+            continue;
+        point p = proj.transform({node.lon(), node.lat()});
+        points.push_back(QPointF(scale * (p.x-minmax.minx) + margin, scale * (minmax.maxy-p.y) + margin));
+    }
+}
+
 class BaseHandler {
 public:
     virtual void osm_object (const osmium::OSMObject &) {}
@@ -18,4 +46,13 @@ public:
     virtual void changeset_discussion (const osmium::ChangesetDiscussion &) {}
     virtual void flush () {}
     virtual void finalize() {};
+
+    // Prefix of the handler's trace spans
+    virtual const char* name() const { return "handler"; }
+
+    // Objects drawn into the handler's layer so far
+    size_t accepted() const { return acceptedCount; }
+
+protected:
+    size_t acceptedCount = 0;
 };
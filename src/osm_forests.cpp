@@ -1,6 +1,9 @@
 #include "osm_forests.h"
 #include "common.h"
+#include "clip.h"
 #include "srtm.h"
+#include "image_writer.h"
+#include "trace.h"
 
 #include <osmium/osm/area.hpp>
 #include <osmium/osm/way.hpp>
@@ -16,7 +19,7 @@
 #include <iostream>
 
 namespace {
-    std::map<std::string, std::set<std::string>> TAGS_TO_INCLUDE{
+    TagFilter TAGS_TO_INCLUDE{
         {"natural", {"wood", "scrub", "canal"}},
         {"landuse", {"forest", "cemetery", "orchard", "vineyard", "allotments"}},
         {"landcover", {"trees"}},
@@ -25,6 +28,12 @@ namespace {
     
     const QColor BASE_COLOR(0, 128, 0);
     const int MARGIN = 100;
+
+    // The areas are only filled, onto an image MARGIN wider than the tile
+    const double CLIP_HALO = 4;
+
+    // Bump on any change to the drawing code not covered by the constants here
+    const int STYLE_VERSION = 3;
 }
 
 OsmForestsHandler::OsmForestsHandler(const Projector& proj_, const MinMax& minmax_, int imageSize, int xTile_, int yTile_) : 
@@ -40,6 +49,12 @@ OsmForestsHandler::OsmForestsHandler(const Projector& proj_, const MinMax& minma
     scale = std::min(scaleX, scaleY);
 }
 
+size_t OsmForestsHandler::estimateMemory(int imageSize) {
+    size_t side = imageSize + 2*MARGIN;
+    // ARGB canvas and gradient image, float heights, total heights and two gradients
+    return side * side * (2 * 4 + 4 * sizeof(float));
+}
+
 template<class Object>
 bool OsmForestsHandler::needObject(const Object& object) const {
     for (const auto& tag: TAGS_TO_INCLUDE) {
@@ -54,25 +69,12 @@ bool OsmForestsHandler::needObject(const Object& object) const {
 
 void OsmForestsHandler::area(const osmium::Area& area)  {
     if (!needObject(area)) return;
+    QRectF window = clip::window(image.width() + 2*MARGIN, image.height() + 2*MARGIN, CLIP_HALO);
     for (const auto& ring: area.outer_rings()) {
-        QPainterPath path;
-        bool first = true;
-        for (const auto& node: ring) {
-            if (!node.location())
-                continue;
-            point p = proj.transform({node.lon(), node.lat()});
-            double x = scale * (p.x-minmax.minx) + MARGIN;
-            double y = scale * (minmax.maxy-p.y) + MARGIN;
-            if (first) {
-                path.moveTo(x, y);
-                first = false;
-            } else {
-                path.lineTo(x, y);
-            }
-        }
-        if (path.intersects(QRectF(0, 0, image.width() + 2*MARGIN, image.height() + 2*MARGIN))) {
-            areas += path;
-        }
+        arena.beginShape(0);
+        projectNodes(ring, proj, minmax, scale, MARGIN, arena.projected());
+        arena.addRing(window);
+        arena.endShape();
     }
 }
 
@@ -112,6 +114,14 @@ namespace {
 
 void OsmForestsHandler::finalize()
 {
+    trace::Span canopy("forests.canopy");
+    for (size_t i = 0; i < arena.size(); i++) {
+        QPainterPath path = arena.path(i);
+        if (path.intersects(QRectF(0, 0, image.width() + 2*MARGIN, image.height() + 2*MARGIN))) {
+            areas += path;
+            acceptedCount++;
+        }
+    }
     QImage imageBase(image.width() + 2*MARGIN, image.height() + 2*MARGIN, QImage::Format_ARGB32);
     imageBase.fill({255, 255, 255, 0});
     QPainter painterBase(&imageBase);
@@ -124,7 +134,6 @@ void OsmForestsHandler::finalize()
     
     
     cv::Mat source(imageBase.height(), imageBase.width(), CV_32FC1, 0.0);
-    std::cout << "tile " << xTile << " " << yTile << std::endl;
     for (int y=0; y<imageBase.height(); y++) {
         for (int x=0; x<imageBase.width(); x++) {
             int seed = xTile * image.width() + x - MARGIN + 10000 * (yTile * image.height() + (y - MARGIN));
@@ -173,8 +182,11 @@ void OsmForestsHandler::finalize()
             int yy = std::min(std::max(y-MARGIN, 0), image.height()-1);
             totalHeights.at<float>(y,x) += heights.at<float>(yy,xx);
         }
-    cvPaint::paint(source).save(("source0" + std::to_string(xTile) + std::to_string(yTile) + ".png").c_str());
-    cvPaint::paint(totalHeights).save(("totalHeights" + std::to_string(xTile) + std::to_string(yTile) + ".png").c_str());
+    canopy.end();
+    TRACE_SCOPE("forests.shade");
+    ImageWriter& writer = ImageWriter::instance();
+    writer.saveDebug("forests", "source0", xTile, yTile, [source]{ return cvPaint::paint(source); });
+    writer.saveDebug("forests", "totalHeights", xTile, yTile, [totalHeights]{ return cvPaint::paint(totalHeights); });
 
     //cv::Mat sourceSmoothed;
     //cv::bilateralFilter(source, sourceSmoothed, -1, 10, 5);
@@ -187,8 +199,8 @@ void OsmForestsHandler::finalize()
     cv::Mat sourceYgrad;
     Sobel(totalHeights, sourceYgrad, -1, 0, 1, 5);
     
-    cvPaint::paint(sourceXgrad).save(("sourceX" + std::to_string(xTile) + std::to_string(yTile) + ".png").c_str());
-    cvPaint::paint(sourceYgrad).save(("sourceY" + std::to_string(xTile) + std::to_string(yTile) + ".png").c_str());
+    writer.saveDebug("forests", "sourceX", xTile, yTile, [sourceXgrad]{ return cvPaint::paint(sourceXgrad); });
+    writer.saveDebug("forests", "sourceY", xTile, yTile, [sourceYgrad]{ return cvPaint::paint(sourceYgrad); });
     
     static const double VAL_THRESHOLD = 5;
     auto imageGrad = paintGrads(sourceXgrad, sourceYgrad);
@@ -211,13 +223,23 @@ void OsmForestsHandler::finalize()
             color.setAlpha(alpha);
             image.setPixel(x, y, color.rgba());
         }
-    image.save("forests.png");
+    QImage result = image;
+    writer.saveDebug("forests", "forests", xTile, yTile, [result]{ return result; });
 }
 
 QImage OsmForestsHandler::getImage() const {
     return image;
 }
 
+std::string OsmForestsHandler::styleKey() {
+    return "forests:" + std::to_string(STYLE_VERSION) + ":" + std::to_string(BASE_COLOR.rgba()) + ":"
+        + std::to_string(MARGIN) + ":" + describeTags(TAGS_TO_INCLUDE);
+}
+
+const char* OsmForestsHandler::name() const {
+    return "forests";
+}
+
 const QPainterPath& OsmForestsHandler::getAreas() const {
     return areas;
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common.h"
+#include "geometry_arena.h"
 #include "osm_common.h"
 
 #include <osmium/handler.hpp>
@@ -14,6 +15,9 @@
 class OsmForestsHandler : public BaseHandler {
 public:
     OsmForestsHandler(const Projector& proj_, const MinMax& minmax_, int imageSize, int xTile_, int yTile);
+
+    // Peak bytes of the canopy canvas and height maps finalize() allocates
+    static size_t estimateMemory(int imageSize);
     
     virtual void area(const osmium::Area &area);
     
@@ -21,14 +25,22 @@ public:
     
     QImage getImage() const;
     
+    // Filled in by finalize()
     const QPainterPath& getAreas() const;
     
     void setHeights(cv::Mat mat);
+
+    // Changes whenever the look of the layer does, for the tile cache
+    static std::string styleKey();
+
+    virtual const char* name() const;
     
 private:
     template<class Object>
     bool needObject(const Object &object) const;
     
+    // Outer rings, united into areas in finalize()
+    GeometryArena arena;
     QPainterPath areas;
     double scale;
     QImage image;
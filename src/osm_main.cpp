@@ -1,5 +1,7 @@
 #include "osm_main.h"
 #include "osm_common.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include <osmium/osm/types.hpp>
 #include <osmium/index/map/dummy.hpp>
@@ -9,6 +11,15 @@
 #include <osmium/area/assembler.hpp>
 #include <osmium/area/multipolygon_collector.hpp>
 #include <osmium/io/pbf_input.hpp>
+#include <osmium/osm/area.hpp>
+#include <osmium/osm/way.hpp>
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
 
 typedef osmium::index::map::Dummy<osmium::unsigned_object_id_type, osmium::Location> IndexNeg;
 typedef osmium::index::map::SparseMemArray<osmium::unsigned_object_id_type, osmium::Location> IndexPos;
@@ -18,18 +29,27 @@ namespace {
 class ProxyHandler: public BaseHandler {
 public:
     ProxyHandler(std::vector<BaseHandler*>& handlers_):
-        handlers(handlers_) {}
+        handlers(handlers_),
+        callbackTime(handlers_.size(), 0),
+        callbackCount(handlers_.size(), 0),
+        sampledCount(handlers_.size(), 0) {}
         
     virtual void osm_object (const osmium::OSMObject &o) const noexcept {
         for (auto& h : handlers) h->osm_object(o);
     }
  
     virtual void node (const osmium::Node & o) const noexcept {
-        for (auto& h : handlers) h->node(o);
+        if (trace::enabled())
+            timed([&o](BaseHandler* h) { h->node(o); });
+        else
+            for (auto& h : handlers) h->node(o);
     }
  
     virtual void way (const osmium::Way &o) const noexcept {
-        for (auto& h : handlers) h->way(o);
+        if (trace::enabled())
+            timed([&o](BaseHandler* h) { h->way(o); });
+        else
+            for (auto& h : handlers) h->way(o);
     }
  
     virtual void relation (const osmium::Relation &o) const noexcept {
@@ -37,7 +57,10 @@ public:
     }
  
     virtual void area (const osmium::Area &o) const noexcept {
-        for (auto& h : handlers) h->area(o);
+        if (trace::enabled())
+            timed([&o](BaseHandler* h) { h->area(o); });
+        else
+            for (auto& h : handlers) h->area(o);
     }
  
     virtual void changeset (const osmium::Changeset &o) const noexcept {
@@ -73,13 +96,148 @@ public:
     }
 
     virtual void finalize () const noexcept {
-        for (auto& h : handlers) h->finalize();
+        for (auto& h : handlers) {
+            trace::Span span(trace::intern(std::string(h->name()) + ".finalize"));
+            h->finalize();
+            metrics::counter("drawmap_objects_accepted_total", "OSM objects drawn into a layer",
+                             "layer=\"" + std::string(h->name()) + "\"").add(h->accepted());
+        }
+    }
+
+    // Time each handler spent in its callbacks, extrapolated from the sampled objects, as trace span arguments
+    std::string callbackArgs() const {
+        std::ostringstream args;
+        for (size_t i = 0; i < handlers.size(); i++) {
+            double total = sampledCount[i] ? double(callbackTime[i]) * callbackCount[i] / sampledCount[i] : 0;
+            args << (i ? "," : "") << "\"" << handlers[i]->name() << ".callbacks_ms\":" << total / 1e6
+                 << ",\"" << handlers[i]->name() << ".objects\":" << callbackCount[i];
+        }
+        return args.str();
     }
 private:
+    // A span per object would dwarf the work, and so would two clock reads per object and handler,
+    // so callback time is summed per handler over every TIMING_STRIDE-th object only
+    static const size_t TIMING_STRIDE = 16;
+
+    template<class F>
+    void timed(F call) const {
+        for (size_t i = 0; i < handlers.size(); i++) {
+            if (callbackCount[i]++ % TIMING_STRIDE) {
+                call(handlers[i]);
+                continue;
+            }
+            auto start = std::chrono::steady_clock::now();
+            call(handlers[i]);
+            callbackTime[i] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            sampledCount[i]++;
+        }
+    }
+
     std::vector<BaseHandler*> handlers;
+    mutable std::vector<int64_t> callbackTime;
+    mutable std::vector<size_t> callbackCount;
+    mutable std::vector<size_t> sampledCount;
 };
 }
 
+namespace {
+    const size_t STORE_BUFFER_SIZE = 16 << 20;
+
+    // Projected bounding box of nodes, grown from box; false if none of them has a location
+    template<class Nodes>
+    bool extendBox(MinMax& box, bool found, const Nodes& nodes, const Projector& proj) {
+        for (const auto& node: nodes) {
+            if (!node.location())
+                continue;
+            point p = proj.transform({node.lon(), node.lat()});
+            if (!found) {
+                box.minx = box.maxx = p.x;
+                box.miny = box.maxy = p.y;
+                found = true;
+            }
+            box.minx = std::min(box.minx, p.x);
+            box.maxx = std::max(box.maxx, p.x);
+            box.miny = std::min(box.miny, p.y);
+            box.maxy = std::max(box.maxy, p.y);
+        }
+        return found;
+    }
+
+    // Copies what the drawing handlers can use into buffers; untagged ways are only parts of areas
+    class StoreHandler: public BaseHandler {
+    public:
+        StoreHandler(std::vector<osmium::memory::Buffer>& buffers_, const Projector& proj_) :
+            buffers(buffers_),
+            proj(proj_) {}
+
+        virtual void way(const osmium::Way& way) {
+            if (way.tags().size() == 0)
+                return;
+            MinMax box;
+            add(way, extendBox(box, false, way.nodes(), proj), box);
+        }
+
+        virtual void area(const osmium::Area& area) {
+            // Inner rings lie within the outer ones
+            MinMax box;
+            bool found = false;
+            for (const auto& ring: area.outer_rings())
+                found = extendBox(box, found, ring, proj);
+            add(area, found, box);
+        }
+
+        virtual void finalize() {
+            if (current.committed() != 0)
+                buffers.push_back(std::move(current));
+        }
+
+        std::vector<FeatureStore::Ref> refs;
+        std::vector<MinMax> boxes;
+
+    private:
+        // Features without a located node are kept for a full replay but never match a query
+        void add(const osmium::OSMObject& object, bool located, const MinMax& box) {
+            if (located) {
+                refs.push_back({buffers.size(), current.committed()});
+                boxes.push_back(box);
+            }
+            current.add_item(object);
+            current.commit();
+            if (current.committed() >= STORE_BUFFER_SIZE) {
+                buffers.push_back(std::move(current));
+                current = osmium::memory::Buffer(STORE_BUFFER_SIZE, osmium::memory::Buffer::auto_grow::yes);
+            }
+        }
+
+        std::vector<osmium::memory::Buffer>& buffers;
+        const Projector& proj;
+        osmium::memory::Buffer current{STORE_BUFFER_SIZE, osmium::memory::Buffer::auto_grow::yes};
+    };
+}
+
+FeatureStore::FeatureStore(const std::string& filename, const Projector& proj) {
+    StoreHandler handler(buffers, proj);
+    OsmDrawer drawer;
+    drawer.addHandler(&handler);
+    drawer.dispatch(filename);
+    refs = std::move(handler.refs);
+    TRACE_SCOPE("osm.index");
+    index.reset(new PackedRTree(handler.boxes));
+    std::cerr << "Feature store: " << (getMemory() >> 20) << " MB in " << buffers.size() << " buffers, "
+              << refs.size() << " features indexed\n";
+}
+
+size_t FeatureStore::getMemory() const {
+    size_t bytes = refs.capacity() * sizeof(Ref) + index->getMemory();
+    for (const auto& buffer: buffers)
+        bytes += buffer.capacity();
+    return bytes;
+}
+
+const PackedRTree& FeatureStore::getIndex() const {
+    return *index;
+}
+
 OsmDrawer::OsmDrawer()
 {}
 
@@ -88,6 +246,15 @@ void OsmDrawer::addHandler(BaseHandler* handler)
     handlers.push_back(handler);
 }
 
+size_t OsmDrawer::estimateMemory(const std::string& filename) {
+    // A PBF spends roughly 8 bytes per node, the index 16 (id and location)
+    static const size_t INDEX_PER_FILE_BYTE = 2;
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0)
+        return 0;
+    return size_t(info.st_size) * INDEX_PER_FILE_BYTE;
+}
+
 void OsmDrawer::dispatch(const std::string& filename) {
     ProxyHandler proxy(handlers);
     osmium::io::File infile(filename);
@@ -95,24 +262,61 @@ void OsmDrawer::dispatch(const std::string& filename) {
     osmium::area::Assembler::config_type assembler_config;
     osmium::area::MultipolygonCollector<osmium::area::Assembler> collector(assembler_config);
 
-    std::cerr << "Pass 1...\n";
+    trace::Span relations("osm.relations");
     osmium::io::Reader reader1(infile);
     collector.read_relations(reader1);
     reader1.close();
-    std::cerr << "Pass 1 done\n";
+    relations.end();
 
     IndexPos indexPos;
     IndexNeg indexNeg;
     LocationHandler locationHandler(indexPos, indexNeg);
     locationHandler.ignore_errors();
 
-    std::cerr << "Pass 2...\n";
+    int64_t start = trace::now();
     osmium::io::Reader reader2(infile);
     osmium::apply(reader2, locationHandler, proxy, collector.handler([&proxy](osmium::memory::Buffer&& buffer) {
         osmium::apply(buffer, proxy);
     }));
     reader2.close();
-    std::cerr << "Pass 2 done\n";
+    if (trace::enabled())
+        trace::record("osm.objects", start, trace::now() - start, proxy.callbackArgs());
+
+    TRACE_SCOPE("osm.finalize");
+    proxy.finalize();
+}
+
+void OsmDrawer::dispatch(const FeatureStore& store) {
+    ProxyHandler proxy(handlers);
+    int64_t start = trace::now();
+    for (const auto& buffer: store.buffers)
+        osmium::apply(buffer, proxy);
+    if (trace::enabled())
+        trace::record("osm.replay", start, trace::now() - start, proxy.callbackArgs());
+
+    TRACE_SCOPE("osm.finalize");
+    proxy.finalize();
+}
+
+void OsmDrawer::dispatch(const FeatureStore& store, const MinMax& area) {
+    ProxyHandler proxy(handlers);
+    int64_t start = trace::now();
+    // Ascending ids keep the order of a full replay, which the drawing depends on
+    std::vector<uint32_t> found = store.index->query(area);
+    for (uint32_t id: found) {
+        const FeatureStore::Ref& ref = store.refs[id];
+        const auto& object = store.buffers[ref.buffer].get<osmium::OSMObject>(ref.offset);
+        if (object.type() == osmium::item_type::way)
+            proxy.way(static_cast<const osmium::Way&>(object));
+        else
+            proxy.area(static_cast<const osmium::Area&>(object));
+    }
+    if (trace::enabled()) {
+        std::string args = proxy.callbackArgs();
+        trace::record("osm.query", start, trace::now() - start,
+                      args + (args.empty() ? "" : ",") + "\"features\":" + std::to_string(found.size()));
+    }
 
+    TRACE_SCOPE("osm.finalize");
     proxy.finalize();
 }
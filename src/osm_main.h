@@ -1,10 +1,44 @@
 #pragma once
 
 #include "osm_common.h"
+#include "rtree.h"
 
+#include <osmium/memory/buffer.hpp>
+
+#include <memory>
 #include <string>
 #include <vector>
 
+/*
+ * The tagged ways and areas of an OSM file, read once with their node
+ * locations filled in and kept in memory, so tiles can be drawn without
+ * going back to the file or a node index. The projected bounding boxes
+ * of the features are indexed, so a tile replays only the features near
+ * it. Read-only once built, so any number of tiles can replay it at the
+ * same time.
+ */
+class FeatureStore {
+public:
+    FeatureStore(const std::string& filename, const Projector& proj);
+
+    size_t getMemory() const;
+
+    const PackedRTree& getIndex() const;
+
+    // Where a feature of the index is kept
+    struct Ref {
+        size_t buffer;
+        size_t offset;
+    };
+
+private:
+    friend class OsmDrawer;
+
+    std::vector<osmium::memory::Buffer> buffers;
+    std::vector<Ref> refs;
+    std::unique_ptr<PackedRTree> index;
+};
+
 class OsmDrawer {
 public:
     OsmDrawer();
@@ -12,6 +46,15 @@ public:
     void addHandler(BaseHandler* handler);
     
     void dispatch(const std::string& filename);
+
+    // Same as dispatch() of the file the store was read from
+    void dispatch(const FeatureStore& store);
+
+    // Same, but only the features whose projected bounding box intersects area
+    void dispatch(const FeatureStore& store, const MinMax& area);
+
+    // Bytes of the node location index dispatch() builds for this file
+    static size_t estimateMemory(const std::string& filename);
     
 private:
     std::vector<BaseHandler*> handlers;
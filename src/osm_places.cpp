@@ -1,8 +1,12 @@
 #include "osm_places.h"
 #include "common.h"
+#include "clip.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include <osmium/osm/area.hpp>
 #include <QPainterPathStroker>
+#include <QPolygonF>
 #include <Qt>
 
 #include <set>
@@ -10,12 +14,18 @@
 #include <cmath>
 
 namespace {
-    std::map<std::string, std::set<std::string>> TAGS_TO_INCLUDE{
+    TagFilter TAGS_TO_INCLUDE{
         {"place", {"village", "hamlet", "allotments"}},
         {"landuse", {"commercial", "garages", "industrial", "residential", "retail"}},
         {"historic", {"castle"}}
     };
     int VERTICAL_SHIFT = 15;
+
+    // Tops are drawn VERTICAL_SHIFT pixels above the outline
+    const double CLIP_HALO = 32;
+
+    // Bump on any change to the drawing code not covered by the constants here
+    const int STYLE_VERSION = 3;
 }
 
 OsmPlacesHandler::OsmPlacesHandler(const Projector& proj_, const MinMax& minmax_, int imageSize) : 
@@ -45,32 +55,25 @@ bool OsmPlacesHandler::needArea(const osmium::Area& area) const {
 void OsmPlacesHandler::area(const osmium::Area& area)  {
     if (!needArea(area)) return;
     if (area.num_rings().first == 0) {
-        std::cerr << "Area with zero outer rings" << std::endl;
+        metrics::log("Area with zero outer rings", true);
         return;
     }
     for (const auto& ring: area.outer_rings()) {
-        QPainterPath path;
-        bool first = true;
-        for (const auto& node: ring) {
-            if (!node.location())
-                continue;
-            point p = proj.transform({node.lon(), node.lat()});
-            double x = scale * (p.x-minmax.minx);
-            double y = scale * (minmax.maxy-p.y);
-            if (first) {
-                path.moveTo(x, y);
-                first = false;
-            } else {
-                path.lineTo(x, y);
-            }
-        }
-        if (path.intersects(QRectF(0, 0, image.width(), image.height()))) {
-            unitedPath += path;
-            paths.push_back(path);
-        }
+        arena.beginShape(0);
+        projectNodes(ring, proj, minmax, scale, 0, arena.projected());
+        arena.addRing(clip::window(image.width(), image.height(), CLIP_HALO));
+        arena.endShape();
     }
 }
 
+std::string OsmPlacesHandler::styleKey() {
+    return "places:" + std::to_string(STYLE_VERSION) + ":" + std::to_string(VERTICAL_SHIFT) + ":" + describeTags(TAGS_TO_INCLUDE);
+}
+
+const char* OsmPlacesHandler::name() const {
+    return "places";
+}
+
 const QPainterPath& OsmPlacesHandler::getUnitedPath() const {
     return unitedPath;
 }
@@ -87,20 +90,6 @@ void OsmPlacesHandler::setForestAreas(const QPainterPath& path) {
     forestAreas = &path;
 }
 
-QPolygonF OsmPlacesHandler::simplifyPolygon(const QPolygonF& polygon) const {
-    static const int DIST_THRESHOLD = 4;
-    QPolygonF newPolygon;
-    QPointF lastPoint(-1e10, -1e10);
-    for (const auto& point: polygon) {
-        double dist = std::hypot(point.x() - lastPoint.x(), point.y() - lastPoint.y());
-        if (dist > DIST_THRESHOLD) {
-            newPolygon << point;
-            lastPoint = point;
-        }
-    }
-    return newPolygon;
-}
-
 namespace {
     
 typedef std::pair<QPainterPath, float> SidePath;
@@ -125,6 +114,18 @@ void addSidePaths(const QPolygonF& polygon, std::vector<SidePath>& paths) {
 
 void OsmPlacesHandler::finalize()
 {
+    std::vector<QPainterPath> paths;
+    for (size_t i = 0; i < arena.size(); i++) {
+        QPainterPath path = arena.path(i);
+        if (path.intersects(QRectF(0, 0, image.width(), image.height()))) {
+            unitedPath += path;
+            paths.push_back(path);
+            acceptedCount++;
+        }
+    }
+
+    // The boolean ops against roads, rail and forests, then painting
+    trace::Span subtract("places.subtract");
     QPainterPath roadsPathSimplified = (*roadsPath+*railPath+*forestAreas).simplified();
     QPainter painter(&image);
     painter.setRenderHint(QPainter::Antialiasing, true);
@@ -148,6 +149,8 @@ void OsmPlacesHandler::finalize()
         newPath.translate(0, -VERTICAL_SHIFT);
         topPaths.emplace_back(newPath, -1);
     }
+    subtract.end();
+    TRACE_SCOPE("places.paint");
     std::sort(sidePaths.begin(), sidePaths.end(), [](const SidePath& a, const SidePath& b) { return a.second < b.second; });
     for (const auto paths: {&sidePaths, &topPaths}) {
         for (const auto& path: *paths) {
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common.h"
+#include "geometry_arena.h"
 #include "osm_common.h"
 
 #include <osmium/handler.hpp>
@@ -23,15 +24,20 @@ public:
     void setRoadsPath(const QPainterPath& path);
     void setRailPath(const QPainterPath& path);
     void setForestAreas(const QPainterPath& path);
+
+    // Changes whenever the look of the layer does, for the tile cache
+    static std::string styleKey();
+
+    virtual const char* name() const;
     
 private:
     bool needArea(const osmium::Area &area) const;
-    QPolygonF simplifyPolygon(const QPolygonF& polygon) const;
     
     double scale;
     QImage image;
     QPainterPath unitedPath;
-    std::vector<QPainterPath> paths;
+    // Outer rings, united and cut in finalize()
+    GeometryArena arena;
     const QPainterPath* roadsPath;
     const QPainterPath* railPath;
     const QPainterPath* forestAreas;
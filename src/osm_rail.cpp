@@ -1,11 +1,20 @@
 #include "osm_rail.h"
 #include "common.h"
+#include "clip.h"
 
 #include <osmium/osm/way.hpp>
 #include <QPainterPathStroker>
 #include <Qt>
 #include <map>
 
+namespace {
+    // The 12 pixel stroke, its 2 pixel outline and the square caps of the fill
+    const double CLIP_HALO = 16;
+
+    // Bump on any change to the drawing code
+    const int STYLE_VERSION = 3;
+}
+
 OsmRailHandler::OsmRailHandler(const Projector& proj_, const MinMax& minmax_, int imageSize) : 
     imageFill(imageSize, imageSize, QImage::Format_ARGB32),
     imageOutline(imageSize, imageSize, QImage::Format_ARGB32),
@@ -34,49 +43,55 @@ void OsmRailHandler::way(const osmium::Way& way)  {
         return;
     if (way.get_value_by_key("service"))
         return;
-    QPainterPath path;
-    bool first = true;
-    for (const auto& node: way.nodes()) {
-        if (!node.location())
-            continue;
-        point p = proj.transform({node.lon(), node.lat()});
-        double x = scale * (p.x-minmax.minx);
-        double y = scale * (minmax.maxy-p.y);
-        if (first) {
-            path.moveTo(x, y);
-            first = false;
-        } else {
-            path.lineTo(x, y);
-        }
+    arena.beginShape(0);
+    projectNodes(way.nodes(), proj, minmax, scale, 0, arena.projected());
+    arena.addLine(clip::window(imageFill.width(), imageFill.height(), CLIP_HALO));
+    arena.endShape();
+}
+
+void OsmRailHandler::finalize() {
+    for (size_t i = 0; i < arena.size(); i++) {
+        QPainterPath path = arena.path(i);
+        
+        QPainterPathStroker stroker;
+        stroker.setWidth(12);
+        stroker.setJoinStyle(Qt::PenJoinStyle::RoundJoin);
+        stroker.setCapStyle(Qt::PenCapStyle::FlatCap);
+        
+        QPainterPath strokeOutline = stroker.createStroke(path);
+        // Counted like roads: only what reaches the tile
+        if (strokeOutline.intersects(QRectF(0, 0, imageFill.width(), imageFill.height())))
+            acceptedCount++;
+        
+        stroker.setCapStyle(Qt::PenCapStyle::SquareCap);
+        QPainterPath strokeFillBlack = stroker.createStroke(path);
+        
+        stroker.setDashPattern({4, 4});
+        stroker.setCapStyle(Qt::PenCapStyle::FlatCap);
+        QPainterPath strokeFillWhite = stroker.createStroke(path);
+        
+        painterOutline.setPen(QPen(QColor(0, 0, 0), 2));
+        painterOutline.drawPath(strokeOutline);
+        
+        painterFill.fillPath(strokeFillBlack, QColor(0, 0, 0));
+        painterFill.fillPath(strokeFillWhite, QColor(255, 255, 255));
+        
+        unitedPath += strokeOutline;
     }
-    
-    QPainterPathStroker stroker;
-    stroker.setWidth(12);
-    stroker.setJoinStyle(Qt::PenJoinStyle::RoundJoin);
-    stroker.setCapStyle(Qt::PenCapStyle::FlatCap);
-    
-    QPainterPath strokeOutline = stroker.createStroke(path);
-    
-    stroker.setCapStyle(Qt::PenCapStyle::SquareCap);
-    QPainterPath strokeFillBlack = stroker.createStroke(path);
-    
-    stroker.setDashPattern({4, 4});
-    stroker.setCapStyle(Qt::PenCapStyle::FlatCap);
-    QPainterPath strokeFillWhite = stroker.createStroke(path);
-    
-    painterOutline.setPen(QPen(QColor(0, 0, 0), 2));
-    painterOutline.drawPath(strokeOutline);
-    
-    painterFill.fillPath(strokeFillBlack, QColor(0, 0, 0));
-    painterFill.fillPath(strokeFillWhite, QColor(255, 255, 255));
-    
-    unitedPath += strokeOutline;
+}
+
+std::string OsmRailHandler::styleKey() {
+    return "rail:" + std::to_string(STYLE_VERSION);
+}
+
+const char* OsmRailHandler::name() const {
+    return "rail";
 }
 
 const QPainterPath& OsmRailHandler::getUnitedPath() const {
     return unitedPath;
 }
 
-QImage OsmRailHandler::getImage() const {
-    return combine(imageOutline, imageFill);
+std::vector<QImage> OsmRailHandler::getLayers() const {
+    return {imageOutline, imageFill};
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common.h"
+#include "geometry_arena.h"
 #include "osm_common.h"
 
 #include <osmium/handler.hpp>
@@ -8,21 +9,34 @@
 #include <QImage>
 #include <QPainter>
 
+#include <string>
+#include <vector>
+
 class OsmRailHandler : public BaseHandler {
 public:
     OsmRailHandler(const Projector& proj_, const MinMax& minmax_, int imageSize);
     
     virtual void way(const osmium::Way &way);
+
+    virtual void finalize();
     
-    QImage getImage() const;
+    // Outline and fill images, bottom to top, for the compositor
+    std::vector<QImage> getLayers() const;
     
     const QPainterPath& getUnitedPath() const;
+
+    // Changes whenever the look of the layer does, for the tile cache
+    static std::string styleKey();
+
+    virtual const char* name() const;
     
 private:
     double scale;
     QImage imageFill, imageOutline;
     QPainter painterFill, painterOutline;
     QPainterPath unitedPath;
+    // Center lines, stroked and painted in finalize()
+    GeometryArena arena;
     const Projector& proj;
     const MinMax& minmax;
 }; 
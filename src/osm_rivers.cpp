@@ -1,5 +1,8 @@
 #include "osm_rivers.h"
 #include "common.h"
+#include "clip.h"
+#include "image_writer.h"
+#include "simplify.h"
 
 #include <osmium/osm/area.hpp>
 #include <osmium/osm/way.hpp>
@@ -16,7 +19,7 @@
 #include <queue>
 
 namespace {
-    std::map<std::string, std::set<std::string>> TAGS_TO_INCLUDE{
+    TagFilter TAGS_TO_INCLUDE{
         {"waterway", {"river", "riverbank", "canal"}},
         {"natural", {"water"}},
         {"landuse", {"reservoir"}},
@@ -24,12 +27,24 @@ namespace {
     
     //const QColor BASE_COLOR(0, 102, 255);
     const QColor BASE_COLOR(0, 51, 128);
+
+    // Areas get outline strokes up to 60 pixels wide
+    const double CLIP_HALO = 40;
+
+    // Bump on any change to the drawing code not covered by the constants here
+    const int STYLE_VERSION = 3;
+
+    // Arena styles
+    const int AREA = 0;
+    const int LINE = 1;
 }
 
-OsmRiversHandler::OsmRiversHandler(const Projector& proj_, const MinMax& minmax_, int imageSize) : 
+OsmRiversHandler::OsmRiversHandler(const Projector& proj_, const MinMax& minmax_, int imageSize, int xTile_, int yTile_) : 
     image(imageSize, imageSize, QImage::Format_ARGB32),
     proj(proj_),
-    minmax(minmax_)
+    minmax(minmax_),
+    xTile(xTile_),
+    yTile(yTile_)
 {
     image.fill({255, 255, 255, 0});
     double scaleX = image.width() / (minmax.maxx - minmax.minx);
@@ -49,92 +64,38 @@ bool OsmRiversHandler::needObject(const Object& object) const {
     return false;
 }
 
-QPolygonF simplifyPolygon(const QPolygonF& polygon, double threshold) {
-    QPolygonF newPolygon;
-    QPointF lastPoint(-1e10, -1e10);
-    for (const auto& point: polygon) {
-        double dist = std::hypot(point.x() - lastPoint.x(), point.y() - lastPoint.y());
-        if (dist > threshold) {
-            newPolygon << point;
-            lastPoint = point;
-        }
-    }
-    return newPolygon;
-}
-
-QPainterPath simplifyPath(const QPainterPath& path, double threshold) {
-    QPainterPath result;
-    QPointF lastAddedPoint(-1e10, -1e10);
-    QPointF lastPoint(-1e10, -1e10);
-    for (size_t i = 0; i < path.elementCount(); i++) {
-        auto element = path.elementAt(i);
-        if (element.isMoveTo()) {
-            if (lastPoint.x() > -1e-9) {
-                result.lineTo(lastPoint);
-            }
-            result.moveTo(element.x, element.y);
-            lastAddedPoint = QPointF(element.x, element.y);
-        } else {
-            double dist = std::hypot(element.x - lastAddedPoint.x(), element.y - lastAddedPoint.y());
-            if (dist > threshold) {
-                result.lineTo(element.x, element.y);
-                lastPoint = QPointF(element.x, element.y);
-            }
-        }
-        lastPoint = QPointF(element.x, element.y);
-    }
-    result.lineTo(lastPoint);
-    return result;
-}
-
 void OsmRiversHandler::area(const osmium::Area& area)  {
     if (!needObject(area)) return;
     for (const auto& ring: area.outer_rings()) {
-        QPainterPath path;
-        bool first = true;
-        for (const auto& node: ring) {
-            if (!node.location())
-                continue;
-            point p = proj.transform({node.lon(), node.lat()});
-            double x = scale * (p.x-minmax.minx);
-            double y = scale * (minmax.maxy-p.y);
-            if (first) {
-                path.moveTo(x, y);
-                first = false;
-            } else {
-                path.lineTo(x, y);
-            }
-        }
-        if (path.intersects(QRectF(0, 0, image.width(), image.height()))) {
-            areas += path;
-        }
+        arena.beginShape(AREA);
+        projectNodes(ring, proj, minmax, scale, 0, arena.projected());
+        arena.addRing(clip::window(image.width(), image.height(), CLIP_HALO));
+        arena.endShape();
     }
 }
 
 void OsmRiversHandler::way(const osmium::Way& way)  {
     if (!needObject(way)) return;
-    QPainterPath path;
-    bool first = true;
-    for (const auto& node: way.nodes()) {
-        if (!node.location())
-            continue;
-        point p = proj.transform({node.lon(), node.lat()});
-        double x = scale * (p.x-minmax.minx);
-        double y = scale * (minmax.maxy-p.y);
-        if (first) {
-            path.moveTo(x, y);
-            first = false;
-        } else {
-            path.lineTo(x, y);
-        }
-    }
-    if (path.intersects(QRectF(0, 0, image.width(), image.height()))) {
-        paths.addPath(path);
-    }
+    arena.beginShape(LINE);
+    projectNodes(way.nodes(), proj, minmax, scale, 0, arena.projected());
+    arena.addLine(clip::window(image.width(), image.height(), CLIP_HALO));
+    arena.endShape();
 }
 
 void OsmRiversHandler::finalize()
 {
+    QPainterPath paths, areas;
+    for (size_t i = 0; i < arena.size(); i++) {
+        QPainterPath path = arena.path(i);
+        if (!path.intersects(QRectF(0, 0, image.width(), image.height())))
+            continue;
+        if (arena.style(i) == AREA)
+            areas += path;
+        else
+            paths.addPath(path);
+        acceptedCount++;
+    }
+
     QPainter painter(&image);
     painter.setRenderHint(QPainter::Antialiasing, true);
     painter.setRenderHint(QPainter::TextAntialiasing, true);
@@ -143,7 +104,7 @@ void OsmRiversHandler::finalize()
     painter.setPen(QPen(BASE_COLOR, 2));
     painter.drawPath(paths);
 
-    auto simplifiedAreas = simplifyPath(areas.simplified(), 3);
+    auto simplifiedAreas = simplify::dropClose(areas.simplified(), 3);
     
     painter.fillPath(simplifiedAreas, BASE_COLOR);
     for (int i = 4; i >= 1; i--) {
@@ -174,7 +135,7 @@ void OsmRiversHandler::finalize()
     painterBase.fillPath(simplifiedAreas, BASE_COLOR);
     painterBase.drawPath(simplifiedAreas);
     
-    imageBase.save("riversBase.png");
+    ImageWriter::instance().saveDebug("rivers", "riversBase", xTile, yTile, [imageBase]{ return imageBase; });
     
     for (int x = 0; x < image.width(); x++)
         for (int y = 0; y < image.height(); y++) {
@@ -184,7 +145,16 @@ void OsmRiversHandler::finalize()
             image.setPixel(x, y, color.rgba());
         }
     
-    image.save("rivers.png");
+    QImage result = image;
+    ImageWriter::instance().saveDebug("rivers", "rivers", xTile, yTile, [result]{ return result; });
+}
+
+std::string OsmRiversHandler::styleKey() {
+    return "rivers:" + std::to_string(STYLE_VERSION) + ":" + std::to_string(BASE_COLOR.rgba()) + ":" + describeTags(TAGS_TO_INCLUDE);
+}
+
+const char* OsmRiversHandler::name() const {
+    return "rivers";
 }
 
 QImage OsmRiversHandler::getImage() const {
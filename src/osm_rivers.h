@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common.h"
+#include "geometry_arena.h"
 #include "osm_common.h"
 
 #include <osmium/handler.hpp>
@@ -10,7 +11,7 @@
 
 class OsmRiversHandler : public BaseHandler {
 public:
-    OsmRiversHandler(const Projector& proj_, const MinMax& minmax_, int imageSize);
+    OsmRiversHandler(const Projector& proj_, const MinMax& minmax_, int imageSize, int xTile_, int yTile_);
     
     virtual void area(const osmium::Area &area);
     virtual void way(const osmium::Way &way);
@@ -18,16 +19,22 @@ public:
     virtual void finalize();
     
     QImage getImage() const;
+
+    // Changes whenever the look of the layer does, for the tile cache
+    static std::string styleKey();
+
+    virtual const char* name() const;
     
 private:
     template<class Object>
     bool needObject(const Object &object) const;
     
-    QPainterPath paths;
-    QPainterPath areas;
+    // Outer rings and waterways, drawn in finalize()
+    GeometryArena arena;
     double scale;
     QImage image;
     const Projector& proj;
     const MinMax& minmax;
+    int xTile, yTile;
 }; 
 
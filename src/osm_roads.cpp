@@ -1,11 +1,14 @@
 #include "osm_roads.h"
 #include "common.h"
+#include "clip.h"
 
 #include <osmium/osm/way.hpp>
 #include <QPainterPathStroker>
 #include <Qt>
+#include <iterator>
 #include <map>
 #include <unordered_map>
+#include <sstream>
 
 namespace {
     struct RoadOptions {
@@ -22,6 +25,12 @@ namespace {
     std::map<RoadType, QColor> outlineColor{{RoadType::MAIN, mainRoadOutline}, {RoadType::SIDE, sideRoadOutline}};
     
     int BASE_WIDTH = 8;
+
+    // Widest outline stroke is 3*BASE_WIDTH + 4, with round caps
+    const double CLIP_HALO = 32;
+
+    // Bump on any change to the drawing code not covered by the constants here
+    const int STYLE_VERSION = 3;
     
     std::map<std::string, RoadOptions> options {
         {"motorway", {BASE_WIDTH*3, RoadType::MAIN}},
@@ -58,51 +67,44 @@ void OsmRoadsHandler::way(const osmium::Way& way)  {
     auto option = options.find(type);
     if (option == options.end())
         return;
-    QPainterPath path0;
-    bool first = true;
-    for (const auto& node: way.nodes()) {
-        if (!node.location())
-            continue;
-        point p = proj.transform({node.lon(), node.lat()});
-        double x = scale * (p.x-minmax.minx);
-        double y = scale * (minmax.maxy-p.y);
-        if (first) {
-            path0.moveTo(x, y);
-            first = false;
-        } else {
-            path0.lineTo(x, y);
-        }
-    }
-    QPainterPathStroker stroker;
-    stroker.setWidth(0.1);
-    stroker.setJoinStyle(Qt::PenJoinStyle::RoundJoin);
-    stroker.setCapStyle(Qt::PenCapStyle::RoundCap);
-
-    QPainterPath path = stroker.createStroke(path0);
-
-    stroker.setWidth(option->second.width);
-    stroker.setJoinStyle(Qt::PenJoinStyle::RoundJoin);
-    stroker.setCapStyle(Qt::PenCapStyle::RoundCap);
-    QPainterPath strokeOutline = stroker.createStroke(path0);
-    
-    stroker.setWidth(option->second.width + 4);
-    QPainterPath strokeOutlineWide = stroker.createStroke(path0);
-    
-    static int nInside = 0; 
-    if (strokeOutline.intersects(QRectF(0, 0, image.width(), image.height()))) {
-        nInside++;
-        if (nInside % 100 == 0) std::cout << nInside << std::endl;
-        unitedPath += strokeOutlineWide;
-        paths.push_back({path, option->second.type, option->second.width});
-        if (option->second.type == RoadType::MAIN) 
-            mainPath += strokeOutline;
-        else
-            sidePath += strokeOutline;
-    }
+    arena.beginShape(std::distance(options.begin(), option));
+    projectNodes(way.nodes(), proj, minmax, scale, 0, arena.projected());
+    arena.addLine(clip::window(image.width(), image.height(), CLIP_HALO));
+    arena.endShape();
 }
 
 void OsmRoadsHandler::finalize()
 {
+    std::vector<RoadPath> paths;
+    for (size_t i = 0; i < arena.size(); i++) {
+        const RoadOptions& option = std::next(options.begin(), arena.style(i))->second;
+        QPainterPath path0 = arena.path(i);
+        QPainterPathStroker stroker;
+        stroker.setWidth(0.1);
+        stroker.setJoinStyle(Qt::PenJoinStyle::RoundJoin);
+        stroker.setCapStyle(Qt::PenCapStyle::RoundCap);
+
+        QPainterPath path = stroker.createStroke(path0);
+
+        stroker.setWidth(option.width);
+        stroker.setJoinStyle(Qt::PenJoinStyle::RoundJoin);
+        stroker.setCapStyle(Qt::PenCapStyle::RoundCap);
+        QPainterPath strokeOutline = stroker.createStroke(path0);
+        
+        stroker.setWidth(option.width + 4);
+        QPainterPath strokeOutlineWide = stroker.createStroke(path0);
+        
+        if (strokeOutline.intersects(QRectF(0, 0, image.width(), image.height()))) {
+            acceptedCount++;
+            unitedPath += strokeOutlineWide;
+            paths.push_back({path, option.type, option.width});
+            if (option.type == RoadType::MAIN) 
+                mainPath += strokeOutline;
+            else
+                sidePath += strokeOutline;
+        }
+    }
+
     sort(paths.begin(), paths.end(), 
          [](const RoadPath& a, const RoadPath& b) { return a.type>b.type; } );
     
@@ -144,6 +146,20 @@ void OsmRoadsHandler::finalize()
     }
 }
 
+std::string OsmRoadsHandler::styleKey() {
+    std::ostringstream key;
+    key << "roads:" << STYLE_VERSION << ":" << BASE_WIDTH << ":";
+    for (const auto& option: options)
+        key << option.first << "=" << option.second.width << "/" << int(option.second.type) << ",";
+    for (const auto& color: {mainRoadFill, mainRoadOutline, sideRoadFill, sideRoadOutline})
+        key << ":" << color.rgba();
+    return key.str();
+}
+
+const char* OsmRoadsHandler::name() const {
+    return "roads";
+}
+
 const QPainterPath& OsmRoadsHandler::getUnitedPath() const {
     return unitedPath;
 }
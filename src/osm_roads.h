@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common.h"
+#include "geometry_arena.h"
 #include "osm_common.h"
 
 #include <osmium/handler.hpp>
@@ -9,6 +10,7 @@
 #include <QPainter>
 
 #include <memory>
+#include <string>
 
 enum class RoadType {MAIN, SIDE};
 
@@ -25,6 +27,11 @@ public:
     const QPainterPath& getUnitedPath() const;
     
     void setPlacesPath(const QPainterPath& path);
+
+    // Changes whenever the look of the layer does, for the tile cache
+    static std::string styleKey();
+
+    virtual const char* name() const;
     
 private:
     struct RoadPath {
@@ -36,7 +43,8 @@ private:
     double scale;
     QImage image;
     QPainterPath unitedPath, mainPath, sidePath;
-    std::vector<RoadPath> paths;
+    // Clipped center lines, styled by their position in the road options; stroked in finalize()
+    GeometryArena arena;
     const QPainterPath* placesPath;
     const Projector& proj;
     const MinMax& minmax;
@@ -0,0 +1,535 @@
+#include "partition.h"
+
+#include "dem_mosaic.h"
+#include "memory.h"
+#include "metrics.h"
+#include "mosaic.h"
+#include "png_writer.h"
+#include "render.h"
+#include "scheduler.h"
+#include "srtm.h"
+#include "tile_cache.h"
+
+#include <QImage>
+#include <QString>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+    const char* MANIFEST_MAGIC = "drawmap-manifest";
+    const int MANIFEST_VERSION = 2;
+    // Pause between passes over tiles claimed by other workers
+    const int RESCAN_SECONDS = 5;
+
+    struct Manifest {
+        // Empty when the layers don't read it
+        std::string osmFile;
+        // TileCache::fileIdentity of osmFile when planned
+        std::string osmIdentity;
+        // DEM mosaic, empty for the SRTM cells or when the layers don't read heights, and its identity
+        std::string demFile;
+        std::string demIdentity;
+        DemSmoothing demSmoothing = DemSmoothing::BILATERAL;
+        double centerLon, centerLat;
+        double tileSize;
+        int tiles;
+        int imageSize;
+        LayerSet layers = allLayerSet();
+        TileRange range;
+        std::vector<std::pair<int, int>> jobs;
+
+        Grid grid(const Projector& proj) const {
+            return Grid(proj.transform({centerLon, centerLat}), tileSize, tiles, imageSize);
+        }
+    };
+
+    std::string manifestPath(const std::string& dir) {
+        return dir + "/manifest";
+    }
+
+    std::string tilePath(const std::string& dir, int x, int y) {
+        return dir + "/tiles/" + Grid::tileFileName(x, y);
+    }
+
+    std::string claimPath(const std::string& dir, int x, int y) {
+        return dir + "/claims/" + std::to_string(x) + "-" + std::to_string(y);
+    }
+
+    std::string failedPath(const std::string& dir, int x, int y) {
+        return dir + "/failed/" + std::to_string(x) + "-" + std::to_string(y);
+    }
+
+    bool exists(const std::string& path) {
+        struct stat info;
+        return stat(path.c_str(), &info) == 0;
+    }
+
+    // Workers may run elsewhere, so inputs are named by their absolute paths
+    std::string absolutePath(const std::string& path) {
+        char resolved[PATH_MAX];
+        if (!realpath(path.c_str(), resolved))
+            throw std::runtime_error("Can't find " + path);
+        return resolved;
+    }
+
+    void makeDirectory(const std::string& path) {
+        if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+            throw std::runtime_error("Can't create directory " + path);
+    }
+
+    // Tile files of workers that died between writing and renaming them
+    void removeTemporaries(const std::string& dir) {
+        std::string tiles = dir + "/tiles";
+        DIR* listing = opendir(tiles.c_str());
+        if (!listing)
+            return;
+        while (dirent* entry = readdir(listing)) {
+            std::string name = entry->d_name;
+            if (name.find(".tmp.") != std::string::npos)
+                std::remove((tiles + "/" + name).c_str());
+        }
+        closedir(listing);
+    }
+
+    std::string hostName() {
+        char name[256] = {};
+        gethostname(name, sizeof(name) - 1);
+        return name;
+    }
+
+    // Unique among the workers sharing a directory, for claims and temporary files
+    std::string workerName() {
+        return hostName() + "-" + std::to_string(getpid());
+    }
+
+    void writeManifest(const Manifest& manifest, const std::string& dir) {
+        std::string tmpName = manifestPath(dir) + ".tmp." + workerName();
+        {
+            std::ofstream file(tmpName);
+            file << std::setprecision(17);
+            file << MANIFEST_MAGIC << " " << MANIFEST_VERSION << "\n"
+                 << "osm " << manifest.osmFile << "\n"
+                 << "identity " << manifest.osmIdentity << "\n"
+                 << "dem " << manifest.demFile << "\n"
+                 << "dem-identity " << manifest.demIdentity << "\n"
+                 << "dem-smoothing " << demSmooth::name(manifest.demSmoothing) << "\n"
+                 << "center " << manifest.centerLon << " " << manifest.centerLat << "\n"
+                 << "tile-size " << manifest.tileSize << "\n"
+                 << "tiles " << manifest.tiles << "\n"
+                 << "image-size " << manifest.imageSize << "\n"
+                 << "layers " << layerNames(manifest.layers) << "\n"
+                 << "range " << manifest.range.minX << " " << manifest.range.maxX << " "
+                 << manifest.range.minY << " " << manifest.range.maxY << "\n";
+            for (const auto& job: manifest.jobs)
+                file << "job " << job.first << " " << job.second << "\n";
+            if (!file)
+                throw std::runtime_error("Can't write " + tmpName);
+        }
+        if (std::rename(tmpName.c_str(), manifestPath(dir).c_str()) != 0)
+            throw std::runtime_error("Can't rename " + tmpName);
+    }
+
+    Manifest readManifest(const std::string& dir) {
+        std::ifstream file(manifestPath(dir));
+        if (!file)
+            throw std::runtime_error("Can't read " + manifestPath(dir));
+        std::string magic;
+        int version = 0;
+        file >> magic >> version;
+        if (magic != MANIFEST_MAGIC || version != MANIFEST_VERSION)
+            throw std::runtime_error("Can't read " + manifestPath(dir) + ": not a version "
+                                     + std::to_string(MANIFEST_VERSION) + " manifest");
+        Manifest manifest;
+        std::string key;
+        while (file >> key) {
+            if (key == "osm" || key == "identity" || key == "dem" || key == "dem-identity") {
+                // Paths run to the end of the line and may hold spaces
+                std::string value;
+                file.get();
+                std::getline(file, value);
+                if (key == "osm")
+                    manifest.osmFile = value;
+                else if (key == "identity")
+                    manifest.osmIdentity = value;
+                else if (key == "dem")
+                    manifest.demFile = value;
+                else
+                    manifest.demIdentity = value;
+            } else if (key == "dem-smoothing") {
+                std::string name;
+                file >> name;
+                try {
+                    manifest.demSmoothing = demSmooth::parse(name);
+                } catch (const std::runtime_error&) {
+                    throw std::runtime_error("Can't read " + manifestPath(dir) + ": unknown DEM smoothing " + name);
+                }
+            } else if (key == "center") {
+                file >> manifest.centerLon >> manifest.centerLat;
+            } else if (key == "tile-size") {
+                file >> manifest.tileSize;
+            } else if (key == "tiles") {
+                file >> manifest.tiles;
+            } else if (key == "image-size") {
+                file >> manifest.imageSize;
+            } else if (key == "layers") {
+                std::string names;
+                file >> names;
+                try {
+                    manifest.layers = parseLayers(names);
+                } catch (const std::runtime_error&) {
+                    throw std::runtime_error("Can't read " + manifestPath(dir) + ": unknown layers " + names);
+                }
+            } else if (key == "range") {
+                file >> manifest.range.minX >> manifest.range.maxX >> manifest.range.minY >> manifest.range.maxY;
+            } else if (key == "job") {
+                std::pair<int, int> job;
+                file >> job.first >> job.second;
+                manifest.jobs.push_back(job);
+            } else {
+                throw std::runtime_error("Can't read " + manifestPath(dir) + ": unknown key " + key);
+            }
+            if (!file)
+                throw std::runtime_error("Can't read " + manifestPath(dir) + ": malformed " + key);
+        }
+        return manifest;
+    }
+
+    /*
+     * Claim files of the tiles this process renders. A claim is a file
+     * created with O_EXCL, which is atomic on local filesystems and on NFS
+     * from version 3 on. A heartbeat thread refreshes the modification time
+     * of every held claim, so long tiles don't look abandoned.
+     */
+    class Claims {
+    public:
+        Claims(const std::string& dir, int timeoutSeconds) :
+            dir(dir), timeoutSeconds(timeoutSeconds), host(hostName()), stopping(false),
+            heartbeat([this] { refresh(); })
+        {}
+
+        ~Claims() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wakeup.notify_all();
+            heartbeat.join();
+        }
+
+        bool acquire(int x, int y) {
+            std::string path = claimPath(dir, x, y);
+            // A second attempt after taking over a stale claim
+            for (int attempt = 0; attempt < 2; attempt++) {
+                int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+                if (fd >= 0) {
+                    std::string owner = host + " " + std::to_string(getpid()) + "\n";
+                    bool written = write(fd, owner.data(), owner.size()) == ssize_t(owner.size());
+                    close(fd);
+                    if (!written)
+                        throw std::runtime_error("Can't write claim " + path);
+                    std::lock_guard<std::mutex> lock(mutex);
+                    held.insert(path);
+                    return true;
+                }
+                if (errno != EEXIST)
+                    throw std::runtime_error("Can't create claim " + path);
+                if (!stale(path))
+                    return false;
+                // Moved aside rather than removed, so workers that found it stale at once don't remove each other's new claims
+                std::string aside = path + ".stale." + workerName();
+                if (std::rename(path.c_str(), aside.c_str()) != 0)
+                    return false;
+                std::remove(aside.c_str());
+                metrics::log("Taking over stale claim " + path);
+            }
+            return false;
+        }
+
+        void release(int x, int y) {
+            std::string path = claimPath(dir, x, y);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                held.erase(path);
+            }
+            std::remove(path.c_str());
+        }
+
+    private:
+        bool stale(const std::string& path) const {
+            struct stat info;
+            if (stat(path.c_str(), &info) != 0)
+                return true;
+            std::ifstream file(path);
+            std::string owner;
+            long pid = 0;
+            file >> owner >> pid;
+            if (owner == host && pid > 0 && kill(pid, 0) != 0 && errno == ESRCH)
+                return true;
+            return std::time(nullptr) - info.st_mtime > timeoutSeconds;
+        }
+
+        void refresh() {
+            auto interval = std::chrono::seconds(std::max(1, timeoutSeconds / 4));
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!wakeup.wait_for(lock, interval, [this] { return stopping; }))
+                for (const auto& path: held)
+                    utime(path.c_str(), nullptr);
+        }
+
+        std::string dir;
+        int timeoutSeconds;
+        std::string host;
+        std::set<std::string> held;
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        bool stopping;
+        std::thread heartbeat;
+    };
+
+    // Counts tiles being rendered, so a worker never claims more than it has threads for
+    class Slots {
+    public:
+        explicit Slots(int count) : free(count) {}
+
+        void acquire() {
+            std::unique_lock<std::mutex> lock(mutex);
+            released.wait(lock, [this] { return free > 0; });
+            free--;
+        }
+
+        void release() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                free++;
+            }
+            released.notify_one();
+        }
+
+    private:
+        int free;
+        std::mutex mutex;
+        std::condition_variable released;
+    };
+}
+
+namespace partition {
+
+void plan(const Options& options, const std::string& dir, const TileRange& range, const TileSet* dirty) {
+    Manifest manifest;
+    manifest.layers = options.layers;
+    if (needsOsm(withDependencies(manifest.layers))) {
+        manifest.osmFile = absolutePath(options.osmFile);
+        manifest.osmIdentity = TileCache::fileIdentity(manifest.osmFile);
+    }
+    if (needsDem(withDependencies(manifest.layers)) && !options.demMosaic.empty()) {
+        manifest.demFile = absolutePath(options.demMosaic);
+        manifest.demIdentity = TileCache::fileIdentity(manifest.demFile);
+    }
+    manifest.demSmoothing = options.demSmoothing;
+    manifest.centerLon = options.centerLon;
+    manifest.centerLat = options.centerLat;
+    manifest.tileSize = options.tileSize;
+    manifest.tiles = options.tiles;
+    manifest.imageSize = options.imageSize;
+    manifest.range = range;
+    for (int y=range.minY; y<=range.maxY; y++)
+        for (int x=range.minX; x<=range.maxX; x++)
+            manifest.jobs.push_back({x, y});
+
+    // Clean tiles of the previous plan are kept only when they were drawn the same way
+    bool keepClean = false;
+    if (dirty) {
+        try {
+            Manifest previous = readManifest(dir);
+            keepClean = previous.layers == manifest.layers && previous.demFile == manifest.demFile
+                        && previous.demIdentity == manifest.demIdentity && previous.demSmoothing == manifest.demSmoothing;
+        } catch (const std::runtime_error&) {
+        }
+        if (!keepClean)
+            std::cout << "Tiles in " << dir << " were planned differently, rendering every tile" << std::endl;
+    }
+
+    for (const char* sub: {"", "/tiles", "/claims", "/failed"})
+        makeDirectory(dir + sub);
+    int toRender = 0;
+    for (const auto& job: manifest.jobs) {
+        if (keepClean && !dirty->count(job) && exists(tilePath(dir, job.first, job.second)))
+            continue;
+        std::remove(tilePath(dir, job.first, job.second).c_str());
+        std::remove(failedPath(dir, job.first, job.second).c_str());
+        toRender++;
+    }
+    writeManifest(manifest, dir);
+    std::cout << "Planned " << manifest.jobs.size() << " tiles in " << dir << ", " << toRender << " to render" << std::endl;
+}
+
+int work(const Options& options, const Projector& proj, const std::string& dir) {
+    Manifest manifest = readManifest(dir);
+    if (!manifest.osmFile.empty() && TileCache::fileIdentity(manifest.osmFile) != manifest.osmIdentity)
+        throw std::runtime_error("Can't render " + dir + ": " + manifest.osmFile + " changed since it was planned");
+    if (!manifest.demFile.empty() && TileCache::fileIdentity(manifest.demFile) != manifest.demIdentity)
+        throw std::runtime_error("Can't render " + dir + ": " + manifest.demFile + " changed since it was planned");
+    // The DEM as planned, whatever this worker was started with; declared before the pool that reads it
+    SRTMtoCV::setSmoothing(manifest.demSmoothing);
+    std::unique_ptr<DemMosaic> mosaic;
+    if (!manifest.demFile.empty())
+        mosaic.reset(new DemMosaic(manifest.demFile));
+    SRTMtoCV::setMosaic(mosaic.get());
+    Grid grid = manifest.grid(proj);
+    const int imageSize = manifest.imageSize;
+
+    size_t budgetBytes = options.memoryBudget < 0 ? memory::physicalMemory() / 4 * 3 : size_t(options.memoryBudget) << 20;
+    MemoryBudget budget(budgetBytes);
+    std::unique_ptr<TileCache> cache;
+    if (!options.cacheDir.empty())
+        cache.reset(new TileCache(options.cacheDir));
+
+    metrics::Tiles& progress = metrics::tiles();
+    progress.total.set(manifest.jobs.size());
+
+    std::string name = workerName();
+    Claims claims(dir, options.claimTimeout * 60);
+    SharedFeatures features(manifest.osmFile, proj, manifest.layers, budget);
+    std::atomic<int> failed(0);
+    // Declared before the pool, whose threads use them until it is destroyed
+    Slots slots(options.jobs > 0 ? options.jobs : int(std::max(1u, std::thread::hardware_concurrency())));
+    ThreadPool pool(options.jobs);
+    // Tiles already run in parallel, so each smooths and composites on its share of the cores
+    SRTMtoCV::setSmoothingThreads(std::max(1, int(std::thread::hardware_concurrency()) / pool.size()));
+    setCompositeThreads(std::max(1, int(std::thread::hardware_concurrency()) / pool.size()));
+
+    std::vector<std::pair<int, int>> pending = manifest.jobs;
+    while (!pending.empty()) {
+        std::vector<std::pair<int, int>> claimedElsewhere;
+        for (const auto& job: pending) {
+            int x = job.first, y = job.second;
+            if (exists(tilePath(dir, x, y)) || exists(failedPath(dir, x, y))) {
+                progress.reused.add();
+                continue;
+            }
+            slots.acquire();
+            if (!claims.acquire(x, y)) {
+                slots.release();
+                claimedElsewhere.push_back(job);
+                continue;
+            }
+            // Another worker may have finished it between the check and the claim
+            if (exists(tilePath(dir, x, y))) {
+                claims.release(x, y);
+                slots.release();
+                progress.reused.add();
+                continue;
+            }
+            MinMax minmax = grid.tileMinMax(x, y);
+            pool.submit([&, minmax, x, y] {
+                progress.inFlight.add(1);
+                try {
+                    QImage image;
+                    SharedInputs shared;
+                    shared.features = features.get();
+                    size_t estimate = memory::estimateTile(proj, minmax, imageSize, manifest.osmFile, manifest.layers,
+                                                           shared.features != nullptr);
+                    {
+                        MemoryBudget::Reservation reservation(budget, estimate);
+                        drawTile(&image, manifest.osmFile, proj, minmax, imageSize, x, y, cache.get(), shared,
+                                 manifest.layers);
+                    }
+                    std::string tmpName = tilePath(dir, x, y) + ".tmp." + name;
+                    savePng(image, tmpName, options.png);
+                    if (std::rename(tmpName.c_str(), tilePath(dir, x, y).c_str()) != 0)
+                        throw std::runtime_error("Can't rename " + tmpName);
+                    progress.rendered.add();
+                    metrics::log("tile " + std::to_string(x) + " " + std::to_string(y) + ": done, rss "
+                                 + std::to_string(memory::currentRss() >> 20) + " MB");
+                } catch (const std::exception& e) {
+                    progress.failed.add();
+                    failed++;
+                    std::ofstream(failedPath(dir, x, y)) << name << ": " << e.what() << std::endl;
+                    metrics::log("tile " + std::to_string(x) + " " + std::to_string(y) + ": " + e.what(), true);
+                }
+                progress.inFlight.add(-1);
+                claims.release(x, y);
+                slots.release();
+            });
+        }
+        pending.swap(claimedElsewhere);
+        // Tiles of other workers are waited for, in case a worker dies and leaves them to take over
+        if (!pending.empty())
+            std::this_thread::sleep_for(std::chrono::seconds(RESCAN_SECONDS));
+    }
+    pool.wait();
+    SRTMtoCV::setMosaic(nullptr);
+    return failed;
+}
+
+void merge(const Options& options, const std::string& dir) {
+    Manifest manifest = readManifest(dir);
+    const TileRange& range = manifest.range;
+
+    int missing = 0;
+    for (const auto& job: manifest.jobs) {
+        if (exists(tilePath(dir, job.first, job.second)))
+            continue;
+        if (missing++ < 10) {
+            std::ifstream reason(failedPath(dir, job.first, job.second));
+            std::string line;
+            std::getline(reason, line);
+            std::cerr << "tile " << job.first << " " << job.second << ": " << (line.empty() ? "not rendered" : line) << std::endl;
+        }
+    }
+    if (missing)
+        throw std::runtime_error("Can't merge " + dir + ": " + std::to_string(missing) + " tiles missing");
+
+    ThreadPool pool(options.jobs);
+    int pendingRows = std::max(2, (pool.size() + range.width() - 1) / range.width() + 1);
+    MosaicWriter mosaic(options.output, range.width(), range.height(), manifest.imageSize, pendingRows, options.png);
+    for (int y=range.minY; y<=range.maxY; y++) {
+        mosaic.waitForRow(y - range.minY);
+        for (int x=range.minX; x<=range.maxX; x++) {
+            pool.submit([&mosaic, &dir, &range, &manifest, x, y] {
+                QImage image;
+                if (!image.load(QString::fromStdString(tilePath(dir, x, y)))
+                        || image.width() != manifest.imageSize || image.height() != manifest.imageSize) {
+                    // Complete the row anyway, or the rows below would wait for it forever
+                    QImage empty(manifest.imageSize, manifest.imageSize, QImage::Format_ARGB32);
+                    empty.fill({255, 255, 255, 0});
+                    mosaic.addTile(x - range.minX, y - range.minY, empty);
+                    throw std::runtime_error("Can't read tile " + tilePath(dir, x, y));
+                }
+                mosaic.addTile(x - range.minX, y - range.minY, image);
+            });
+        }
+    }
+    pool.wait();
+    mosaic.finish();
+    removeTemporaries(dir);
+    std::cout << "Merged " << manifest.jobs.size() << " tiles into " << options.output << std::endl;
+}
+
+}
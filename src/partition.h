@@ -0,0 +1,44 @@
+#pragma once
+
+#include "common.h"
+#include "grid.h"
+#include "options.h"
+
+#include <string>
+
+/*
+ * Rendering split across processes that share only a directory. A planner
+ * writes the manifest of tile jobs; any number of workers, on this host or
+ * on others mounting the same directory, claim tiles one at a time with
+ * exclusively created claim files and render each one to its own PNG; a
+ * merge then streams the tile PNGs into the mosaic. Tiles are renamed into
+ * place whole, so a tile rendered twice after a lost claim costs time, not
+ * correctness.
+ *
+ * DIR/manifest        grid, extract, DEM and the tile jobs
+ * DIR/tiles/imgX-Y.png finished tiles; files of dead workers left half written are removed by merge
+ * DIR/claims/X-Y      "host pid" of the worker rendering the tile
+ * DIR/failed/X-Y      why the tile failed; such tiles are not retried until planned again
+ */
+namespace partition {
+    /*
+     * Writes the manifest of range into dir. Previous tile outputs in dir are
+     * removed, only those of the dirty tiles when a change set is given and
+     * the previous manifest had the same layers and DEM, so workers redo
+     * just these.
+     */
+    void plan(const Options& options, const std::string& dir, const TileRange& range, const TileSet* dirty = nullptr);
+
+    /*
+     * Claims and renders tiles of the manifest in dir on options.jobs threads,
+     * from the extract, DEM mosaic and smoothing it was planned with,
+     * until every tile is finished or failed, by this worker or by others.
+     * A claim is taken over when its worker has died on this host or when it
+     * has not been refreshed for options.claimTimeout minutes. Returns the
+     * number of tiles that failed here.
+     */
+    int work(const Options& options, const Projector& proj, const std::string& dir);
+
+    // Assembles the finished tiles of dir into options.output; throws if any is missing
+    void merge(const Options& options, const std::string& dir);
+}
@@ -0,0 +1,317 @@
+#include "png_writer.h"
+
+#include <QColor>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+    const int BYTES_PER_PIXEL = 4;
+    const size_t IDAT_SIZE = 1 << 20;
+
+    void putUint32(unsigned char* p, uint32_t v) {
+        p[0] = v >> 24;
+        p[1] = v >> 16;
+        p[2] = v >> 8;
+        p[3] = v;
+    }
+
+    inline unsigned char paeth(int a, int b, int c) {
+        int p = a + b - c;
+        int pa = std::abs(p - a);
+        int pb = std::abs(p - b);
+        int pc = std::abs(p - c);
+        if (pa <= pb && pa <= pc)
+            return a;
+        if (pb <= pc)
+            return b;
+        return c;
+    }
+
+    // Sum of the filtered bytes taken as signed, the libpng heuristic for picking a filter
+    long filterCost(const unsigned char* row, size_t size) {
+        long sum = 0;
+        for (size_t i = 1; i < size; i++)
+            sum += row[i] < 128 ? row[i] : 256 - row[i];
+        return sum;
+    }
+}
+
+PngOptions PngOptions::preset(const std::string& name) {
+    PngOptions options;
+    if (name == "fast") {
+        options.level = 1;
+        options.strategy = Z_RLE;
+        options.adaptiveFilter = false;
+    } else if (name == "archive") {
+        options.level = 9;
+        options.strategy = Z_DEFAULT_STRATEGY;
+        options.chunkSize = 16 << 20;
+    } else if (name != "default") {
+        throw std::runtime_error("Unknown PNG preset " + name);
+    }
+    return options;
+}
+
+PngWriter::PngWriter(const std::string& filename_, int width_, int height_, const PngOptions& options_) :
+    filename(filename_),
+    file(filename_, std::ios::out|std::ios::binary|std::ios::trunc),
+    out(file),
+    options(options_),
+    width(width_),
+    height(height_),
+    rowsWritten(0),
+    finished(false),
+    adler(adler32(0, Z_NULL, 0)),
+    prevRow(width_ * BYTES_PER_PIXEL, 0),
+    candidate(width_ * BYTES_PER_PIXEL + 1),
+    fullChunks(0)
+{
+    if (!file) {
+        throw std::runtime_error("Can't open file " + filename);
+    }
+    start();
+}
+
+PngWriter::PngWriter(std::ostream& out_, const std::string& name, int width_, int height_, const PngOptions& options_) :
+    filename(name),
+    out(out_),
+    options(options_),
+    width(width_),
+    height(height_),
+    rowsWritten(0),
+    finished(false),
+    adler(adler32(0, Z_NULL, 0)),
+    prevRow(width_ * BYTES_PER_PIXEL, 0),
+    candidate(width_ * BYTES_PER_PIXEL + 1),
+    fullChunks(0)
+{
+    start();
+}
+
+void PngWriter::start() {
+    int threads = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    size_t rowSize = candidate.size();
+    options.chunkSize = std::max(options.chunkSize, rowSize);
+    chunks.resize(threads);
+    for (auto& chunk: chunks)
+        chunk.data.reserve(options.chunkSize + rowSize);
+
+    static const unsigned char SIGNATURE[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    out.write(reinterpret_cast<const char*>(SIGNATURE), sizeof(SIGNATURE));
+
+    unsigned char header[13];
+    putUint32(header, width);
+    putUint32(header + 4, height);
+    header[8] = 8;   // bit depth
+    header[9] = 6;   // RGBA
+    header[10] = 0;  // deflate
+    header[11] = 0;  // adaptive filtering
+    header[12] = 0;  // no interlace
+    writeChunk("IHDR", header, sizeof(header));
+
+    // zlib header: 32K window deflate, the level hint and the check bits
+    int level = options.level < 0 ? 6 : options.level;
+    unsigned char zlibHeader[2] = {0x78, static_cast<unsigned char>((level <= 1 ? 0 : level <= 5 ? 1 : level == 6 ? 2 : 3) << 6)};
+    zlibHeader[1] += (31 - (zlibHeader[0] * 256 + zlibHeader[1]) % 31) % 31;
+    writeChunk("IDAT", zlibHeader, sizeof(zlibHeader));
+}
+
+int PngWriter::getWidth() const {
+    return width;
+}
+
+int PngWriter::getHeight() const {
+    return height;
+}
+
+void PngWriter::writeChunk(const char* type, const unsigned char* data, size_t size) {
+    unsigned char buffer[4];
+    putUint32(buffer, size);
+    out.write(reinterpret_cast<const char*>(buffer), 4);
+    out.write(type, 4);
+    if (size)
+        out.write(reinterpret_cast<const char*>(data), size);
+    uLong crc = crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+    if (size)
+        crc = crc32(crc, data, size);
+    putUint32(buffer, crc);
+    out.write(reinterpret_cast<const char*>(buffer), 4);
+    if (!out) {
+        throw std::runtime_error("Can't write data to file " + filename);
+    }
+}
+
+void PngWriter::filterRow(const unsigned char* row, unsigned char* filtered) {
+    const int size = width * BYTES_PER_PIXEL;
+    long bestCost = -1;
+    for (unsigned char type = options.adaptiveFilter ? 0 : 1; type <= 4; type++) {
+        candidate[0] = type;
+        for (int i = 0; i < size; i++) {
+            int a = i >= BYTES_PER_PIXEL ? row[i - BYTES_PER_PIXEL] : 0;
+            int b = prevRow[i];
+            int c = i >= BYTES_PER_PIXEL ? prevRow[i - BYTES_PER_PIXEL] : 0;
+            int predictor = 0;
+            switch (type) {
+                case 1: predictor = a; break;
+                case 2: predictor = b; break;
+                case 3: predictor = (a + b) / 2; break;
+                case 4: predictor = paeth(a, b, c); break;
+            }
+            candidate[i + 1] = row[i] - predictor;
+        }
+        if (!options.adaptiveFilter) {
+            std::memcpy(filtered, candidate.data(), candidate.size());
+            return;
+        }
+        long cost = filterCost(candidate.data(), candidate.size());
+        if (bestCost < 0 || cost < bestCost) {
+            bestCost = cost;
+            std::memcpy(filtered, candidate.data(), candidate.size());
+        }
+    }
+}
+
+void PngWriter::writeRow(const unsigned char* rgba) {
+    if (rowsWritten >= height) {
+        throw std::runtime_error("Too many rows written to " + filename);
+    }
+    auto& data = chunks[fullChunks].data;
+    size_t offset = data.size();
+    data.resize(offset + candidate.size());
+    filterRow(rgba, data.data() + offset);
+    std::memcpy(prevRow.data(), rgba, prevRow.size());
+    rowsWritten++;
+
+    if (data.size() >= options.chunkSize) {
+        fullChunks++;
+        if (fullChunks == chunks.size())
+            compressChunks(false);
+    }
+}
+
+void PngWriter::compress(Chunk& chunk, bool last) const {
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    // Raw deflate: the zlib header and checksum are written once for the whole image
+    if (deflateInit2(&stream, options.level, Z_DEFLATED, -15, 9, options.strategy) != Z_OK) {
+        throw std::runtime_error("Can't initialize zlib for " + filename);
+    }
+    chunk.adler = adler32(0, Z_NULL, 0);
+    chunk.adler = adler32(chunk.adler, chunk.data.data(), chunk.data.size());
+    chunk.compressed.resize(deflateBound(&stream, chunk.data.size()) + 16);
+    stream.next_in = chunk.data.data();
+    stream.avail_in = chunk.data.size();
+    int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+    while (true) {
+        stream.next_out = chunk.compressed.data() + stream.total_out;
+        stream.avail_out = chunk.compressed.size() - stream.total_out;
+        int status = deflate(&stream, flush);
+        if (status == Z_STREAM_ERROR) {
+            deflateEnd(&stream);
+            throw std::runtime_error("zlib error while writing " + filename);
+        }
+        if (stream.avail_out != 0)
+            break;
+        chunk.compressed.resize(chunk.compressed.size() * 2);
+    }
+    chunk.compressed.resize(stream.total_out);
+    deflateEnd(&stream);
+}
+
+void PngWriter::compressChunks(bool last) {
+    // On the last call the chunk being filled is compressed too, ending the stream
+    size_t count = last ? fullChunks + 1 : fullChunks;
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(count);
+    for (size_t i = 0; i < count; i++) {
+        bool isLast = last && i + 1 == count;
+        threads.emplace_back([this, i, isLast, &errors] {
+            try {
+                compress(chunks[i], isLast);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for (auto& thread: threads)
+        thread.join();
+    for (auto& error: errors)
+        if (error)
+            std::rethrow_exception(error);
+
+    for (size_t i = 0; i < count; i++) {
+        Chunk& chunk = chunks[i];
+        adler = adler32_combine(adler, chunk.adler, chunk.data.size());
+        for (size_t offset = 0; offset < chunk.compressed.size(); offset += IDAT_SIZE)
+            writeChunk("IDAT", chunk.compressed.data() + offset, std::min(IDAT_SIZE, chunk.compressed.size() - offset));
+        chunk.data.clear();
+        chunk.compressed.clear();
+        chunk.compressed.shrink_to_fit();
+    }
+    fullChunks = 0;
+}
+
+void PngWriter::finish() {
+    if (finished)
+        return;
+    // Pad with transparent rows if the caller stopped early
+    std::vector<unsigned char> empty(width * BYTES_PER_PIXEL, 0);
+    while (rowsWritten < height)
+        writeRow(empty.data());
+    if (fullChunks == chunks.size())
+        compressChunks(false);
+    compressChunks(true);
+
+    unsigned char trailer[4];
+    putUint32(trailer, adler);
+    writeChunk("IDAT", trailer, sizeof(trailer));
+    writeChunk("IEND", nullptr, 0);
+    if (file.is_open())
+        file.close();
+    finished = true;
+}
+
+void toRgba(const QImage& image, int y, unsigned char* rgba) {
+    bool premultiplied = image.format() == QImage::Format_ARGB32_Premultiplied;
+    const QRgb* src = reinterpret_cast<const QRgb*>(image.constScanLine(y));
+    for (int i = 0; i < image.width(); i++) {
+        QRgb pixel = premultiplied ? qUnpremultiply(src[i]) : src[i];
+        rgba[4*i] = qRed(pixel);
+        rgba[4*i + 1] = qGreen(pixel);
+        rgba[4*i + 2] = qBlue(pixel);
+        rgba[4*i + 3] = qAlpha(pixel);
+    }
+}
+
+namespace {
+    void writeImage(const QImage& image, PngWriter& writer) {
+        QImage source = image;
+        if (source.format() != QImage::Format_ARGB32 && source.format() != QImage::Format_ARGB32_Premultiplied
+                && source.format() != QImage::Format_RGB32)
+            source = source.convertToFormat(QImage::Format_ARGB32);
+        std::vector<unsigned char> row(source.width() * 4);
+        for (int y = 0; y < source.height(); y++) {
+            toRgba(source, y, row.data());
+            writer.writeRow(row.data());
+        }
+        writer.finish();
+    }
+}
+
+void savePng(const QImage& image, const std::string& filename, const PngOptions& options) {
+    PngWriter writer(filename, image.width(), image.height(), options);
+    writeImage(image, writer);
+}
+
+std::string encodePng(const QImage& image, const PngOptions& options) {
+    std::ostringstream out(std::ios::out|std::ios::binary);
+    PngWriter writer(out, "in-memory PNG", image.width(), image.height(), options);
+    writeImage(image, writer);
+    return out.str();
+}
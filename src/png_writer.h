@@ -0,0 +1,84 @@
+#pragma once
+
+#include <QImage>
+
+#include <zlib.h>
+
+#include <cstdint>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+struct PngOptions {
+    // zlib level 0..9 and strategy (Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE, Z_HUFFMAN_ONLY)
+    int level = 6;
+    int strategy = Z_FILTERED;
+    // Pick the best of the five PNG filters per row; otherwise always use Sub
+    bool adaptiveFilter = true;
+    // Threads compressing chunks in parallel, 0 for one per core
+    int threads = 0;
+    // Uncompressed bytes per independently compressed chunk
+    size_t chunkSize = 4 << 20;
+
+    // "fast", "default" or "archive"; throws on anything else
+    static PngOptions preset(const std::string& name);
+};
+
+/*
+ * Streams an 8-bit RGBA PNG row by row. Filtered rows are collected into
+ * chunks that are deflated in parallel, each ending on a byte boundary
+ * (sync flush), and concatenated into one zlib stream whose checksum is
+ * combined from the per-chunk ones. Only `threads` chunks are held at a
+ * time.
+ */
+class PngWriter {
+public:
+    PngWriter(const std::string& filename, int width, int height, const PngOptions& options = PngOptions());
+
+    // Writes into out, which must outlive the writer; name is only used in error messages
+    PngWriter(std::ostream& out, const std::string& name, int width, int height, const PngOptions& options = PngOptions());
+
+    // rgba is width*4 bytes of non-premultiplied R, G, B, A
+    void writeRow(const unsigned char* rgba);
+
+    void finish();
+
+    int getWidth() const;
+
+    int getHeight() const;
+
+private:
+    struct Chunk {
+        std::vector<unsigned char> data;
+        std::vector<unsigned char> compressed;
+        uLong adler;
+    };
+
+    void start();
+    void writeChunk(const char* type, const unsigned char* data, size_t size);
+    void filterRow(const unsigned char* row, unsigned char* filtered);
+    void compressChunks(bool last);
+    void compress(Chunk& chunk, bool last) const;
+
+    std::string filename;
+    std::ofstream file;
+    std::ostream& out;
+    PngOptions options;
+    int width, height;
+    int rowsWritten;
+    bool finished;
+    uLong adler;
+    std::vector<unsigned char> prevRow;
+    std::vector<unsigned char> candidate;
+    std::vector<Chunk> chunks;
+    size_t fullChunks;
+};
+
+// Converts row y of an ARGB32 (premultiplied or not) or RGB32 image into RGBA bytes
+void toRgba(const QImage& image, int y, unsigned char* rgba);
+
+void savePng(const QImage& image, const std::string& filename, const PngOptions& options = PngOptions());
+
+// The PNG file savePng would write, in memory
+std::string encodePng(const QImage& image, const PngOptions& options = PngOptions());
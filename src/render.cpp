@@ -0,0 +1,394 @@
+#include "render.h"
+
+#include "srtm.h"
+#include "compositor.h"
+
+#include "osm_roads.h"
+#include "osm_rail.h"
+#include "osm_places.h"
+#include "osm_rivers.h"
+#include "osm_forests.h"
+#include "osm_main.h"
+#include "image_writer.h"
+#include "memory.h"
+#include "mosaic.h"
+#include "png_writer.h"
+#include "run_journal.h"
+#include "scheduler.h"
+#include "tile_cache.h"
+#include "layers.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <QImage>
+#include <QString>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+    int compositeThreads = 0;
+
+    // Layers of the finished tiles next to it, empty while a run rewrites them
+    const char* TILE_LAYERS_FILE = "tiles.layers";
+
+    // Tiles from before it was kept were drawn with every layer
+    std::string tileLayers(const std::string& filename) {
+        std::ifstream file(filename);
+        if (!file)
+            return layerNames(allLayerSet());
+        std::string names;
+        file >> names;
+        return names;
+    }
+
+    void setTileLayers(const std::string& filename, const std::string& names) {
+        std::ofstream file(filename);
+        file << names << "\n";
+        if (!file)
+            throw std::runtime_error("Can't write " + filename);
+    }
+
+    std::string layerStyleKey(Layer layer) {
+        switch (layer) {
+            case Layer::HILLS: return SRTMtoCV::styleKey();
+            case Layer::FORESTS: return OsmForestsHandler::styleKey();
+            case Layer::RIVERS: return OsmRiversHandler::styleKey();
+            case Layer::ROADS: return OsmRoadsHandler::styleKey();
+            case Layer::RAIL: return OsmRailHandler::styleKey();
+            case Layer::PLACES: return OsmPlacesHandler::styleKey();
+        }
+        return "";
+    }
+
+    // Images the layer is drawn as; rail's outline and fill are blended by the compositor
+    size_t layerParts(Layer layer) {
+        return layer == Layer::RAIL ? 2 : 1;
+    }
+
+    // Cache entry of one image of a layer
+    std::string partKey(const std::string& key, size_t part) {
+        return part ? key + "-" + std::to_string(part) : key;
+    }
+
+    // Hash of everything the layer image of the tile depends on, its input layers' styles included
+    std::string layerKey(Layer layer, const std::string& osmFile, const Projector& proj, const MinMax& minmax,
+                         int imageSize, int xTile, int yTile) {
+        std::ostringstream description;
+        description << std::setprecision(17) << minmax.minx << " " << minmax.miny << " "
+                    << minmax.maxx << " " << minmax.maxy << " " << imageSize << " " << xTile << " " << yTile;
+        for (auto input: withDependencies({layer}))
+            description << "|" << layerStyleKey(input);
+        if (needsOsm({layer}))
+            description << "|" << TileCache::fileIdentity(osmFile);
+        if (needsDem({layer}))
+            for (const auto& file: SRTMtoCV::cellFiles(proj, minmax))
+                description << "|" << TileCache::fileIdentity(file);
+        return TileCache::hash(description.str());
+    }
+}
+
+std::string tileKey(const std::string& osmFile, const Projector& proj, const MinMax& minmax, int imageSize,
+                    int xTile, int yTile, const LayerSet& layers) {
+    std::string keys;
+    for (auto layer: allLayers())
+        if (layers.count(layer))
+            keys += layerKey(layer, osmFile, proj, minmax, imageSize, xTile, yTile);
+    return TileCache::hash(keys);
+}
+
+SharedFeatures::SharedFeatures(const std::string& osmFile_, const Projector& proj_, const LayerSet& layers,
+                               MemoryBudget& budget_) :
+    osmFile(osmFile_),
+    proj(proj_),
+    needed(needsOsm(withDependencies(layers))),
+    budget(budget_)
+{}
+
+const FeatureStore* SharedFeatures::get() {
+    if (!needed)
+        return nullptr;
+    // A failed read leaves the flag unset, so the next tile tries again
+    std::call_once(once, [this] {
+        store.reset(new FeatureStore(osmFile, proj));
+        budget.hold(store->getMemory());
+    });
+    return store.get();
+}
+
+std::map<Layer, std::vector<QImage>> drawLayers(const std::string& osmFile, const Projector& proj, const MinMax& minmax,
+                                   int imageSize, int xTile, int yTile, const TileCache* cache,
+                                   const SharedInputs& shared, const LayerSet& layers) {
+    trace::TileScope tileScope(xTile, yTile);
+
+    std::map<Layer, std::vector<QImage>> images;
+    std::map<Layer, std::string> keys;
+    LayerSet stale;
+    trace::Span cacheLoad("cache.load");
+    for (auto layer: allLayers()) {
+        if (!layers.count(layer))
+            continue;
+        if (cache) {
+            keys[layer] = layerKey(layer, osmFile, proj, minmax, imageSize, xTile, yTile);
+            std::vector<QImage> parts(layerParts(layer));
+            size_t loaded = 0;
+            while (loaded < parts.size() && cache->load(partKey(keys[layer], loaded), parts[loaded]))
+                loaded++;
+            if (loaded == parts.size()) {
+                images[layer] = parts;
+                continue;
+            }
+        }
+        stale.insert(layer);
+    }
+    cacheLoad.end();
+    if (stale.empty()) {
+        metrics::log("tile " + std::to_string(xTile) + " " + std::to_string(yTile) + " is fully cached");
+    }
+
+    // Layers to run: the stale ones and whatever they take input from
+    LayerSet run = withDependencies(stale);
+    auto fresh = [&](Layer layer, const std::vector<QImage>& parts) {
+        if (stale.count(layer) == 0)
+            return;
+        images[layer] = parts;
+        if (!cache)
+            return;
+        TRACE_SCOPE("cache.store");
+        try {
+            for (size_t part = 0; part < parts.size(); part++)
+                cache->store(partKey(keys[layer], part), parts[part]);
+        } catch (const std::exception& e) {
+            metrics::log(e.what(), true);
+        }
+    };
+
+    std::unique_ptr<SRTMtoCV> srtm;
+    if (needsDem(run)) {
+        TRACE_SCOPE("hills");
+        if (shared.dem)
+            srtm.reset(new SRTMtoCV(*shared.dem, proj, minmax, imageSize));
+        else
+            srtm.reset(new SRTMtoCV(proj, minmax, imageSize));
+
+        ImageWriter& writer = ImageWriter::instance();
+        cv::Mat heights = srtm->getCvHeights(), xGrad = srtm->getXGrad(), yGrad = srtm->getYGrad();
+        writer.saveDebug("hills", "test-cv", xTile, yTile, [heights]{ return cvPaint::paint(heights); });
+        writer.saveDebug("hills", "test-xgrad", xTile, yTile, [xGrad]{ return cvPaint::paint(xGrad); });
+        writer.saveDebug("hills", "test-ygrad", xTile, yTile, [yGrad]{ return cvPaint::paint(yGrad); });
+        writer.saveDebug("hills", "test-grads", xTile, yTile, [xGrad, yGrad]{ return cvPaint::paintGrads(xGrad, yGrad); });
+    }
+
+    std::unique_ptr<OsmRoadsHandler> roads;
+    std::unique_ptr<OsmRailHandler> rail;
+    std::unique_ptr<OsmPlacesHandler> places;
+    std::unique_ptr<OsmRiversHandler> rivers;
+    std::unique_ptr<OsmForestsHandler> forests;
+
+    OsmDrawer osm;
+    if (run.count(Layer::ROADS)) {
+        roads.reset(new OsmRoadsHandler(proj, minmax, imageSize));
+        osm.addHandler(roads.get());
+    }
+    if (run.count(Layer::RAIL)) {
+        rail.reset(new OsmRailHandler(proj, minmax, imageSize));
+        osm.addHandler(rail.get());
+    }
+    if (run.count(Layer::RIVERS)) {
+        rivers.reset(new OsmRiversHandler(proj, minmax, imageSize, xTile, yTile));
+        osm.addHandler(rivers.get());
+    }
+    if (run.count(Layer::FORESTS)) {
+        forests.reset(new OsmForestsHandler(proj, minmax, imageSize, xTile, yTile));
+        forests->setHeights(srtm->getCvHeights());
+        osm.addHandler(forests.get());
+    }
+    // Last, so roads, rail and forests have built the paths it cuts by the time it finalizes
+    if (run.count(Layer::PLACES)) {
+        places.reset(new OsmPlacesHandler(proj, minmax, imageSize));
+        osm.addHandler(places.get());
+    }
+
+    static const QPainterPath NO_PLACES;
+    if (roads)
+        roads->setPlacesPath(places ? places->getUnitedPath() : NO_PLACES);
+    if (places) {
+        places->setRoadsPath(roads->getUnitedPath());
+        places->setRailPath(rail->getUnitedPath());
+        places->setForestAreas(forests->getAreas());
+    }
+
+    if (needsOsm(run)) {
+        if (shared.features) {
+            // Handlers draw up to forests' 100 pixel margin past the tile
+            static const double QUERY_MARGIN_PIXELS = 128;
+            double margin = QUERY_MARGIN_PIXELS * (minmax.maxx - minmax.minx) / imageSize;
+            MinMax area = minmax;
+            area.minx -= margin;
+            area.miny -= margin;
+            area.maxx += margin;
+            area.maxy += margin;
+            osm.dispatch(*shared.features, area);
+        }
+        else
+            osm.dispatch(osmFile);
+    }
+
+    if (srtm) {
+        TRACE_SCOPE("hills.paint");
+        fresh(Layer::HILLS, {cvPaint::paintGrads(srtm->getXGrad(), srtm->getYGrad())});
+    }
+    if (forests)
+        fresh(Layer::FORESTS, {forests->getImage()});
+    if (rivers)
+        fresh(Layer::RIVERS, {rivers->getImage()});
+    if (roads)
+        fresh(Layer::ROADS, {roads->getImage()});
+    if (rail)
+        fresh(Layer::RAIL, rail->getLayers());
+    if (places)
+        fresh(Layer::PLACES, {places->getImage()});
+
+    return images;
+}
+
+void drawTile(QImage* result, const std::string& osmFile, const Projector& proj, const MinMax& minmax, int imageSize,
+              int xTile, int yTile, const TileCache* cache, const SharedInputs& shared, const LayerSet& layers) {
+    trace::TileScope tileScope(xTile, yTile);
+    TRACE_SCOPE("tile");
+    auto images = drawLayers(osmFile, proj, minmax, imageSize, xTile, yTile, cache, shared, layers);
+    std::vector<QImage> drawn;
+    for (auto layer: allLayers())
+        if (layers.count(layer))
+            drawn.insert(drawn.end(), images[layer].begin(), images[layer].end());
+    TRACE_SCOPE("composite");
+    *result = composite(drawn, compositeThreads);
+}
+
+void setCompositeThreads(int threads) {
+    compositeThreads = threads;
+}
+
+int renderGrid(const Options& options, const Projector& proj, const Grid& grid, const TileRange& range,
+               const TileSet* dirty) {
+    const int imageSize = grid.getImageSize();
+    size_t budgetBytes = options.memoryBudget < 0 ? memory::physicalMemory() / 4 * 3 : size_t(options.memoryBudget) << 20;
+    MemoryBudget budget(budgetBytes);
+
+    std::unique_ptr<TileCache> cache;
+    if (!options.cacheDir.empty())
+        cache.reset(new TileCache(options.cacheDir));
+    std::unique_ptr<RunJournal> journal;
+    if (!options.runDir.empty()) {
+        journal.reset(new RunJournal(options.runDir));
+        std::cout << "Run directory " << options.runDir << " holds " << journal->size() << " finished tiles" << std::endl;
+    }
+
+    // Clean tiles are only reused when drawn with the same layers, and the finished tiles are
+    // marked as mixed until this run has rewritten them all
+    std::string layersFile = journal ? options.runDir + "/" + TILE_LAYERS_FILE : TILE_LAYERS_FILE;
+    if (dirty && tileLayers(layersFile) != layerNames(options.layers)) {
+        std::cout << "Finished tiles hold other layers than " << layerNames(options.layers) << ", rendering every tile"
+                  << std::endl;
+        dirty = nullptr;
+    }
+    setTileLayers(layersFile, "");
+
+    metrics::Tiles& progress = metrics::tiles();
+    progress.total.set(range.width() * range.height());
+
+    SharedFeatures features(options.osmFile, proj, options.layers, budget);
+    int threads = options.jobs > 0 ? options.jobs : int(std::max(1u, std::thread::hardware_concurrency()));
+    // Declared before the pools, whose tasks add tiles to it until they are destroyed
+    int pendingRows = std::max(2, (threads + range.width() - 1) / range.width() + 1);
+    MosaicWriter mosaic(options.output, range.width(), range.height(), imageSize, pendingRows, options.png);
+    std::atomic<int> failed(0);
+    ThreadPool pool(threads);
+    // Tiles already run in parallel, so each smooths and composites on its share of the cores
+    SRTMtoCV::setSmoothingThreads(std::max(1, int(std::thread::hardware_concurrency()) / pool.size()));
+    setCompositeThreads(std::max(1, int(std::thread::hardware_concurrency()) / pool.size()));
+    // Strips are encoded in order on their own thread, so render workers never wait for them
+    ThreadPool mosaicPool(1);
+
+    // Tiles are submitted row by row, never more than pendingRows rows ahead of the mosaic,
+    // so finished tiles don't pile up in memory
+    for (int y=range.minY; y<=range.maxY; y++) {
+        mosaic.waitForRow(y - range.minY);
+        for (int x=range.minX; x<=range.maxX; x++) {
+            MinMax minmax = grid.tileMinMax(x, y);
+            int mx = x - range.minX, my = y - range.minY;
+            pool.submit([&mosaicPool, &mosaic, &options, &budget, &proj, &cache, &journal, &progress, &features, &failed,
+                         dirty, imageSize, minmax, x, y, mx, my] {
+                auto image = std::make_shared<QImage>();
+                bool clean = dirty && !dirty->count({x, y});
+                std::string key = journal ? tileKey(options.osmFile, proj, minmax, imageSize, x, y, options.layers) : "";
+                // A finished tile is taken from the run directory when nothing it depends on has changed, or
+                // whatever it was rendered from when a change set leaves it clean. Without a run directory, a
+                // clean tile is taken from the previous run's file. Either way it must be intact and of this size.
+                bool loaded = journal ? journal->load(x, y, clean ? "" : key, image.get())
+                                      : clean && image->load(QString::fromStdString(Grid::tileFileName(x, y)));
+                if (loaded && image->width() == imageSize && image->height() == imageSize) {
+                    mosaicPool.submit([&mosaic, image, mx, my] { mosaic.addTile(mx, my, *image); });
+                    progress.reused.add();
+                    return;
+                }
+                progress.inFlight.add(1);
+                bool rendered = false;
+                try {
+                    {
+                        SharedInputs shared;
+                        shared.features = features.get();
+                        size_t estimate = memory::estimateTile(proj, minmax, imageSize, options.osmFile,
+                                                               options.layers, shared.features != nullptr);
+                        MemoryBudget::Reservation reservation(budget, estimate);
+                        drawTile(image.get(), options.osmFile, proj, minmax, imageSize, x, y, cache.get(), shared,
+                                 options.layers);
+                        std::ostringstream line;
+                        line << "tile " << x << " " << y << ": estimated " << (estimate >> 20)
+                             << " MB, reserved " << (reservation.getBytes() >> 20)
+                             << " MB, rss " << (memory::currentRss() >> 20) << " MB";
+                        metrics::log(line.str());
+                    }
+                    rendered = true;
+                    // In the mosaic before it is saved, so a tile that can't be saved still completes its row
+                    mosaicPool.submit([&mosaic, image, mx, my] { mosaic.addTile(mx, my, *image); });
+                    if (journal)
+                        journal->record(x, y, key, encodePng(*image, options.png));
+                    else
+                        ImageWriter::instance().save(*image, Grid::tileFileName(x, y));
+                } catch (const std::exception& e) {
+                    progress.inFlight.add(-1);
+                    progress.failed.add();
+                    failed++;
+                    metrics::log("tile " + std::to_string(x) + " " + std::to_string(y) + ": " + e.what(), true);
+                    if (rendered)
+                        return;
+                    // Leave a transparent hole so the rows below can still be written
+                    QImage empty(imageSize, imageSize, QImage::Format_ARGB32);
+                    empty.fill({255, 255, 255, 0});
+                    mosaicPool.submit([&mosaic, empty, mx, my] { mosaic.addTile(mx, my, empty); });
+                    return;
+                }
+                progress.inFlight.add(-1);
+                progress.rendered.add();
+            });
+        }
+    }
+    pool.wait();
+    mosaicPool.wait();
+    ImageWriter::instance().flush();
+
+    mosaic.finish();
+    // Failed tiles left holes, so the tiles stay marked as mixed
+    if (!failed)
+        setTileLayers(layersFile, layerNames(options.layers));
+    return failed;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "common.h"
+#include "grid.h"
+#include "options.h"
+#include "tile_cache.h"
+#include "layers.h"
+#include "memory.h"
+#include "osm_main.h"
+#include "srtm.h"
+
+#include <QImage>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Inputs kept resident between tiles; the ones left null are read from disk by each tile
+struct SharedInputs {
+    const FeatureStore* features = nullptr;
+    SRTMProvider* dem = nullptr;
+};
+
+/*
+ * The FeatureStore of a batch of tiles, read by the first tile that asks
+ * for it, so the tiles replay it instead of each streaming the whole
+ * extract, and a batch whose tiles are all reused doesn't read it at all.
+ * Its memory is held out of the budget for the rest of the batch.
+ */
+class SharedFeatures {
+public:
+    SharedFeatures(const std::string& osmFile, const Projector& proj, const LayerSet& layers, MemoryBudget& budget);
+
+    // nullptr when none of the layers needs the extract
+    const FeatureStore* get();
+
+private:
+    std::string osmFile;
+    const Projector& proj;
+    bool needed;
+    MemoryBudget& budget;
+    std::once_flag once;
+    std::unique_ptr<FeatureStore> store;
+};
+
+/*
+ * Draws the given layers of one tile, unblended: the images of each layer,
+ * bottom to top, as the compositor takes them. Their handlers run
+ * together with the ones they take input from, and no others: the extract
+ * isn't read when none of them needs it, nor the DEM. With a cache, layers
+ * whose inputs and style haven't changed are loaded from it and only the
+ * stale ones (and the layers they depend on) are run.
+ */
+std::map<Layer, std::vector<QImage>> drawLayers(const std::string& osmFile, const Projector& proj, const MinMax& minmax,
+                                   int imageSize, int xTile, int yTile, const TileCache* cache = nullptr,
+                                   const SharedInputs& shared = SharedInputs(), const LayerSet& layers = allLayerSet());
+
+// Hash of everything a finished tile depends on: its place in the grid, its layers' styles and the input files
+std::string tileKey(const std::string& osmFile, const Projector& proj, const MinMax& minmax, int imageSize,
+                    int xTile, int yTile, const LayerSet& layers = allLayerSet());
+
+/*
+ * Renders one tile: the layers of drawLayers, composited into result.
+ */
+void drawTile(QImage* result, const std::string& osmFile, const Projector& proj, const MinMax& minmax, int imageSize,
+              int xTile, int yTile, const TileCache* cache = nullptr, const SharedInputs& shared = SharedInputs(),
+              const LayerSet& layers = allLayerSet());
+
+/*
+ * Threads drawTile composites each tile on from then on; <= 0, the
+ * default, means one per core, for tiles rendered one at a time. Set
+ * before rendering starts.
+ */
+void setCompositeThreads(int threads);
+
+/*
+ * Renders the tiles of range on a thread pool, saving each one as
+ * Grid::tileFileName and streaming the mosaic of the range to options.output.
+ * The tiles share one SharedFeatures. With dirty given, only those tiles are
+ * rendered; the others are read back from their files to rebuild the mosaic.
+ * With options.runDir, tiles go to its RunJournal instead, and tiles it
+ * holds with their current tileKey are not rendered again. Either way,
+ * tiles.layers next to the tiles records their layers, and clean tiles
+ * drawn with other layers or by a run that didn't finish are rendered.
+ * A tile that fails is left as a transparent hole in the mosaic; returns
+ * the number of such tiles.
+ */
+int renderGrid(const Options& options, const Projector& proj, const Grid& grid, const TileRange& range,
+               const TileSet* dirty = nullptr);
@@ -0,0 +1,112 @@
+#include "rtree.h"
+
+#include <algorithm>
+#include <numeric>
+
+namespace {
+    const uint32_t HILBERT_SIDE = 1 << 16;
+
+    // Position of cell x, y along the Hilbert curve filling a HILBERT_SIDE square
+    uint32_t hilbert(uint32_t x, uint32_t y) {
+        uint32_t d = 0;
+        for (uint32_t s = HILBERT_SIDE / 2; s > 0; s /= 2) {
+            uint32_t rx = (x & s) > 0;
+            uint32_t ry = (y & s) > 0;
+            d += s * s * ((3 * rx) ^ ry);
+            if (ry == 0) {
+                if (rx == 1) {
+                    x = HILBERT_SIDE - 1 - x;
+                    y = HILBERT_SIDE - 1 - y;
+                }
+                std::swap(x, y);
+            }
+        }
+        return d;
+    }
+
+    bool intersects(const MinMax& a, const MinMax& b) {
+        return a.minx <= b.maxx && b.minx <= a.maxx && a.miny <= b.maxy && b.miny <= a.maxy;
+    }
+
+    void extend(MinMax& box, const MinMax& other) {
+        box.minx = std::min(box.minx, other.minx);
+        box.miny = std::min(box.miny, other.miny);
+        box.maxx = std::max(box.maxx, other.maxx);
+        box.maxy = std::max(box.maxy, other.maxy);
+    }
+}
+
+PackedRTree::PackedRTree(const std::vector<MinMax>& items_) :
+    items(items_.size())
+{
+    if (items == 0)
+        return;
+
+    MinMax extent = items_[0];
+    for (const auto& box: items_)
+        extend(extent, box);
+    double width = std::max(extent.maxx - extent.minx, 1e-9);
+    double height = std::max(extent.maxy - extent.miny, 1e-9);
+    std::vector<uint32_t> keys(items);
+    for (size_t i = 0; i < items; i++) {
+        const MinMax& box = items_[i];
+        double cx = ((box.minx + box.maxx) / 2 - extent.minx) / width;
+        double cy = ((box.miny + box.maxy) / 2 - extent.miny) / height;
+        keys[i] = hilbert(uint32_t(cx * (HILBERT_SIDE - 1)), uint32_t(cy * (HILBERT_SIDE - 1)));
+    }
+    std::vector<uint32_t> order(items);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&keys](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+
+    for (uint32_t id: order) {
+        boxes.push_back(items_[id]);
+        indices.push_back(id);
+    }
+    levelEnds.push_back(boxes.size());
+    // Every pass groups the previous level into nodes of NODE_SIZE, until one root is left
+    size_t begin = 0;
+    while (levelEnds.back() - begin > 1) {
+        size_t end = levelEnds.back();
+        for (size_t first = begin; first < end; first += NODE_SIZE) {
+            MinMax box = boxes[first];
+            for (size_t child = first + 1; child < std::min(first + NODE_SIZE, end); child++)
+                extend(box, boxes[child]);
+            boxes.push_back(box);
+            indices.push_back(first);
+        }
+        begin = end;
+        levelEnds.push_back(boxes.size());
+    }
+}
+
+std::vector<uint32_t> PackedRTree::query(const MinMax& area) const {
+    std::vector<uint32_t> result;
+    if (items == 0)
+        return result;
+    std::vector<size_t> pending = {boxes.size() - 1};
+    while (!pending.empty()) {
+        size_t node = pending.back();
+        pending.pop_back();
+        if (!intersects(boxes[node], area))
+            continue;
+        if (node < items) {
+            result.push_back(indices[node]);
+            continue;
+        }
+        // Children sit on the level below, which ends where this node's level begins
+        size_t level = std::upper_bound(levelEnds.begin(), levelEnds.end(), node) - levelEnds.begin();
+        size_t childrenEnd = std::min<size_t>(indices[node] + NODE_SIZE, levelEnds[level - 1]);
+        for (size_t child = indices[node]; child < childrenEnd; child++)
+            pending.push_back(child);
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+size_t PackedRTree::size() const {
+    return items;
+}
+
+size_t PackedRTree::getMemory() const {
+    return boxes.capacity() * sizeof(MinMax) + indices.capacity() * sizeof(uint32_t);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Static R-tree over item bounding boxes, packed bottom-up after sorting
+ * the items along a Hilbert curve through their centers, so neighbouring
+ * items share nodes and queries touch few of them. Nodes live in two flat
+ * arrays, leaves first and the root last, and refer to their children by
+ * position: no pointers, so the arrays could be written out and mapped
+ * back as they are. Immutable after construction and safe to query from
+ * any number of threads.
+ */
+class PackedRTree {
+public:
+    static const int NODE_SIZE = 16;
+
+    // Items are identified by their position in boxes
+    explicit PackedRTree(const std::vector<MinMax>& boxes);
+
+    // Ascending ids of the items whose box intersects area, borders included
+    std::vector<uint32_t> query(const MinMax& area) const;
+
+    size_t size() const;
+
+    size_t getMemory() const;
+
+private:
+    size_t items;
+    std::vector<MinMax> boxes;
+    // Of a leaf, the item id; of an inner node, the position of its first child
+    std::vector<uint32_t> indices;
+    // One past the last node of each level, from the leaves up
+    std::vector<size_t> levelEnds;
+};
@@ -0,0 +1,159 @@
+#include "run_journal.h"
+
+#include "grid.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+    void makeDirectory(const std::string& path) {
+        if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+            throw std::runtime_error("Can't create directory " + path);
+    }
+
+    // Writes all of data to fd and syncs it
+    bool writeSynced(int fd, const std::string& data) {
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t result = write(fd, data.data() + written, data.size() - written);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result <= 0)
+                return false;
+            written += result;
+        }
+        return fsync(fd) == 0;
+    }
+
+    // Tile files a crashed run left half written, which no journal line refers to
+    void removeTemporaries(const std::string& dir) {
+        DIR* listing = opendir(dir.c_str());
+        if (!listing)
+            return;
+        while (dirent* entry = readdir(listing)) {
+            std::string name = entry->d_name;
+            if (name.find(".png.tmp") != std::string::npos)
+                std::remove((dir + "/" + name).c_str());
+        }
+        closedir(listing);
+    }
+
+    uLong checksum(const std::string& data) {
+        return crc32(crc32(0, Z_NULL, 0), reinterpret_cast<const Bytef*>(data.data()), data.size());
+    }
+}
+
+RunJournal::RunJournal(const std::string& dir_) :
+    dir(dir_),
+    fd(-1)
+{
+    makeDirectory(dir);
+    makeDirectory(dir + "/tiles");
+    removeTemporaries(dir + "/tiles");
+    read();
+    compact();
+    fd = open(journalPath().c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0)
+        throw std::runtime_error("Can't open " + journalPath());
+}
+
+RunJournal::~RunJournal() {
+    if (fd >= 0)
+        close(fd);
+}
+
+std::string RunJournal::tilePath(int x, int y) const {
+    return dir + "/tiles/" + Grid::tileFileName(x, y);
+}
+
+std::string RunJournal::journalPath() const {
+    return dir + "/journal";
+}
+
+void RunJournal::read() {
+    std::ifstream file(journalPath());
+    std::string line;
+    while (std::getline(file, line)) {
+        // Only a line that made it whole to disk ends with a newline
+        if (file.eof())
+            break;
+        std::istringstream fields(line);
+        std::string tag;
+        int x, y;
+        Entry entry;
+        if (fields >> tag >> x >> y >> entry.key >> entry.bytes >> entry.crc && tag == "tile")
+            entries[{x, y}] = entry;
+    }
+}
+
+// Rewrites the journal with one line per tile, dropping those of earlier runs that were redone
+void RunJournal::compact() {
+    std::ostringstream lines;
+    for (const auto& item: entries)
+        lines << "tile " << item.first.first << " " << item.first.second << " " << item.second.key << " "
+              << item.second.bytes << " " << item.second.crc << "\n";
+    std::string tmpName = journalPath() + ".tmp";
+    int tmp = open(tmpName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (tmp < 0)
+        throw std::runtime_error("Can't write " + tmpName);
+    bool written = writeSynced(tmp, lines.str());
+    close(tmp);
+    if (!written || std::rename(tmpName.c_str(), journalPath().c_str()) != 0)
+        throw std::runtime_error("Can't write " + journalPath());
+}
+
+bool RunJournal::load(int x, int y, const std::string& key, QImage* image) const {
+    Entry entry;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = entries.find({x, y});
+        if (found == entries.end())
+            return false;
+        entry = found->second;
+    }
+    if (!key.empty() && entry.key != key)
+        return false;
+    std::ifstream file(tilePath(x, y), std::ios::in | std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (data.size() != entry.bytes || checksum(data) != entry.crc)
+        return false;
+    return image->loadFromData(reinterpret_cast<const uchar*>(data.data()), int(data.size()), "PNG");
+}
+
+void RunJournal::record(int x, int y, const std::string& key, const std::string& png) {
+    std::ostringstream tmpName;
+    tmpName << tilePath(x, y) << ".tmp" << std::this_thread::get_id();
+    int tmp = open(tmpName.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (tmp < 0)
+        throw std::runtime_error("Can't write " + tmpName.str());
+    bool written = writeSynced(tmp, png);
+    close(tmp);
+    if (!written || std::rename(tmpName.str().c_str(), tilePath(x, y).c_str()) != 0) {
+        std::remove(tmpName.str().c_str());
+        throw std::runtime_error("Can't write " + tilePath(x, y));
+    }
+
+    Entry entry = {key, png.size(), checksum(png)};
+    std::ostringstream line;
+    line << "tile " << x << " " << y << " " << entry.key << " " << entry.bytes << " " << entry.crc << "\n";
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!writeSynced(fd, line.str()))
+        throw std::runtime_error("Can't append to " + journalPath());
+    entries[{x, y}] = entry;
+}
+
+size_t RunJournal::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+}
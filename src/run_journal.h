@@ -0,0 +1,57 @@
+#pragma once
+
+#include <QImage>
+
+#include <zlib.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+/*
+ * Run directory of a batch render, so a crashed or killed run resumes
+ * where it stopped. Finished tiles are DIR/tiles/imgX-Y.png, and
+ * DIR/journal gets one line per tile once its file is complete:
+ *
+ *   tile X Y KEY BYTES CRC32
+ *
+ * KEY being the tileKey of the parameters it was rendered with. A line is
+ * appended with a single write and synced; a torn last line is ignored, as
+ * is a tile whose file doesn't match its line. The last line of a tile wins.
+ * Tile files a crashed run left half written are removed on opening.
+ */
+class RunJournal {
+public:
+    explicit RunJournal(const std::string& dir);
+    ~RunJournal();
+
+    /*
+     * Reads the tile into image when it was recorded with key, or with any
+     * key when key is empty, and its file is intact.
+     */
+    bool load(int x, int y, const std::string& key, QImage* image) const;
+
+    // Stores the encoded tile and records it; thread-safe
+    void record(int x, int y, const std::string& key, const std::string& png);
+
+    // Tiles recorded, by this run or earlier ones
+    size_t size() const;
+
+private:
+    struct Entry {
+        std::string key;
+        size_t bytes;
+        uLong crc;
+    };
+
+    std::string tilePath(int x, int y) const;
+    std::string journalPath() const;
+    void read();
+    void compact();
+
+    std::string dir;
+    int fd;
+    std::map<std::pair<int, int>, Entry> entries;
+    mutable std::mutex mutex;
+};
@@ -0,0 +1,108 @@
+#include "scheduler.h"
+
+#include <algorithm>
+
+namespace {
+    // Index of the worker running on this thread in its pool, -1 elsewhere
+    thread_local const ThreadPool* currentPool = nullptr;
+    thread_local int currentWorker = -1;
+}
+
+ThreadPool::ThreadPool(int threadCount) :
+    queued(0),
+    unfinished(0),
+    stopping(false),
+    nextQueue(0)
+{
+    if (threadCount <= 0)
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < threadCount; i++)
+        queues.emplace_back(new Queue);
+    for (int i = 0; i < threadCount; i++)
+        threads.emplace_back(&ThreadPool::run, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this]{ return unfinished == 0; });
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for (auto& thread: threads)
+        thread.join();
+}
+
+int ThreadPool::size() const {
+    return threads.size();
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    int index = currentPool == this ? currentWorker : nextQueue++ % queues.size();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        unfinished++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(queues[index]->mutex);
+        queues[index]->tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queued++;
+    }
+    wakeup.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]{ return unfinished == 0; });
+    if (error) {
+        auto e = error;
+        error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+bool ThreadPool::takeTask(int index, std::function<void()>& task) {
+    for (size_t i = 0; i < queues.size(); i++) {
+        Queue& queue = *queues[(index + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::run(int index) {
+    currentPool = this;
+    currentWorker = index;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeup.wait(lock, [this]{ return stopping || queued > 0; });
+            if (queued == 0)
+                return;
+            queued--;
+        }
+        // A task counted in `queued` is in some queue until someone takes it
+        std::function<void()> task;
+        while (!takeTask(index, task))
+            std::this_thread::yield();
+        try {
+            task();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error)
+                error = std::current_exception();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            unfinished--;
+        }
+        done.notify_all();
+    }
+}
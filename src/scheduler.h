@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Fixed-size thread pool with a task queue per worker. Tasks submitted
+ * from outside are spread round-robin, tasks submitted from a worker go
+ * to its own queue; a worker that runs dry steals from the others. Every
+ * queue is served oldest first, so tasks start roughly in submit order.
+ */
+class ThreadPool {
+public:
+    // threads <= 0 means one thread per core
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+
+    void submit(std::function<void()> task);
+
+    // Blocks until every submitted task has finished; rethrows the first exception a task threw
+    void wait();
+
+    int size() const;
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool takeTask(int index, std::function<void()>& task);
+    void run(int index);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wakeup, done;
+    int queued;
+    int unfinished;
+    bool stopping;
+    std::atomic<unsigned> nextQueue;
+    std::exception_ptr error;
+};
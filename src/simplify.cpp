@@ -0,0 +1,200 @@
+#include "simplify.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+namespace {
+    double squaredDistance(const QPointF& p, const QPointF& a, const QPointF& b) {
+        double dx = b.x() - a.x(), dy = b.y() - a.y();
+        double length = dx * dx + dy * dy;
+        double t = length > 0 ? ((p.x() - a.x()) * dx + (p.y() - a.y()) * dy) / length : 0;
+        t = std::max(0.0, std::min(1.0, t));
+        double ex = a.x() + t * dx - p.x(), ey = a.y() + t * dy - p.y();
+        return ex * ex + ey * ey;
+    }
+
+    // Marks the points strictly between first and last that Douglas-Peucker keeps
+    void mark(const QPointF* points, size_t first, size_t last, double tolerance, simplify::Scratch& scratch) {
+        double limit = tolerance * tolerance;
+        // An explicit stack, since long coastlines would recurse thousands of levels deep
+        auto& ranges = scratch.ranges;
+        ranges.clear();
+        ranges.push_back({first, last});
+        while (!ranges.empty()) {
+            auto range = ranges.back();
+            ranges.pop_back();
+            double farthest = limit;
+            size_t index = 0;
+            for (size_t i = range.first + 1; i < range.second; i++) {
+                double distance = squaredDistance(points[i], points[range.first], points[range.second]);
+                if (distance > farthest) {
+                    farthest = distance;
+                    index = i;
+                }
+            }
+            if (index == 0)
+                continue;
+            scratch.keep[index] = 1;
+            ranges.push_back({range.first, index});
+            ranges.push_back({index, range.second});
+        }
+    }
+
+    bool same(const QPointF& a, const QPointF& b) {
+        return a.x() == b.x() && a.y() == b.y();
+    }
+
+    // Sign of the turn a-b-c
+    int orientation(const QPointF& a, const QPointF& b, const QPointF& c) {
+        double cross = (b.x() - a.x()) * (c.y() - a.y()) - (b.y() - a.y()) * (c.x() - a.x());
+        return (cross > 0) - (cross < 0);
+    }
+
+    // Whether segments a-b and c-d cross at a point inside both; touching doesn't count
+    bool cross(const QPointF& a, const QPointF& b, const QPointF& c, const QPointF& d) {
+        if (std::max(a.x(), b.x()) < std::min(c.x(), d.x()) || std::max(c.x(), d.x()) < std::min(a.x(), b.x())
+                || std::max(a.y(), b.y()) < std::min(c.y(), d.y()) || std::max(c.y(), d.y()) < std::min(a.y(), b.y()))
+            return false;
+        return orientation(a, b, c) * orientation(a, b, d) < 0 && orientation(c, d, a) * orientation(c, d, b) < 0;
+    }
+
+    /*
+     * Keeps the farthest dropped point of every shortcut between kept points
+     * of a wrapped ring that crosses another kept edge, until none does.
+     * Each pass keeps at least one more point, and edges of the original
+     * ring are never shortcuts, so it ends. Quadratic in the kept points.
+     */
+    void uncross(const QPointF* wrapped, size_t count, simplify::Scratch& scratch) {
+        auto& kept = scratch.kept;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            kept.clear();
+            for (size_t i = 0; i < count; i++)
+                if (scratch.keep[i])
+                    kept.push_back(i);
+            size_t edges = kept.size() - 1;
+            for (size_t e = 0; e < edges; e++) {
+                size_t from = kept[e], to = kept[e + 1];
+                if (to - from < 2)
+                    continue;
+                for (size_t f = 0; f < edges; f++) {
+                    // Edges sharing a vertex, the first and the last ones included, can't cross
+                    bool adjacent = f + 1 >= e && f <= e + 1;
+                    if (adjacent || (e == 0 && f == edges - 1) || (f == 0 && e == edges - 1))
+                        continue;
+                    if (!cross(wrapped[from], wrapped[to], wrapped[kept[f]], wrapped[kept[f + 1]]))
+                        continue;
+                    double farthest = -1;
+                    size_t index = from + 1;
+                    for (size_t i = from + 1; i < to; i++) {
+                        double distance = squaredDistance(wrapped[i], wrapped[from], wrapped[to]);
+                        if (distance > farthest) {
+                            farthest = distance;
+                            index = i;
+                        }
+                    }
+                    scratch.keep[index] = 1;
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Of a ring without the closing point; positive when counter-clockwise in y-up coordinates
+    double signedArea(const QPointF* ring, size_t count) {
+        double area = 0;
+        for (size_t i = 0; i < count; i++) {
+            const QPointF& a = ring[i];
+            const QPointF& b = ring[(i + 1) % count];
+            area += a.x() * b.y() - b.x() * a.y();
+        }
+        return area / 2;
+    }
+}
+
+namespace simplify {
+
+size_t polyline(QPointF* points, size_t count, Scratch& scratch, double tolerance) {
+    if (count <= 2)
+        return count;
+    scratch.keep.assign(count, 0);
+    scratch.keep[0] = scratch.keep[count - 1] = 1;
+    mark(points, 0, count - 1, tolerance, scratch);
+    // Every kept point moves only towards the front, so compacting in place is safe
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++)
+        if (scratch.keep[i])
+            points[kept++] = points[i];
+    return kept;
+}
+
+size_t ring(QPointF* points, size_t count, Scratch& scratch, double tolerance) {
+    bool closed = count > 1 && same(points[0], points[count - 1]);
+    size_t open = count - (closed ? 1 : 0);
+    if (open < 4)
+        return count;
+
+    // Split at the first point and the one farthest from it, then treat the halves as polylines
+    size_t opposite = 0;
+    double farthest = -1;
+    for (size_t i = 1; i < open; i++) {
+        double dx = points[i].x() - points[0].x(), dy = points[i].y() - points[0].y();
+        if (dx * dx + dy * dy > farthest) {
+            farthest = dx * dx + dy * dy;
+            opposite = i;
+        }
+    }
+    // A copy of the open ring and its closing point, to mark from and to restore a rejected result
+    auto& wrapped = scratch.ring;
+    wrapped.assign(points, points + open);
+    wrapped.push_back(points[0]);
+    scratch.keep.assign(open + 1, 0);
+    scratch.keep[0] = scratch.keep[opposite] = scratch.keep[open] = 1;
+    mark(wrapped.data(), 0, opposite, tolerance, scratch);
+    mark(wrapped.data(), opposite, open, tolerance, scratch);
+    uncross(wrapped.data(), open + 1, scratch);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < open; i++)
+        if (scratch.keep[i])
+            points[kept++] = wrapped[i];
+    double before = signedArea(wrapped.data(), open), after = signedArea(points, kept);
+    if (kept < 3 || before * after <= 0 || std::abs(after) < std::abs(before) / 2) {
+        std::copy(wrapped.begin(), wrapped.begin() + open, points);
+        return count;
+    }
+    if (closed)
+        points[kept++] = points[0];
+    return kept;
+}
+
+QPainterPath dropClose(const QPainterPath& path, double threshold) {
+    QPainterPath result;
+    QPointF lastAddedPoint(-1e10, -1e10);
+    QPointF lastPoint(-1e10, -1e10);
+    for (int i = 0; i < path.elementCount(); i++) {
+        auto element = path.elementAt(i);
+        if (element.isMoveTo()) {
+            if (lastPoint.x() > -1e-9) {
+                result.lineTo(lastPoint);
+            }
+            result.moveTo(element.x, element.y);
+            lastAddedPoint = QPointF(element.x, element.y);
+        } else {
+            double dist = std::hypot(element.x - lastAddedPoint.x(), element.y - lastAddedPoint.y());
+            if (dist > threshold) {
+                result.lineTo(element.x, element.y);
+                lastPoint = QPointF(element.x, element.y);
+            }
+        }
+        lastPoint = QPointF(element.x, element.y);
+    }
+    result.lineTo(lastPoint);
+    return result;
+}
+
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <QPainterPath>
+#include <QPointF>
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/*
+ * Vertex reduction shared by the OSM layers. Handlers simplify every way
+ * and ring right after projecting it to pixels, before it is stroked or
+ * united, so the stroker and the boolean ops only see the vertices the
+ * tile resolution can show. Working in pixels ties the tolerance to the
+ * tile's scale: TOLERANCE pixels are TOLERANCE / scale projected meters.
+ * Points are reduced in place, with working space the caller keeps
+ * between ways.
+ */
+namespace simplify {
+    // Farthest a simplified line may stray from the original, in pixels
+    const double TOLERANCE = 0.5;
+
+    // Working space of polyline() and ring(), reused from way to way
+    struct Scratch {
+        std::vector<char> keep;
+        std::vector<std::pair<size_t, size_t>> ranges;
+        std::vector<QPointF> ring;
+        std::vector<size_t> kept;
+    };
+
+    // Douglas-Peucker in place; the end points are kept. Returns how many points are left.
+    size_t polyline(QPointF* points, size_t count, Scratch& scratch, double tolerance = TOLERANCE);
+
+    // Douglas-Peucker in place on a closed ring, which stays closed. A shortcut
+    // that would cross another edge keeps its farthest dropped point, so the
+    // result crosses itself only where the ring did. A ring is never reduced
+    // below a triangle nor allowed to flip its orientation or lose most of its
+    // area; such rings are left unchanged. Returns how many points are left.
+    size_t ring(QPointF* points, size_t count, Scratch& scratch, double tolerance = TOLERANCE);
+
+    // Drops the points closer than threshold to the last kept one, a
+    // stylistic coarsening with no bound on the distance to the original
+    QPainterPath dropClose(const QPainterPath& path, double threshold);
+}
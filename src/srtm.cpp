@@ -1,5 +1,8 @@
 #include "srtm.h"
+#include "metrics.h"
+#include "trace.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <fstream>
 
@@ -8,6 +11,34 @@
 
 namespace {
     static const int SRTMSize = 3601;
+
+    // Bump on any change to smoothing, gradients or cvPaint::paintGrads
+    const int STYLE_VERSION = 2;
+
+    DemSmoothing smoothing = DemSmoothing::BILATERAL;
+    int smoothingThreads = 0;
+    const DemMosaic* mosaic = nullptr;
+
+    // Mosaic samples read beyond the tile for the smoothing, the gradients and the interpolation
+    const int MOSAIC_MARGIN = 16;
+    const int GEO_BOUNDS_STEPS = 16;
+
+    // Part of a mosaic level a tile reads
+    struct Window {
+        int level;
+        int x0, y0, width, height;
+    };
+
+    Window mosaicWindow(const DemMosaic& mosaic, const MinMax& geo, int imageSize) {
+        Window window;
+        window.level = mosaic.levelFor(std::min(geo.maxx - geo.minx, geo.maxy - geo.miny) / imageSize);
+        double spacing = mosaic.spacing(window.level);
+        window.x0 = std::floor((geo.minx - mosaic.getWest()) / spacing) - MOSAIC_MARGIN;
+        window.y0 = std::floor((mosaic.getNorth() - geo.maxy) / spacing) - MOSAIC_MARGIN;
+        window.width = std::ceil((geo.maxx - mosaic.getWest()) / spacing) + MOSAIC_MARGIN - window.x0 + 1;
+        window.height = std::ceil((mosaic.getNorth() - geo.miny) / spacing) + MOSAIC_MARGIN - window.y0 + 1;
+        return window;
+    }
 }
 
 SRTMProvider::SRTMProvider(const Projector& proj_) : 
@@ -15,19 +46,58 @@ SRTMProvider::SRTMProvider(const Projector& proj_) :
 {}
     
 const SRTMProvider::Heights& SRTMProvider::getHeights(int x, int y) {
-    if (heights.count({x,y}) == 0)
-        heights[{x,y}] = loadHeights(x,y);
-    return heights[{x,y}];
+    // Loading under the lock also keeps two tiles from downloading the same cell
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = heights.find({x,y});
+    if (found != heights.end()) {
+        metrics::dem().hits.add();
+        return found->second;
+    }
+    metrics::dem().misses.add();
+    return heights[{x,y}] = loadHeights(x,y);
+}
+
+std::vector<float> SRTMProvider::sample(const std::vector<point>& lonLat) {
+    static const int STEPS = SRTMSize - 1;
+    size_t count = lonLat.size();
+    std::vector<float> result(count);
+    // Cell of every point and where in it the point lies, in samples from its north-west corner
+    std::vector<int> cellX(count), cellY(count);
+    std::vector<double> fx(count), fy(count);
+    for (size_t i = 0; i < count; i++) {
+        double x = std::floor(lonLat[i].x), y = std::floor(lonLat[i].y);
+        cellX[i] = x;
+        cellY[i] = y;
+        fx[i] = (lonLat[i].x - x) * STEPS;
+        fy[i] = (y + 1 - lonLat[i].y) * STEPS;
+    }
+    const Heights* heights = nullptr;
+    for (size_t i = 0; i < count; i++) {
+        if (!heights || cellX[i] != cellX[i - 1] || cellY[i] != cellY[i - 1])
+            heights = &getHeights(cellX[i], cellY[i]);
+        // A point on the south edge of its cell is on the last row of samples
+        int x0 = std::min(int(fx[i]), STEPS - 1), y0 = std::min(int(fy[i]), STEPS - 1);
+        float tx = fx[i] - x0, ty = fy[i] - y0;
+        const auto& west = (*heights)[x0];
+        const auto& east = (*heights)[x0 + 1];
+        // Samples are stored as read, big-endian int16 taken unsigned
+        float northWest = int16_t(uint16_t(west[y0])), northEast = int16_t(uint16_t(east[y0]));
+        float southWest = int16_t(uint16_t(west[y0 + 1])), southEast = int16_t(uint16_t(east[y0 + 1]));
+        float north = northWest + (northEast - northWest) * tx;
+        float south = southWest + (southEast - southWest) * tx;
+        result[i] = north + (south - north) * ty;
+    }
+    return result;
+}
+
+std::vector<float> SRTMProvider::sampleProjected(const std::vector<point>& projected) {
+    std::vector<point> lonLat = projected;
+    proj.invertTransform(lonLat);
+    return sample(lonLat);
 }
 
-int16_t SRTMProvider::getHeight(double x, double y) {
-    int xx = std::floor(x);
-    int yy = std::floor(y);
-    const Heights& thisHeights = getHeights(xx, yy);
-    int fx = (x - xx) * SRTMSize;
-    int fy = (1 - (y - yy)) * SRTMSize;
-    //std::cout << "getHeight(" << x << " " << y << "   " << xx << " " << yy << "    " << fx << " " << fy << std::endl;
-    return thisHeights[fx][fy];
+float SRTMProvider::getHeight(double x, double y) {
+    return sample({{x, y}})[0];
 }
 
 SRTMProvider::Heights SRTMProvider::loadHeights(std::string filename) {
@@ -52,7 +122,17 @@ SRTMProvider::Heights SRTMProvider::loadHeights(std::string filename) {
     return heights;
 }
     
+std::string SRTMProvider::cellFile(int x, int y) {
+    return "srtm/" + cellName(x, y) + ".hgt";
+}
+
 SRTMProvider::Heights SRTMProvider::loadHeights(int x, int y) {
+    std::string filename = cellName(x, y);
+    system(("./download_srtm.sh " + filename).c_str());
+    return loadHeights(cellFile(x, y));
+}
+
+std::string SRTMProvider::cellName(int x, int y) {
     char cx='E', cy='N';
     if (x < 0) {
         x = -x;
@@ -64,14 +144,12 @@ SRTMProvider::Heights SRTMProvider::loadHeights(int x, int y) {
     }
     char filename[8];
     snprintf(filename, 8, "%c%02d%c%03d", cy, y, cx, x);
-    
-    system((std::string("./download_srtm.sh ") + filename).c_str());
-    
-    return loadHeights(std::string("srtm/") + filename + ".hgt");
+    return filename;
 }
 
 SRTMtoCV::SRTMtoCV(const Projector& proj_, const MinMax& minmax_, int imageSize_) : 
-    provider(proj_),
+    ownProvider(new SRTMProvider(proj_)),
+    provider(*ownProvider),
     minmax(minmax_),
     proj(proj_),
     imageSize(imageSize_)
@@ -79,47 +157,142 @@ SRTMtoCV::SRTMtoCV(const Projector& proj_, const MinMax& minmax_, int imageSize_
     calc();
 }
 
-void SRTMtoCV::calc() {
-    MinMax floorMinMax;
+SRTMtoCV::SRTMtoCV(SRTMProvider& provider_, const Projector& proj_, const MinMax& minmax_, int imageSize_) :
+    provider(provider_),
+    minmax(minmax_),
+    proj(proj_),
+    imageSize(imageSize_)
+{
+    calc();
+}
+
+std::vector<std::string> SRTMtoCV::cellFiles(const Projector& proj, const MinMax& minmax) {
+    if (mosaic)
+        return {mosaic->getFilename()};
+    point minp = proj.invertTransform({minmax.minx, minmax.miny});
+    point maxp = proj.invertTransform({minmax.maxx, minmax.maxy});
+    std::vector<std::string> files;
+    for (int x = floor(minp.x); x <= floor(maxp.x); x++)
+        for (int y = floor(minp.y); y <= floor(maxp.y); y++)
+            files.push_back(SRTMProvider::cellFile(x, y));
+    return files;
+}
+
+std::string SRTMtoCV::styleKey() {
+    std::string key = "hills:" + std::to_string(STYLE_VERSION);
+    // The reference smoothing keeps the keys it always had
+    if (smoothing != DemSmoothing::BILATERAL)
+        key += ":" + demSmooth::name(smoothing);
+    return key;
+}
+
+void SRTMtoCV::setMosaic(const DemMosaic* mosaic_) {
+    mosaic = mosaic_;
+}
+
+MinMax SRTMtoCV::geoBounds(const Projector& proj, const MinMax& minmax) {
+    MinMax result;
+    result.minx = result.miny = 1e9;
+    result.maxx = result.maxy = -1e9;
+    for (int i = 0; i <= GEO_BOUNDS_STEPS; i++) {
+        double x = minmax.minx + (minmax.maxx - minmax.minx) * i / GEO_BOUNDS_STEPS;
+        double y = minmax.miny + (minmax.maxy - minmax.miny) * i / GEO_BOUNDS_STEPS;
+        for (point border: {point{x, minmax.miny}, point{x, minmax.maxy}, point{minmax.minx, y}, point{minmax.maxx, y}}) {
+            point p = proj.invertTransform(border);
+            result.minx = std::min(result.minx, p.x);
+            result.maxx = std::max(result.maxx, p.x);
+            result.miny = std::min(result.miny, p.y);
+            result.maxy = std::max(result.maxy, p.y);
+        }
+    }
+    return result;
+}
+
+size_t SRTMtoCV::estimateMemory(const Projector& proj, const MinMax& minmax, int imageSize) {
+    // Copies of the source: itself and its smoothed copy with the smoothing's scratch, then the two gradients
+    size_t filtering = std::max<size_t>(4, 2 + demSmooth::scratch(smoothing));
+    // heights, gradients and remap tables per pixel
+    size_t pixels = size_t(imageSize) * imageSize * sizeof(float) * 5;
+    if (mosaic) {
+        // Pages of the mapped file are the kernel's to drop
+        Window window = mosaicWindow(*mosaic, geoBounds(proj, minmax), imageSize);
+        return filtering * size_t(window.width) * window.height * sizeof(float) + pixels;
+    }
     point minp = proj.invertTransform({minmax.minx, minmax.miny});
-    floorMinMax.minx = floor(minp.x);
-    floorMinMax.miny = floor(minp.y);
     point maxp = proj.invertTransform({minmax.maxx, minmax.maxy});
-    floorMinMax.maxx = floor(maxp.x);
-    floorMinMax.maxy = floor(maxp.y);
-    cv::Mat source(
-        (SRTMSize-1) * (floorMinMax.maxy-floorMinMax.miny+1) + 1,
-        (SRTMSize-1) * (floorMinMax.maxx-floorMinMax.minx+1) + 1,
-        CV_32FC1,
-        -1
-    );
-    for (int x = floorMinMax.minx; x<=floorMinMax.maxx; x++) {
-        for (int y = floorMinMax.miny; y<=floorMinMax.maxy; y++) {
-            const Heights& heights = provider.getHeights(x, y);
-            for (int dx = 0; dx < SRTMSize; dx++) {
-                for (int dy = 0; dy < SRTMSize; dy++) {
-                    int nx = (x-floorMinMax.minx)*(SRTMSize-1)+dx;
-                    int ny = (floorMinMax.maxy-y)*(SRTMSize-1)+dy;
-                    source.at<float>(ny, nx) = heights[dx][dy];
+    size_t cellsX = floor(maxp.x) - floor(minp.x) + 1;
+    size_t cellsY = floor(maxp.y) - floor(minp.y) + 1;
+    size_t cells = cellsX * cellsY * SRTMSize * SRTMSize * sizeof(int32_t);
+    size_t source = ((SRTMSize-1) * cellsX + 1) * ((SRTMSize-1) * cellsY + 1) * sizeof(float);
+    return cells + filtering * source + pixels;
+}
+
+void SRTMtoCV::calc() {
+    trace::Span load("dem.load");
+    cv::Mat source;
+    // Lon and lat of source sample (0, 0), samples per degree, and level 0 samples per source sample
+    double originLon, originLat, samplesPerDegree;
+    int sampleStep = 1;
+    if (mosaic) {
+        Window window = mosaicWindow(*mosaic, geoBounds(proj, minmax), imageSize);
+        source = mosaic->read(window.level, window.x0, window.y0, window.width, window.height);
+        double spacing = mosaic->spacing(window.level);
+        originLon = mosaic->getWest() + window.x0 * spacing;
+        originLat = mosaic->getNorth() - window.y0 * spacing;
+        samplesPerDegree = 1 / spacing;
+        sampleStep = 1 << window.level;
+    } else {
+        MinMax floorMinMax;
+        point minp = proj.invertTransform({minmax.minx, minmax.miny});
+        floorMinMax.minx = floor(minp.x);
+        floorMinMax.miny = floor(minp.y);
+        point maxp = proj.invertTransform({minmax.maxx, minmax.maxy});
+        floorMinMax.maxx = floor(maxp.x);
+        floorMinMax.maxy = floor(maxp.y);
+        source = cv::Mat(
+            (SRTMSize-1) * (floorMinMax.maxy-floorMinMax.miny+1) + 1,
+            (SRTMSize-1) * (floorMinMax.maxx-floorMinMax.minx+1) + 1,
+            CV_32FC1,
+            -1
+        );
+        for (int x = floorMinMax.minx; x<=floorMinMax.maxx; x++) {
+            for (int y = floorMinMax.miny; y<=floorMinMax.maxy; y++) {
+                const Heights& heights = provider.getHeights(x, y);
+                for (int dx = 0; dx < SRTMSize; dx++) {
+                    for (int dy = 0; dy < SRTMSize; dy++) {
+                        int nx = (x-floorMinMax.minx)*(SRTMSize-1)+dx;
+                        int ny = (floorMinMax.maxy-y)*(SRTMSize-1)+dy;
+                        source.at<float>(ny, nx) = heights[dx][dy];
+                    }
                 }
             }
         }
+        originLon = floorMinMax.minx;
+        originLat = floorMinMax.maxy + 1;
+        samplesPerDegree = SRTMSize;
     }
-    cv::Mat sourceSmoothed;
-    cv::bilateralFilter(source, sourceSmoothed, -1, 10, 5);
-    source = sourceSmoothed;
+    load.end();
+    trace::Span smoothing("dem.smooth");
+    source = smooth(source, sampleStep);
+    smoothing.end();
     //writeMatrix(source, "source");
     
     //paint(source).save("source.png");
     
-    cv::Mat sourceXgrad;
-    Sobel(source, sourceXgrad, -1, 1, 0, 5);
-    cv::Mat sourceYgrad;
-    Sobel(source, sourceYgrad, -1, 0, 1, 5);
+    trace::Span gradient("dem.gradients");
+    cv::Mat sourceXgrad, sourceYgrad;
+    gradients(source, sourceXgrad, sourceYgrad);
+    // Per level 0 sample, which is what the hills are painted for
+    if (sampleStep > 1) {
+        sourceXgrad /= sampleStep;
+        sourceYgrad /= sampleStep;
+    }
+    gradient.end();
 
     //paint(sourceXgrad).save("sourceXgrad.png");
     //paint(sourceYgrad).save("sourceYgrad.png");
     
+    TRACE_SCOPE("dem.remap");
     cvHeights.create(imageSize, imageSize, CV_32FC1);
     cv::Mat trX(cvHeights.rows, cvHeights.cols, CV_32FC1, -1);
     cv::Mat trY(cvHeights.rows, cvHeights.cols, CV_32FC1, -1);
@@ -128,8 +301,8 @@ void SRTMtoCV::calc() {
             double rx = (minmax.minx + 1.0*x/cvHeights.cols*(minmax.maxx-minmax.minx));
             double ry = (minmax.maxy - 1.0*y/cvHeights.rows*(minmax.maxy-minmax.miny));
             point p = proj.invertTransform({rx, ry});
-            double fx = (p.x - floorMinMax.minx) * SRTMSize;
-            double fy = (floorMinMax.maxy + 1 - p.y) * SRTMSize;
+            double fx = (p.x - originLon) * samplesPerDegree;
+            double fy = (originLat - p.y) * samplesPerDegree;
             trX.at<float>(y, x) = fx;
             trY.at<float>(y, x) = fy;
         }
@@ -144,6 +317,23 @@ void SRTMtoCV::calc() {
     //writeMatrix(cvHeights, "cvHeights");
 }
 
+void SRTMtoCV::setSmoothing(DemSmoothing mode) {
+    smoothing = mode;
+}
+
+void SRTMtoCV::setSmoothingThreads(int threads) {
+    smoothingThreads = threads;
+}
+
+cv::Mat SRTMtoCV::smooth(const cv::Mat& source, int step) {
+    return demSmooth::apply(source, smoothing, smoothingThreads, step);
+}
+
+void SRTMtoCV::gradients(const cv::Mat& source, cv::Mat& xGrad, cv::Mat& yGrad) {
+    Sobel(source, xGrad, -1, 1, 0, 5);
+    Sobel(source, yGrad, -1, 0, 1, 5);
+}
+
 cv::Mat SRTMtoCV::getCvHeights() {
     return cvHeights;
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "common.h"
+#include "dem_mosaic.h"
+#include "dem_smooth.h"
 
 #include <QImage>
 
@@ -8,7 +10,12 @@
 #include "opencv2/imgproc/imgproc.hpp"
 
 #include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
+// Loads DEM cells on first use and keeps them; safe to share between threads
 class SRTMProvider {
 public:
     typedef std::vector<std::vector<int32_t>> Heights;
@@ -17,16 +24,34 @@ public:
     
     const Heights& getHeights(int x, int y);
 
-    int16_t getHeight(double x, double y);
+    /*
+     * Heights at lon/lat points, interpolated bilinearly between the four
+     * samples around each; cells share their edge samples, so this holds
+     * across cell borders too. Consecutive points in one cell share its
+     * lookup, so nearby points are best passed in order. Thread-safe.
+     */
+    std::vector<float> sample(const std::vector<point>& lonLat);
+
+    // sample() at projected points
+    std::vector<float> sampleProjected(const std::vector<point>& projected);
+
+    // sample() of one point at lon x, lat y
+    float getHeight(double x, double y);
+
+    // File of the one-degree cell with south-west corner at lon x, lat y
+    static std::string cellFile(int x, int y);
     
 private:
     
     const Projector& proj;
     std::map<std::pair<int, int>, Heights> heights;
+    std::mutex mutex;
     
     Heights loadHeights(std::string filename);
     
     Heights loadHeights(int x, int y);
+
+    static std::string cellName(int x, int y);
 };
 
 class SRTMtoCV {
@@ -35,16 +60,54 @@ public:
     
     SRTMtoCV(const Projector& proj_, const MinMax& minmax_, int imageSize_);
 
+    // Reads the cells through a provider that outlives the tile, so they are loaded once
+    SRTMtoCV(SRTMProvider& provider_, const Projector& proj_, const MinMax& minmax_, int imageSize_);
+
+    // Peak bytes calc() needs for this tile, DEM cells included
+    static size_t estimateMemory(const Projector& proj, const MinMax& minmax, int imageSize);
+
     void calc();
+
+    // Smoothing of every tile from then on; set before rendering starts
+    static void setSmoothing(DemSmoothing mode);
+
+    /*
+     * Threads each tile smooths on from then on; <= 0, the default, means
+     * one per core, for tiles rendered one at a time. Set before rendering
+     * starts.
+     */
+    static void setSmoothingThreads(int threads);
+
+    /*
+     * Tiles read their window of mosaic from then on, at the coarsest level
+     * finer than their pixels, instead of whole cells; null to go back to
+     * the cells. Set before rendering starts.
+     */
+    static void setMosaic(const DemMosaic* mosaic);
+
+    // Lon/lat box of a projected area, from points along its border
+    static MinMax geoBounds(const Projector& proj, const MinMax& minmax);
+
+    // The steps of calc() on the DEM grid, before it is remapped to the tile
+    static cv::Mat smooth(const cv::Mat& source, int step = 1);
+
+    static void gradients(const cv::Mat& source, cv::Mat& xGrad, cv::Mat& yGrad);
     
     cv::Mat getCvHeights();
     
     cv::Mat getXGrad();
     
     cv::Mat getYGrad();
+
+    // Files of the DEM cells the tile reads, or the mosaic
+    static std::vector<std::string> cellFiles(const Projector& proj, const MinMax& minmax);
+
+    // Changes whenever the look of the hills layer does, for the tile cache
+    static std::string styleKey();
     
 private:
-    SRTMProvider provider;
+    std::unique_ptr<SRTMProvider> ownProvider;
+    SRTMProvider& provider;
     const MinMax& minmax;
     const Projector& proj;
     cv::Mat cvHeights;
@@ -0,0 +1,127 @@
+#include "tile_cache.h"
+
+#include <zlib.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace {
+    const char MAGIC[4] = {'D', 'M', 'L', 'C'};
+    const int COMPRESSION_LEVEL = 1;
+    // Larger than any tile; a bigger side means a corrupt header
+    const int32_t MAX_SIDE = 1 << 15;
+
+    struct Header {
+        char magic[4];
+        int32_t width, height, format;
+        uint64_t compressedSize;
+    };
+
+    uint64_t fnv1a(const std::string& data, uint64_t hash) {
+        for (unsigned char c: data) {
+            hash ^= c;
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    // Formats layers are drawn in, all of them 4 bytes per pixel
+    bool knownFormat(int32_t format) {
+        return format == QImage::Format_RGB32 || format == QImage::Format_ARGB32
+               || format == QImage::Format_ARGB32_Premultiplied;
+    }
+}
+
+TileCache::TileCache(const std::string& directory_) :
+    directory(directory_)
+{
+    mkdir(directory.c_str(), 0755);
+}
+
+std::string TileCache::path(const std::string& key) const {
+    return directory + "/" + key + ".layer";
+}
+
+bool TileCache::load(const std::string& key, QImage& image) const {
+    std::ifstream file(path(key), std::ios::in|std::ios::binary);
+    if (!file)
+        return false;
+    file.seekg(0, std::ios::end);
+    uint64_t length = file.tellg();
+    file.seekg(0);
+    Header header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::string(header.magic, 4) != std::string(MAGIC, 4))
+        return false;
+    // Checked before allocating anything, so a corrupt entry is a miss and not a huge allocation
+    if (header.width <= 0 || header.width > MAX_SIDE || header.height <= 0 || header.height > MAX_SIDE
+            || !knownFormat(header.format))
+        return false;
+    if (header.compressedSize != length - sizeof(header)
+            || header.compressedSize > compressBound(uLong(header.width) * header.height * 4))
+        return false;
+    std::vector<unsigned char> compressed(header.compressedSize);
+    if (!file.read(reinterpret_cast<char*>(compressed.data()), compressed.size()))
+        return false;
+    QImage result(header.width, header.height, static_cast<QImage::Format>(header.format));
+    uLongf size = size_t(result.bytesPerLine()) * result.height();
+    if (uncompress(result.bits(), &size, compressed.data(), compressed.size()) != Z_OK
+            || size != size_t(result.bytesPerLine()) * result.height())
+        return false;
+    image = result;
+    return true;
+}
+
+void TileCache::store(const std::string& key, const QImage& image) const {
+    size_t size = size_t(image.bytesPerLine()) * image.height();
+    uLongf compressedSize = compressBound(size);
+    std::vector<unsigned char> compressed(compressedSize);
+    if (compress2(compressed.data(), &compressedSize, image.constBits(), size, COMPRESSION_LEVEL) != Z_OK) {
+        throw std::runtime_error("Can't compress cache entry " + key);
+    }
+    Header header;
+    std::copy(MAGIC, MAGIC + 4, header.magic);
+    header.width = image.width();
+    header.height = image.height();
+    header.format = image.format();
+    header.compressedSize = compressedSize;
+
+    std::ostringstream tmpName;
+    tmpName << path(key) << ".tmp" << std::this_thread::get_id();
+    {
+        std::ofstream file(tmpName.str(), std::ios::out|std::ios::binary|std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(compressed.data()), compressedSize);
+        if (!file) {
+            throw std::runtime_error("Can't write cache entry " + tmpName.str());
+        }
+    }
+    if (std::rename(tmpName.str().c_str(), path(key).c_str()) != 0) {
+        throw std::runtime_error("Can't rename cache entry " + tmpName.str());
+    }
+}
+
+std::string TileCache::hash(const std::string& description) {
+    std::ostringstream result;
+    result << std::hex << std::setfill('0')
+           << std::setw(16) << fnv1a(description, 14695981039346656037ULL)
+           << std::setw(16) << fnv1a(std::string(description.rbegin(), description.rend()), 14695981039346656037ULL);
+    return result.str();
+}
+
+std::string TileCache::fileIdentity(const std::string& path) {
+    std::ostringstream result;
+    result << path;
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0)
+        result << ":" << info.st_size << ":" << info.st_mtime;
+    return result.str();
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <QImage>
+
+#include <string>
+
+/*
+ * On-disk cache of layer images, addressed by a hash of everything the
+ * image depends on. Entries are zlib-compressed raw pixels, written to a
+ * temporary file and renamed, so concurrent tiles and interrupted runs
+ * never see a partial entry.
+ */
+class TileCache {
+public:
+    explicit TileCache(const std::string& directory);
+
+    bool load(const std::string& key, QImage& image) const;
+
+    void store(const std::string& key, const QImage& image) const;
+
+    // 128-bit hex digest of the description
+    static std::string hash(const std::string& description);
+
+    // Path, size and modification time; just the path for a missing file
+    static std::string fileIdentity(const std::string& path);
+
+private:
+    std::string path(const std::string& key) const;
+
+    std::string directory;
+};
@@ -0,0 +1,224 @@
+#include "tile_server.h"
+
+#include "scheduler.h"
+
+#include <QImage>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+    // Half the side of the web mercator square, in projected meters
+    const double MERCATOR_HALF = 20037508.342789244;
+    const int MAX_ZOOM = 24;
+    const size_t MAX_REQUEST = 8192;
+    // Every cell is 52 MB of heights kept for the server's lifetime
+    const size_t MAX_DEM_CELLS = 16;
+
+    void sendAll(int connection, const std::string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t count = send(connection, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return;
+            sent += count;
+        }
+    }
+
+    void respond(int connection, int status, const std::string& reason, const std::string& type, const std::string& body) {
+        std::string header = "HTTP/1.0 " + std::to_string(status) + " " + reason + "\r\n"
+            + "Content-Type: " + type + "\r\n"
+            + "Content-Length: " + std::to_string(body.size()) + "\r\n"
+            + "Access-Control-Allow-Origin: *\r\n"
+            + "Connection: close\r\n\r\n";
+        sendAll(connection, header + body);
+    }
+
+    // Path of a GET request line, without the query string; empty if the request is not a GET
+    std::string requestPath(const std::string& request) {
+        if (request.compare(0, 4, "GET ") != 0)
+            return "";
+        size_t end = request.find_first_of(" ?\r\n", 4);
+        return request.substr(4, end == std::string::npos ? std::string::npos : end - 4);
+    }
+}
+
+TileServer::TileServer(const Options& options_, const Projector& proj_) :
+    options(options_),
+    proj(proj_),
+    dem(proj_),
+    png(options_.png),
+    lruBytes(0)
+{
+    if (needsOsm(withDependencies(options.layers)))
+        features.reset(new FeatureStore(options.osmFile, proj));
+    if (!options.cacheDir.empty())
+        cache.reset(new TileCache(options.cacheDir));
+    // Tiles are small and requests already run in parallel
+    png.threads = 1;
+}
+
+void TileServer::run() {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) {
+        throw std::runtime_error(std::string("Can't create socket: ") + strerror(errno));
+    }
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options.servePort);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        close(listener);
+        throw std::runtime_error("Can't listen on port " + std::to_string(options.servePort) + ": " + strerror(errno));
+    }
+    std::cout << "Serving on http://127.0.0.1:" << options.servePort << "/tile/{z}/{x}/{y}.png" << std::endl;
+
+    ThreadPool pool(options.jobs);
+    // Requests already run in parallel, so each tile composites on its share of the cores
+    setCompositeThreads(std::max(1, int(std::thread::hardware_concurrency()) / pool.size()));
+    while (true) {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            close(listener);
+            throw std::runtime_error(std::string("Can't accept connection: ") + strerror(errno));
+        }
+        pool.submit([this, connection] {
+            handle(connection);
+            close(connection);
+        });
+    }
+}
+
+void TileServer::handle(int connection) {
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < MAX_REQUEST) {
+        ssize_t count = recv(connection, buffer, sizeof(buffer), 0);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            break;
+        request.append(buffer, count);
+    }
+    std::string path = requestPath(request);
+    static const std::string SUFFIX = ".png";
+    std::string name = path.size() > SUFFIX.size() && path.compare(path.size() - SUFFIX.size(), SUFFIX.size(), SUFFIX) == 0
+        ? path.substr(0, path.size() - SUFFIX.size()) : "";
+
+    int z, x, y;
+    double minLon, minLat, maxLon, maxLat;
+    // Anything after the numbers lands in tail and rejects the path
+    char tail;
+    std::string key;
+    MinMax minmax;
+    int xTile = 0, yTile = 0;
+    if (sscanf(name.c_str(), "/tile/%d/%d/%d%c", &z, &x, &y, &tail) == 3
+            && z >= 0 && z <= MAX_ZOOM && x >= 0 && y >= 0 && x < (1 << z) && y < (1 << z)) {
+        double size = 2 * MERCATOR_HALF / (1 << z);
+        minmax.minx = -MERCATOR_HALF + x * size;
+        minmax.maxx = minmax.minx + size;
+        minmax.maxy = MERCATOR_HALF - y * size;
+        minmax.miny = minmax.maxy - size;
+        key = "tile/" + std::to_string(z) + "/" + std::to_string(x) + "/" + std::to_string(y);
+        xTile = x;
+        yTile = y;
+    } else if (sscanf(name.c_str(), "/bbox/%lf,%lf,%lf,%lf%c", &minLon, &minLat, &maxLon, &maxLat, &tail) == 4
+            && minLon < maxLon && minLat < maxLat) {
+        point min = proj.transform({minLon, minLat});
+        point max = proj.transform({maxLon, maxLat});
+        double half = std::max(max.x - min.x, max.y - min.y) / 2;
+        point center = {(min.x + max.x) / 2, (min.y + max.y) / 2};
+        minmax.minx = center.x - half;
+        minmax.maxx = center.x + half;
+        minmax.miny = center.y - half;
+        minmax.maxy = center.y + half;
+        key = path;
+    } else {
+        respond(connection, 404, "Not Found", "text/plain", "Unknown path " + path + "\n");
+        return;
+    }
+
+    if (SRTMtoCV::cellFiles(proj, minmax).size() > MAX_DEM_CELLS) {
+        respond(connection, 400, "Bad Request", "text/plain", "Area of " + path + " is too large\n");
+        return;
+    }
+
+    try {
+        respond(connection, 200, "OK", "image/png", getTile(key, minmax, xTile, yTile));
+    } catch (const std::exception& e) {
+        std::cerr << "Can't render " << key << ": " << e.what() << std::endl;
+        respond(connection, 500, "Internal Server Error", "text/plain", std::string(e.what()) + "\n");
+    }
+}
+
+std::string TileServer::getTile(const std::string& key, const MinMax& minmax, int xTile, int yTile) {
+    std::promise<std::string> promise;
+    std::shared_future<std::string> result;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto cached = lruIndex.find(key);
+        if (cached != lruIndex.end()) {
+            lru.splice(lru.begin(), lru, cached->second);
+            return cached->second->second;
+        }
+        auto rendering = inFlight.find(key);
+        if (rendering != inFlight.end()) {
+            result = rendering->second;
+        } else {
+            inFlight[key] = promise.get_future().share();
+        }
+    }
+    if (result.valid())
+        return result.get();
+
+    std::string png;
+    try {
+        png = render(minmax, xTile, yTile);
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        promise.set_exception(std::current_exception());
+        inFlight.erase(key);
+        throw;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    promise.set_value(png);
+    inFlight.erase(key);
+    lru.emplace_front(key, png);
+    lruIndex[key] = lru.begin();
+    lruBytes += png.size();
+    size_t capacity = size_t(options.lruMegabytes) << 20;
+    while (lruBytes > capacity && lru.size() > 1) {
+        lruBytes -= lru.back().second.size();
+        lruIndex.erase(lru.back().first);
+        lru.pop_back();
+    }
+    return png;
+}
+
+std::string TileServer::render(const MinMax& minmax, int xTile, int yTile) {
+    SharedInputs shared;
+    shared.features = features.get();
+    shared.dem = &dem;
+    QImage image;
+    drawTile(&image, options.osmFile, proj, minmax, options.imageSize, xTile, yTile, cache.get(), shared, options.layers);
+    return encodePng(image, png);
+}
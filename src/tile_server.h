@@ -0,0 +1,59 @@
+#pragma once
+
+#include "common.h"
+#include "options.h"
+#include "osm_main.h"
+#include "render.h"
+#include "srtm.h"
+#include "tile_cache.h"
+
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+/*
+ * Serves rendered tiles over HTTP on localhost, for slippy-map viewers:
+ *
+ *   GET /tile/Z/X/Y.png                          web mercator tile
+ *   GET /bbox/MINLON,MINLAT,MAXLON,MAXLAT.png    square tile centered on the box
+ *
+ * Tiles are options.imageSize pixels of options.layers. The OSM features
+ * (unless the layers don't need them) and the DEM cells are loaded once
+ * and shared by all requests, encoded tiles are kept in an
+ * LRU of options.lruMegabytes, and concurrent requests for the same tile
+ * wait for a single render.
+ */
+class TileServer {
+public:
+    TileServer(const Options& options, const Projector& proj);
+
+    // Accepts connections until the process is killed
+    void run();
+
+private:
+    typedef std::list<std::pair<std::string, std::string>> Lru;
+
+    void handle(int connection);
+
+    // Encoded PNG for key, rendering minmax if it is neither cached nor being rendered
+    std::string getTile(const std::string& key, const MinMax& minmax, int xTile, int yTile);
+
+    std::string render(const MinMax& minmax, int xTile, int yTile);
+
+    const Options& options;
+    const Projector& proj;
+    std::unique_ptr<FeatureStore> features;
+    SRTMProvider dem;
+    std::unique_ptr<TileCache> cache;
+    PngOptions png;
+
+    std::mutex mutex;
+    Lru lru;
+    std::map<std::string, Lru::iterator> lruIndex;
+    size_t lruBytes;
+    std::map<std::string, std::shared_future<std::string>> inFlight;
+};
@@ -0,0 +1,227 @@
+#include "trace.h"
+
+#include "metrics.h"
+
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+namespace trace {
+    std::atomic<bool> active(false);
+}
+
+namespace {
+    const size_t RESERVED_EVENTS = 4096;
+    const int NO_TILE = std::numeric_limits<int>::min();
+
+    std::atomic<bool> recording(false), measuring(false), profiling(false);
+
+    void updateActive() {
+        trace::active.store(recording.load(std::memory_order_relaxed) || measuring.load(std::memory_order_relaxed)
+                            || profiling.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    struct Event {
+        const char* name;
+        int64_t start, duration;
+        int tileX, tileY;
+        std::string args;
+    };
+
+    // Only its own thread appends; the lock is for write() reading it meanwhile
+    struct Buffer {
+        std::mutex mutex;
+        std::vector<Event> events;
+        int thread;
+    };
+
+    std::mutex registryMutex;
+    std::vector<std::shared_ptr<Buffer>>& registry() {
+        static std::vector<std::shared_ptr<Buffer>> buffers;
+        return buffers;
+    }
+
+    const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+    thread_local int currentX = NO_TILE, currentY = NO_TILE;
+
+    Buffer& localBuffer() {
+        // Buffers stay registered after their thread exits so its events are still written
+        thread_local std::shared_ptr<Buffer> buffer;
+        if (!buffer) {
+            buffer = std::make_shared<Buffer>();
+            buffer->events.reserve(RESERVED_EVENTS);
+            std::lock_guard<std::mutex> lock(registryMutex);
+            buffer->thread = registry().size() + 1;
+            registry().push_back(buffer);
+        }
+        return *buffer;
+    }
+
+    void writeString(std::ostream& out, const char* value) {
+        out << trace::jsonString(value);
+    }
+}
+
+namespace trace {
+    std::string jsonString(const std::string& value) {
+        std::string result = "\"";
+        for (char c: value) {
+            if (c == '"' || c == '\\') {
+                result += '\\';
+                result += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                result += escaped;
+            } else {
+                result += c;
+            }
+        }
+        return result + "\"";
+    }
+
+    void enable(bool on) {
+        recording.store(on, std::memory_order_relaxed);
+        updateActive();
+    }
+
+    void measure(bool on) {
+        measuring.store(on, std::memory_order_relaxed);
+        updateActive();
+    }
+
+    void profileMemory(bool on) {
+        profiling.store(on, std::memory_order_relaxed);
+        heap::enable(on);
+        updateActive();
+    }
+
+    int64_t now() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    void record(const char* name, int64_t start, int64_t duration, const std::string& args) {
+        if (measuring.load(std::memory_order_relaxed))
+            metrics::stage(name).observe(duration);
+        if (!recording.load(std::memory_order_relaxed))
+            return;
+        Buffer& buffer = localBuffer();
+        std::lock_guard<std::mutex> lock(buffer.mutex);
+        buffer.events.push_back({name, start, duration, currentX, currentY, args});
+    }
+
+    const char* intern(const std::string& name) {
+        static std::mutex mutex;
+        static std::set<std::string> names;
+        std::lock_guard<std::mutex> lock(mutex);
+        return names.insert(name).first->c_str();
+    }
+
+    void write(const std::string& filename) {
+        std::ofstream out(filename);
+        if (!out) {
+            throw std::runtime_error("Can't open file " + filename);
+        }
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        std::vector<std::shared_ptr<Buffer>> buffers;
+        {
+            std::lock_guard<std::mutex> lock(registryMutex);
+            buffers = registry();
+        }
+        for (const auto& buffer: buffers) {
+            std::lock_guard<std::mutex> lock(buffer->mutex);
+            out << (first ? "" : ",") << "\n{\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->thread
+                << ",\"name\":\"thread_name\",\"args\":{\"name\":\"thread " << buffer->thread << "\"}}";
+            first = false;
+            for (const auto& event: buffer->events) {
+                out << ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->thread << ",\"name\":";
+                writeString(out, event.name);
+                out << ",\"ts\":" << event.start << ",\"dur\":" << event.duration << ",\"args\":{";
+                bool hasTile = event.tileX != NO_TILE;
+                if (hasTile)
+                    out << "\"tile\":\"" << event.tileX << "," << event.tileY << "\"";
+                if (!event.args.empty())
+                    out << (hasTile ? "," : "") << event.args;
+                out << "}}";
+            }
+        }
+        out << "\n]}\n";
+        if (!out) {
+            throw std::runtime_error("Can't write data to file " + filename);
+        }
+    }
+
+    std::map<std::string, int64_t> totals() {
+        std::map<std::string, int64_t> result;
+        std::lock_guard<std::mutex> registryLock(registryMutex);
+        for (const auto& buffer: registry()) {
+            std::lock_guard<std::mutex> lock(buffer->mutex);
+            for (const auto& event: buffer->events)
+                result[event.name] += event.duration;
+        }
+        return result;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> registryLock(registryMutex);
+        for (const auto& buffer: registry()) {
+            std::lock_guard<std::mutex> lock(buffer->mutex);
+            buffer->events.clear();
+        }
+    }
+
+    TileScope::TileScope(int x_, int y_) :
+        x(x_),
+        y(y_),
+        previousX(currentX),
+        previousY(currentY),
+        // Nested scopes of the same tile report it once
+        profiled(profiling.load(std::memory_order_relaxed) && previousX == NO_TILE)
+    {
+        currentX = x;
+        currentY = y;
+        if (profiled)
+            probe.start();
+    }
+
+    TileScope::~TileScope() {
+        if (profiled)
+            heap::addTile(x, y, probe.finish());
+        currentX = previousX;
+        currentY = previousY;
+    }
+
+    void Span::begin() {
+        start = now();
+        profiled = profiling.load(std::memory_order_relaxed);
+        if (profiled)
+            probe.start();
+    }
+
+    void Span::finish() {
+        int64_t duration = now() - start;
+        if (!profiled) {
+            record(name, start, duration);
+            return;
+        }
+        heap::Sample sample = probe.finish();
+        heap::addStage(name, sample);
+        if (!recording.load(std::memory_order_relaxed)) {
+            record(name, start, duration);
+            return;
+        }
+        std::ostringstream args;
+        args << "\"heap_peak_mb\":" << sample.heapPeak / double(1 << 20)
+             << ",\"rss_mb\":" << (sample.rss >> 20)
+             << ",\"raised_peak_rss_mb\":" << (sample.peakRssGrowth >> 20);
+        record(name, start, duration, args.str());
+    }
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "heap_profile.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+
+/*
+ * Scoped timing spans, exported as Chrome trace JSON (chrome://tracing,
+ * ui.perfetto.dev). Each thread appends to its own buffer, so a span costs
+ * two clock reads and an uncontended lock when tracing is on and a relaxed
+ * load when it is off. Span durations can also feed the per-stage latency
+ * histograms of metrics.h and probe the heap for heap_profile.h, with or
+ * without the trace. Span names must be
+ * string literals or otherwise outlive the trace.
+ */
+namespace trace {
+    // Set while spans are either recorded or measured
+    extern std::atomic<bool> active;
+
+    inline bool enabled() {
+        return active.load(std::memory_order_relaxed);
+    }
+
+    // Records spans for write() and totals()
+    void enable(bool on);
+
+    // Adds span durations to metrics::stage()
+    void measure(bool on);
+
+    // Counts allocations and adds the heap high-water mark of every span and tile to the heap profile
+    void profileMemory(bool on);
+
+    // Microseconds since the trace clock started
+    int64_t now();
+
+    // Quoted and escaped for a JSON string, for args built from run-time text
+    std::string jsonString(const std::string& value);
+
+    // Records or measures a finished span on the calling thread; args is a JSON object body or empty
+    void record(const char* name, int64_t start, int64_t duration, const std::string& args = "");
+
+    // A copy of name that lives as long as the process, for span names built at run time
+    const char* intern(const std::string& name);
+
+    // Writes everything recorded so far
+    void write(const std::string& filename);
+
+    // Microseconds spent in each span name over everything recorded so far
+    std::map<std::string, int64_t> totals();
+
+    // Drops everything recorded so far
+    void clear();
+
+    // Tags the spans of the calling thread with a tile until destroyed
+    class TileScope {
+    public:
+        TileScope(int x, int y);
+        ~TileScope();
+
+    private:
+        int x, y;
+        int previousX, previousY;
+        bool profiled;
+        heap::Probe probe;
+    };
+
+    class Span {
+    public:
+        explicit Span(const char* name_) :
+            name(name_),
+            start(-1),
+            profiled(false)
+        {
+            if (enabled())
+                begin();
+        }
+
+        ~Span() {
+            end();
+        }
+
+        // Ends the span early, for stages that follow each other in one scope
+        void end() {
+            if (start >= 0)
+                finish();
+            start = -1;
+        }
+
+    private:
+        void begin();
+        void finish();
+
+        const char* name;
+        int64_t start;
+        bool profiled;
+        heap::Probe probe;
+    };
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) trace::Span TRACE_CONCAT(traceSpan, __LINE__)(name)